@@ -0,0 +1,149 @@
+/**
+ * \file adc_filter.h
+ *
+ * \brief Rejects single conversion spikes, from the LM324 output or SPI
+ *        glitches, by reading the ADC in bursts of ADC_BURST_N conversions
+ *        and keeping the median or a trimmed mean.
+ *
+ * A burst is sorted with a fixed sorting network for its size, whose
+ * compare-exchanges compile to conditional moves, so filtering takes the
+ * same time whatever the data. The middle samples, all but ADC_TRIM at
+ * each end, are averaged, leaving out any of them further than
+ * ADC_OUTLIER_COUNTS from the median:
+ *
+ *     ADC_TRIM = ADC_BURST_N / 2     the median (the default)
+ *     ADC_TRIM = 1                   drops the lowest and the highest
+ *     ADC_TRIM = 0                   the mean of the samples near the median
+ *
+ * Every sample further than ADC_OUTLIER_COUNTS from the median is counted
+ * as a rejected outlier, as is every burst with one.
+ *
+ * \note The burst size is fixed at compile time, -DADC_BURST_N=1, 3, 5, 7
+ *       or 9; 1 reads the ADC once a tick, unfiltered, as before.
+ */
+#ifndef ADC_FILTER_H
+#define ADC_FILTER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#ifndef ADC_BURST_N
+#define ADC_BURST_N 5
+#endif
+#ifndef ADC_TRIM
+#define ADC_TRIM (ADC_BURST_N / 2)
+#endif
+#ifndef ADC_OUTLIER_COUNTS
+#define ADC_OUTLIER_COUNTS 16   // about 2.4 C with the LM35 and 5 V reference
+#endif
+
+#if ADC_BURST_N != 1 && ADC_BURST_N != 3 && ADC_BURST_N != 5 && \
+    ADC_BURST_N != 7 && ADC_BURST_N != 9
+#error "ADC_BURST_N must be 1, 3, 5, 7 or 9"
+#endif
+#if ADC_TRIM < 0 || 2 * ADC_TRIM >= ADC_BURST_N
+#error "ADC_TRIM must leave at least one sample"
+#endif
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct adc_filter {
+    uint64_t bursts;
+    uint64_t outliers;          // samples rejected
+    uint64_t spiky;             // bursts with at least one rejected sample
+    unsigned int median;        // of the last burst
+};
+
+/////////////////////////////////////////////////////////////////////
+// Functions
+/////////////////////////////////////////////////////////////////////
+
+// Orders v[i] and v[j], without a branch
+#define ADC_CSWAP(v, i, j)                                                  \
+    do {                                                                    \
+        unsigned int a_ = (v)[i], b_ = (v)[j];                              \
+        (v)[i] = a_ < b_ ? a_ : b_;                                         \
+        (v)[j] = a_ < b_ ? b_ : a_;                                         \
+    } while (0)
+
+/**
+ * \brief Sorts a burst in place with the optimal sorting network for its
+ *        size
+ */
+void adc_sort(unsigned int* v)
+{
+#if ADC_BURST_N == 3
+    ADC_CSWAP(v, 1, 2); ADC_CSWAP(v, 0, 2); ADC_CSWAP(v, 0, 1);
+#elif ADC_BURST_N == 5
+    ADC_CSWAP(v, 0, 1); ADC_CSWAP(v, 3, 4); ADC_CSWAP(v, 2, 4);
+    ADC_CSWAP(v, 2, 3); ADC_CSWAP(v, 0, 3); ADC_CSWAP(v, 0, 2);
+    ADC_CSWAP(v, 1, 4); ADC_CSWAP(v, 1, 3); ADC_CSWAP(v, 1, 2);
+#elif ADC_BURST_N == 7
+    ADC_CSWAP(v, 1, 2); ADC_CSWAP(v, 3, 4); ADC_CSWAP(v, 5, 6);
+    ADC_CSWAP(v, 0, 2); ADC_CSWAP(v, 3, 5); ADC_CSWAP(v, 4, 6);
+    ADC_CSWAP(v, 0, 1); ADC_CSWAP(v, 4, 5); ADC_CSWAP(v, 2, 6);
+    ADC_CSWAP(v, 0, 4); ADC_CSWAP(v, 1, 5); ADC_CSWAP(v, 0, 3);
+    ADC_CSWAP(v, 2, 5); ADC_CSWAP(v, 1, 3); ADC_CSWAP(v, 2, 4);
+    ADC_CSWAP(v, 2, 3);
+#elif ADC_BURST_N == 9
+    ADC_CSWAP(v, 0, 1); ADC_CSWAP(v, 3, 4); ADC_CSWAP(v, 6, 7);
+    ADC_CSWAP(v, 1, 2); ADC_CSWAP(v, 4, 5); ADC_CSWAP(v, 7, 8);
+    ADC_CSWAP(v, 0, 1); ADC_CSWAP(v, 3, 4); ADC_CSWAP(v, 6, 7);
+    ADC_CSWAP(v, 0, 3); ADC_CSWAP(v, 3, 6); ADC_CSWAP(v, 0, 3);
+    ADC_CSWAP(v, 1, 4); ADC_CSWAP(v, 4, 7); ADC_CSWAP(v, 1, 4);
+    ADC_CSWAP(v, 2, 5); ADC_CSWAP(v, 5, 8); ADC_CSWAP(v, 2, 5);
+    ADC_CSWAP(v, 1, 3); ADC_CSWAP(v, 5, 7); ADC_CSWAP(v, 2, 6);
+    ADC_CSWAP(v, 4, 6); ADC_CSWAP(v, 2, 4); ADC_CSWAP(v, 2, 3);
+    ADC_CSWAP(v, 5, 6);
+#else
+    (void)v;
+#endif
+}
+
+/**
+ * \brief Filters a burst of conversions
+ *
+ * \param f   the filter of the channel, for its counters
+ * \param v   ADC_BURST_N raw conversions, sorted in place
+ *
+ * \returns The filtered value, in ADC counts
+ */
+double adc_filter_burst(struct adc_filter* f, unsigned int* v)
+{
+    unsigned int median, sum = 0, kept = 0, rejected = 0;
+    int i;
+    adc_sort(v);
+    median = v[ADC_BURST_N / 2];
+    for (i = 0; i < ADC_BURST_N; i++) {
+        unsigned int d = v[i] > median ? v[i] - median : median - v[i];
+        unsigned int keep = d <= ADC_OUTLIER_COUNTS;
+        unsigned int in = i >= ADC_TRIM && i < ADC_BURST_N - ADC_TRIM;
+        rejected += !keep;
+        sum += v[i] & -(keep & in);
+        kept += keep & in;
+    }
+    f->bursts++;
+    f->outliers += rejected;
+    f->spiky += rejected > 0;
+    f->median = median;
+    // the median is always kept
+    return (double)sum / kept;
+}
+
+/**
+ * \brief Prints the outlier counters of a channel
+ */
+void adc_filter_print_stats(const struct adc_filter* f, int zone)
+{
+    printf("adc: zone %d %llu bursts of %d, %llu outliers rejected in %llu "
+           "bursts\n", zone, (unsigned long long)f->bursts, ADC_BURST_N,
+           (unsigned long long)f->outliers, (unsigned long long)f->spiky);
+}
+
+#endif
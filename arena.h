@@ -0,0 +1,310 @@
+/**
+ * \file arena.h
+ *
+ * \brief A single block of memory, sized and mapped at startup, that the
+ *        runtime structures of the control loop are carved from, so the
+ *        loop never calls malloc() and never faults a page in.
+ *
+ * Mapping the block is cheap, so the structures can be carved out early.
+ * arena_populate() then faults in every page and locks them with mlock() when
+ * the limits allow it, so every page is resident before the loop runs.
+ * Allocations bump an offset and are never freed, the whole arena goes at
+ * exit. Any thread may allocate, so the logger can carve out an encoder the
+ * first time a zone logs.
+ *
+ * Programs built with -DARENA_GUARD also replace malloc() and friends. Once
+ * a thread calls arena_guard_arm(), every allocation or free it makes is
+ * counted, and the first one is reported at exit. With ARENA_GUARD=abort in
+ * the environment the program aborts on it instead, for a core dump or a
+ * debugger to show where it came from:
+ *
+ *     ARENA_GUARD=abort gdb -ex run --args ./temp_control_guard 45
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define ARENA_ALIGN   64        // default alignment, a cache line
+
+// Space to reserve for an allocation, whatever padding its alignment takes
+#define ARENA_SIZE(bytes, align)   ((bytes) + (align) - 1)
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct arena {
+    char* base;
+    size_t size;
+    size_t used;                // bumped atomically by arena_alloc()
+    int locked;                 // the pages are locked in memory
+    uint64_t allocs;
+    uint64_t failed;            // allocations that did not fit
+};
+
+/////////////////////////////////////////////////////////////////////
+// Functions
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Maps an arena, leaving its pages to arena_populate()
+ *
+ * \param a      the arena
+ * \param size   the bytes it holds, rounded up to whole pages
+ *
+ * \returns 0 on success, -1 if the memory can't be mapped
+ */
+int arena_init(struct arena* a, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    memset(a, 0, sizeof(*a));
+    a->size = (size + page - 1) / page * page;
+    a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (a->base == MAP_FAILED) {
+        printf("arena: can't map %zu bytes\n", a->size);
+        a->base = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Faults in every page of an arena and locks them in memory
+ */
+void arena_populate(struct arena* a)
+{
+    size_t page = sysconf(_SC_PAGESIZE), off;
+    if (a->base == NULL) {
+        return;
+    }
+    // without CAP_IPC_LOCK this fails past RLIMIT_MEMLOCK, the pages are then
+    // faulted in by hand but could be swapped out
+    a->locked = mlock(a->base, a->size) == 0;
+    if (!a->locked) {
+        for (off = 0; off < a->size; off += page) {
+            ((volatile char*)a->base)[off] = a->base[off];
+        }
+    }
+}
+
+/**
+ * \brief Carves zeroed memory out of an arena
+ *
+ * \param a       the arena
+ * \param size    the bytes wanted
+ * \param align   their alignment, a power of 2 no larger than a page
+ *
+ * \returns The memory, or NULL if the arena is full
+ */
+void* arena_alloc(struct arena* a, size_t size, size_t align)
+{
+    size_t used = __atomic_load_n(&a->used, __ATOMIC_RELAXED);
+    size_t start;
+    do {
+        start = (used + align - 1) & ~(align - 1);
+        if (a->base == NULL || start + size > a->size) {
+            __atomic_fetch_add(&a->failed, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&a->used, &used, start + size, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    __atomic_fetch_add(&a->allocs, 1, __ATOMIC_RELAXED);
+    // the pages came zeroed from mmap and nothing is ever handed out twice
+    return a->base + start;
+}
+
+// Carves out n objects of a type, at its alignment or a cache line's
+#define ARENA_NEW(a, type, n)                                               \
+    ((type*)arena_alloc((a), (n) * sizeof(type),                            \
+                        __alignof__(type) > ARENA_ALIGN ? __alignof__(type) \
+                                                        : ARENA_ALIGN))
+
+/**
+ * \brief Unmaps an arena, everything carved from it goes with it
+ */
+void arena_destroy(struct arena* a)
+{
+    if (a->base != NULL) {
+        munmap(a->base, a->size);
+        a->base = NULL;
+    }
+}
+
+/**
+ * \brief Prints how much of an arena was used
+ */
+void arena_print_stats(const struct arena* a)
+{
+    printf("arena: %zu of %zu bytes used in %llu allocations, %s",
+           a->used, a->size, (unsigned long long)a->allocs,
+           a->locked ? "locked" : "not locked");
+    if (a->failed > 0) {
+        printf(", %llu did not fit", (unsigned long long)a->failed);
+    }
+    printf("\n");
+}
+
+/////////////////////////////////////////////////////////////////////
+// Allocation guard
+/////////////////////////////////////////////////////////////////////
+
+#ifdef ARENA_GUARD
+
+// glibc's own allocator, which the replacements below hand everything to
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t align, size_t size);
+void __libc_free(void* ptr);
+
+__thread int arena_guard_armed = 0;
+int arena_guard_abort = 0;
+uint64_t arena_guard_allocs = 0;
+uint64_t arena_guard_frees = 0;
+const char* arena_guard_first = NULL;       // the call that was made first
+void* arena_guard_caller = NULL;            // and where it was made from
+
+/**
+ * \brief Counts a call made by an armed thread, or aborts on it
+ *
+ * \note Runs inside malloc(), so it must not allocate itself.
+ */
+void arena_guard_hit(const char* call, void* caller)
+{
+    if (arena_guard_abort) {
+        char msg[128];
+        int len = snprintf(msg, sizeof(msg), "arena: %s() called from %p "
+                           "after the control loop started\n", call, caller);
+        arena_guard_armed = 0;
+        if (write(STDERR_FILENO, msg, len) < 0) {
+            // aborting anyway
+        }
+        abort();
+    }
+    if (arena_guard_first == NULL) {
+        arena_guard_first = call;
+        arena_guard_caller = caller;
+    }
+}
+
+void* malloc(size_t size)
+{
+    if (arena_guard_armed) {
+        arena_guard_allocs++;
+        arena_guard_hit("malloc", __builtin_return_address(0));
+    }
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    if (arena_guard_armed) {
+        arena_guard_allocs++;
+        arena_guard_hit("calloc", __builtin_return_address(0));
+    }
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    if (arena_guard_armed) {
+        arena_guard_allocs++;
+        arena_guard_hit("realloc", __builtin_return_address(0));
+    }
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void** ptr, size_t align, size_t size)
+{
+    void* p;
+    if (arena_guard_armed) {
+        arena_guard_allocs++;
+        arena_guard_hit("posix_memalign", __builtin_return_address(0));
+    }
+    if ((p = __libc_memalign(align, size)) == NULL) {
+        return ENOMEM;
+    }
+    *ptr = p;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size)
+{
+    if (arena_guard_armed) {
+        arena_guard_allocs++;
+        arena_guard_hit("aligned_alloc", __builtin_return_address(0));
+    }
+    return __libc_memalign(align, size);
+}
+
+void free(void* ptr)
+{
+    if (arena_guard_armed && ptr != NULL) {
+        arena_guard_frees++;
+        arena_guard_hit("free", __builtin_return_address(0));
+    }
+    __libc_free(ptr);
+}
+
+/**
+ * \brief Starts guarding the calling thread against allocating
+ */
+void arena_guard_arm()
+{
+    const char* env = getenv("ARENA_GUARD");
+    arena_guard_abort = env != NULL && strcmp(env, "abort") == 0;
+    arena_guard_armed = 1;
+}
+
+/**
+ * \brief Stops guarding the calling thread
+ */
+void arena_guard_disarm()
+{
+    arena_guard_armed = 0;
+}
+
+/**
+ * \brief Prints what the guarded thread allocated and freed
+ */
+void arena_guard_print_stats()
+{
+    printf("arena: guard saw %llu allocations and %llu frees in the control "
+           "loop\n", (unsigned long long)arena_guard_allocs,
+           (unsigned long long)arena_guard_frees);
+    if (arena_guard_first != NULL) {
+        printf("arena: the first was %s() called from %p\n",
+               arena_guard_first, arena_guard_caller);
+    }
+}
+
+#else
+
+void arena_guard_arm()
+{
+}
+
+void arena_guard_disarm()
+{
+}
+
+void arena_guard_print_stats()
+{
+}
+
+#endif
+
+#endif
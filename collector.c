@@ -0,0 +1,420 @@
+/*  \file collector.c
+ *
+ *  \brief Host level view of every temp_control running on a machine: finds
+ *         their shared state pages, polls them at a fixed rate and merges
+ *         them into one host page and, optionally, one sample log.
+ *
+ *      ./temp_control -n rack1 -Z 17,0 -Z 18,1 45 &
+ *      ./temp_control -n rack2 50 &
+ *      ./collector -r 20 -l host_logs
+ *
+ *  Every temp_control started with -n is picked up within a rescan period of
+ *  creating its page (see shared_state.h). Each one is given a range of host
+ *  zone numbers the first time it is seen, which it keeps for the life of the
+ *  collector even if it restarts, so a zone's series in the merged log never
+ *  changes meaning. An instance that adds zones is given a larger range,
+ *  moved past the others if it can't grow in place. The ranges are recorded
+ *  in zones.txt in the log directory.
+ *
+ *  The host page is /dev/shm/temp_collector, a struct shared_host updated
+ *  under the same sequence lock as the instance pages. The merged log is in
+ *  the block format read by tsquery, with one sample per zone for every tick
+ *  of its instance seen by a poll.
+ *
+ *  \note Everything runs on one thread, and all memory is allocated at
+ *        startup: up to SHARED_HOST_INSTANCES instances and SHARED_HOST_ZONES
+ *        zones in total.
+ */
+
+#include <dirent.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "log_writer.h"
+#include "shared_state.h"
+
+volatile sig_atomic_t running = 1;
+
+/**
+ * \brief A temp_control the collector has seen
+ */
+struct source {
+    char name[32];
+    const struct shared_state* page;    // NULL while the page is gone
+    dev_t dev;
+    ino_t ino;
+    int first_zone;             // host zone of its zone 0, -1 if unassigned
+    unsigned nzones;            // host zones reserved
+    uint64_t last_updated;      // updated_us of the last tick logged
+    int seen;                   // found by the current scan
+    int warned;                 // already said it has too many zones
+};
+
+struct collector {
+    struct source sources[SHARED_HOST_INSTANCES];
+    int nsources;
+    unsigned nzones;            // host zones handed out
+    struct shared_host* host;
+    struct shared_state copy;
+
+    struct log_writer log;
+    int logging;
+    FILE* zone_map;
+
+    uint64_t polls;
+    uint64_t torn;              // pages that kept changing while read
+    uint64_t samples;
+};
+
+void int_handler(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+/**
+ * \brief Returns the current time of a clock in microseconds
+ */
+int64_t clock_us(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Discovery
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Returns the source with a name, adding it if it is new
+ *
+ * \returns The source, or NULL if there is no room for another
+ */
+struct source* find_source(struct collector* c, const char* name)
+{
+    struct source* s;
+    int i;
+    for (i = 0; i < c->nsources; i++) {
+        if (strcmp(c->sources[i].name, name) == 0) {
+            return &c->sources[i];
+        }
+    }
+    if (c->nsources == SHARED_HOST_INSTANCES) {
+        return NULL;
+    }
+    s = &c->sources[c->nsources++];
+    memset(s, 0, sizeof(*s));
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    s->first_zone = -1;
+    return s;
+}
+
+/**
+ * \brief Maps the pages of new instances and lets go of the ones that are
+ *        gone
+ */
+void scan(struct collector* c)
+{
+    size_t prefix = strlen(SHARED_STATE_PREFIX);
+    struct dirent* entry;
+    DIR* dir;
+    int i;
+
+    for (i = 0; i < c->nsources; i++) {
+        c->sources[i].seen = 0;
+    }
+    if ((dir = opendir(SHARED_STATE_DIR)) == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char path[512];
+        struct source* s;
+        struct stat st;
+        if (strncmp(entry->d_name, SHARED_STATE_PREFIX, prefix) != 0 ||
+            strlen(entry->d_name + prefix) >= sizeof(s->name) ||
+            (s = find_source(c, entry->d_name + prefix)) == NULL) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", SHARED_STATE_DIR,
+                 entry->d_name);
+        if (stat(path, &st) < 0) {
+            continue;
+        }
+        s->seen = 1;
+        // a restarted instance may have created a new file under the name
+        if (s->page != NULL && (s->dev != st.st_dev || s->ino != st.st_ino)) {
+            shared_state_close(s->page);
+            s->page = NULL;
+        }
+        if (s->page == NULL && (s->page = shared_state_open(path)) != NULL) {
+            s->dev = st.st_dev;
+            s->ino = st.st_ino;
+            printf("collector: found %s\n", s->name);
+        }
+    }
+    closedir(dir);
+    for (i = 0; i < c->nsources; i++) {
+        struct source* s = &c->sources[i];
+        if (!s->seen && s->page != NULL) {
+            shared_state_close(s->page);
+            s->page = NULL;
+            printf("collector: lost %s\n", s->name);
+        }
+    }
+    fflush(stdout);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Polling
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Gives a source its range of host zones the first time it is read,
+ *        and a larger one once it has more zones than that, after a reload
+ *
+ * \note The last range handed out grows in place. Any other moves past the
+ *       rest, and its old host zones are not used again.
+ */
+void assign_zones(struct collector* c, struct source* s, unsigned nzones)
+{
+    unsigned z, first = c->nzones;
+    if (s->first_zone >= 0 && s->first_zone + s->nzones == c->nzones) {
+        first = s->first_zone;
+    }
+    if (nzones > SHARED_HOST_ZONES - first) {
+        if (!s->warned) {
+            printf("collector: no host zones left for the %u zones of %s%s\n",
+                   nzones, s->name, s->first_zone >= 0 ? ", only the first "
+                   "ones are collected" : "");
+            fflush(stdout);
+            s->warned = 1;
+        }
+        return;
+    }
+    // zones that keep their host zone are already in the map
+    z = (int)first == s->first_zone ? s->nzones : 0;
+    if (s->first_zone >= 0) {
+        printf("collector: %s grew to %u zones, host zones %u to %u\n",
+               s->name, nzones, first, first + nzones - 1);
+        fflush(stdout);
+    }
+    s->first_zone = first;
+    s->nzones = nzones;
+    c->nzones = first + nzones;
+    if (c->zone_map != NULL) {
+        for (; z < nzones; z++) {
+            fprintf(c->zone_map, "%u %s %u\n", s->first_zone + z, s->name, z);
+        }
+        fflush(c->zone_map);
+    }
+}
+
+/**
+ * \brief Reads every instance once, updating the host page and logging the
+ *        ticks that happened since the last poll
+ */
+void poll_sources(struct collector* c)
+{
+    struct shared_host* h = c->host;
+    int64_t log_offset = c->log.config.epoch_offset_us;
+    int i;
+
+    shared_state_begin(&h->seq);
+    h->polls = ++c->polls;
+    h->updated_unix_us = clock_us(CLOCK_REALTIME);
+    for (i = 0; i < c->nsources; i++) {
+        struct source* s = &c->sources[i];
+        struct shared_host_instance* hi = &h->instances[i];
+        const struct shared_state* ss = &c->copy;
+        unsigned z, n;
+
+        snprintf(hi->name, sizeof(hi->name), "%s", s->name);
+        hi->up = 0;
+        if (s->page == NULL) {
+            continue;
+        }
+        if (shared_state_read(s->page, &c->copy) < 0) {
+            c->torn++;
+            continue;
+        }
+        if (s->first_zone < 0 || ss->nzones > s->nzones) {
+            assign_zones(c, s, ss->nzones);
+        }
+        hi->pid = ss->pid;
+        hi->up = shared_state_alive(ss);
+        hi->first_zone = s->first_zone < 0 ? 0 : s->first_zone;
+        hi->nzones = s->first_zone < 0 ? 0 : s->nzones;
+        hi->last_tick_unix_us = ss->updated_us + ss->epoch_offset_us;
+        hi->ticks = ss->ticks;
+        hi->overruns = ss->overruns;
+        hi->throttled = ss->throttled;
+        hi->denied_joules = ss->denied_joules;
+
+        n = ss->nzones < hi->nzones ? ss->nzones : hi->nzones;
+        for (z = 0; z < n; z++) {
+            h->zones[hi->first_zone + z] = ss->zones[z];
+        }
+        if (!c->logging || n == 0 || ss->updated_us == s->last_updated) {
+            continue;
+        }
+        s->last_updated = ss->updated_us;
+        for (z = 0; z < n; z++) {
+            struct log_sample sample;
+            sample.t_us = hi->last_tick_unix_us - log_offset;
+            sample.temp = ss->zones[z].temp;
+            sample.raw = ss->zones[z].raw;
+            sample.heater = ss->zones[z].heater;
+            sample.zone = hi->first_zone + z;
+            c->samples += log_push(&c->log, &sample) == 0;
+        }
+    }
+    h->ninstances = c->nsources;
+    h->nzones = c->nzones;
+    shared_state_end(&h->seq);
+    if (c->logging) {
+        log_service(&c->log);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Host page
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Creates and maps the host page
+ *
+ * \returns The page, or NULL on failure
+ */
+struct shared_host* host_create()
+{
+    char path[256];
+    struct shared_host* h;
+    int fd;
+    snprintf(path, sizeof(path), "%s/%s", SHARED_STATE_DIR, SHARED_HOST_NAME);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        ftruncate(fd, sizeof(struct shared_host)) < 0) {
+        printf("can't create host page %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    h = mmap(NULL, sizeof(struct shared_host), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        printf("can't map host page %s\n", path);
+        return NULL;
+    }
+    h->version = SHARED_STATE_VERSION;
+    h->pid = getpid();
+    __atomic_store_n(&h->magic, SHARED_HOST_MAGIC, __ATOMIC_RELEASE);
+    return h;
+}
+
+/**
+ * \brief Unmaps and removes the host page
+ */
+void host_destroy(struct shared_host* h)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", SHARED_STATE_DIR, SHARED_HOST_NAME);
+    munmap(h, sizeof(struct shared_host));
+    unlink(path);
+}
+
+int main(int argc, char* argv[])
+{
+    static struct collector c;
+    struct log_config log_config = { NULL, "host", 0, 0, 0, 0, LOG_FORMAT_TSB,
+                                     0, 0, 0, NULL };
+    double rate = 10, rescan = 1;
+    struct timespec next;
+    uint64_t polls_per_scan, period_ns;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:r:s:")) != -1) {
+        switch (opt) {
+        case 'l':
+            log_config.dir = optarg;
+            break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            break;
+        case 's':
+            rescan = strtod(optarg, NULL);
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc != optind || rate <= 0 || rate > 1e5 || rescan <= 0) {
+        printf("Incorrect call to collector. The correct format is\n");
+        printf("\t./collector [-r polls_per_second] [-s rescan_seconds] "
+               "[-l log_dir]\n");
+        return 1;
+    }
+    polls_per_scan = rescan * rate > 1 ? (uint64_t)(rescan * rate) : 1;
+
+    if ((c.host = host_create()) == NULL) {
+        return 2;
+    }
+    if (log_config.dir != NULL) {
+        char path[LOG_PATH_MAX];
+        // the log timebase is the monotonic clock
+        log_config.epoch_offset_us = clock_us(CLOCK_REALTIME) -
+                                     clock_us(CLOCK_MONOTONIC);
+        if (log_open(&c.log, &log_config) < 0) {
+            host_destroy(c.host);
+            return 3;
+        }
+        snprintf(path, sizeof(path), "%s/zones.txt", log_config.dir);
+        if ((c.zone_map = fopen(path, "a")) == NULL) {
+            printf("can't open %s\n", path);
+        }
+        c.logging = 1;
+    }
+    signal(SIGINT, int_handler);
+    signal(SIGTERM, int_handler);
+    printf("collector: polling %s/%s* %g times a second\n", SHARED_STATE_DIR,
+           SHARED_STATE_PREFIX, rate);
+    fflush(stdout);
+
+    // a slow rate's period does not fit a 32-bit long in nanoseconds
+    period_ns = (uint64_t)(1e9 / rate);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (running) {
+        if (c.polls % polls_per_scan == 0) {
+            scan(&c);
+        }
+        poll_sources(&c);
+        next.tv_sec += period_ns / 1000000000;
+        next.tv_nsec += period_ns % 1000000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    if (c.logging) {
+        log_close(&c.log);
+        log_print_stats(&c.log);
+        if (c.zone_map != NULL) {
+            fclose(c.zone_map);
+        }
+    }
+    host_destroy(c.host);
+    printf("collector: %llu polls of %d instances, %u zones, %llu samples "
+           "logged, %llu torn reads\n", (unsigned long long)c.polls,
+           c.nsources, c.nzones, (unsigned long long)c.samples,
+           (unsigned long long)c.torn);
+    return 0;
+}
@@ -0,0 +1,703 @@
+/**
+ * \file config.h
+ *
+ * \brief Configuration file for temp_control: the zones with their pins,
+ *        sensors, targets and controllers, the power budget, rates and log
+ *        settings, parsed and validated into one flat table.
+ *
+ *     # everything after a # is a comment
+ *     [control]
+ *     name = oven              # publish the live state, see shared_state.h
+ *     budget = 40              # W all heaters may draw together
+ *     deadline_us = 1000       # ticks further apart count as overruns
+ *     spi_hz = 244000
+ *     filter_hz = 100          # rate of the smoothing filters
+ *     state = /var/lib/temp_control/state
+ *
+ *     [log]
+ *     dir = /var/log/temp_control
+ *     options = segment_mb=64,flush_ms=500
+ *
+ *     [zone top]
+ *     pin = 17
+ *     channel = 0              # MCP3002 input of the zone's sensor
+ *     target = 45
+ *     watts = 2.5
+ *     priority = 1
+ *     controller = hyst:0.5    # see controller_init()
+ *     smooth_s = 2             # low-pass time constant, 0 for none
+ *
+ *     [interlock door]         # heaters are held off while it is active
+ *     pin = 22
+ *     pull = up                # none, down or up
+ *     active = low             # the level at which it holds them off
+ *
+ * Everything the control loop needs per zone, such as the ADC command byte
+ * and the GPIO word and mask, and the masks of the interlock inputs are
+ * worked out when the file is parsed, so a table is never modified after it
+ * has been built.
+ *
+ * The watcher rebuilds the table on its own thread whenever the file changes
+ * or SIGHUP arrives, and hands it to the control thread through an atomic
+ * pointer exchange. The control thread picks it up at the start of a tick and
+ * hands the table it replaced back to the watcher to free, so neither side
+ * ever waits for the other or allocates on the control thread.
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <ctype.h>
+#include <errno.h>
+#include <libgen.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "controllers.h"
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define CONFIG_MAX_ZONES     64
+#define CONFIG_NAME_MAX      32
+#define CONFIG_PATH_MAX      256
+#define CONFIG_LINE_MAX      512
+#define CONFIG_POLL_MS       250    // how often the watcher checks for SIGHUP
+#define CONFIG_MIN_TARGET    30
+#define CONFIG_MAX_TARGET    70
+#define CONFIG_MAX_INTERLOCKS 16
+#define CONFIG_GPIO_WORDS    2      // GPLEV words, pins 0-31 and 32-53
+#define CONFIG_SPI_FIRST_PIN 7      // SPI0 CE1, CE0, MISO, MOSI and SCLK,
+#define CONFIG_SPI_LAST_PIN  11     // which the ADC is read through
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct config_zone {
+    char name[CONFIG_NAME_MAX];
+    int pin;
+    int channel;
+    double target;
+    double watts;
+    int priority;
+    char controller[CONFIG_NAME_MAX];
+    double smooth_s;            // time constant of the reading's low-pass
+
+    // worked out from the above
+    unsigned char adc_command;  // first byte sent to the MCP3002
+    unsigned int gpio_word;     // pin / 32, the GPSET/GPCLR/GPLEV word
+    unsigned int gpio_mask;     // 1 << pin % 32
+};
+
+struct config_interlock {
+    char name[CONFIG_NAME_MAX];
+    int pin;
+    int pull;                   // 0 none, 1 down, 2 up, as PULL_* of
+                                // pi_helpers.h
+    int active_high;            // holds the heaters off while high
+};
+
+struct config {
+    uint64_t generation;        // counts the tables built by the watcher
+    char name[CONFIG_NAME_MAX];
+    double budget_watts;
+    unsigned deadline_us;
+    unsigned spi_hz;
+    unsigned debounce_ms;       // time an interlock input has to be stable
+    double filter_hz;           // rate the smoothing filters are stepped at
+    char state_path[CONFIG_PATH_MAX];
+    char log_dir[CONFIG_PATH_MAX];
+    char log_options[CONFIG_PATH_MAX];
+    int nzones;
+    struct config_zone zones[CONFIG_MAX_ZONES];
+    int ninterlocks;
+    struct config_interlock interlocks[CONFIG_MAX_INTERLOCKS];
+
+    // worked out from the interlocks, per GPLEV word
+    uint32_t interlock_mask[CONFIG_GPIO_WORDS];    // the interlock pins
+    uint32_t interlock_high[CONFIG_GPIO_WORDS];    // the ones active high
+
+    struct config* next_retired;    // chains tables waiting to be freed
+};
+
+struct config_watcher {
+    char path[CONFIG_PATH_MAX];
+    int fd;                     // inotify on the file's directory
+    pthread_t thread;
+    int running;
+    uint64_t generation;
+    struct config* pending;     // built, waiting for the control thread
+    struct config* retired;     // replaced, waiting to be freed, a chain
+    uint64_t reloads;
+    uint64_t rejected;
+};
+
+volatile sig_atomic_t config_hangup = 0;
+
+/////////////////////////////////////////////////////////////////////
+// Parsing
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Sets a configuration to the defaults used without a file: no zones,
+ *        no power budget and the rates temp_control has always used
+ */
+void config_defaults(struct config* cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->deadline_us = 1000;
+    cfg->spi_hz = 244000;
+    cfg->debounce_ms = 20;
+    cfg->filter_hz = 100;
+}
+
+/**
+ * \brief Adds a zone with default settings
+ *
+ * \returns The zone, or NULL if there are too many
+ */
+struct config_zone* config_add_zone(struct config* cfg, const char* name)
+{
+    struct config_zone* zone;
+    if (cfg->nzones == CONFIG_MAX_ZONES) {
+        return NULL;
+    }
+    zone = &cfg->zones[cfg->nzones++];
+    memset(zone, 0, sizeof(*zone));
+    snprintf(zone->name, sizeof(zone->name), "%s", name);
+    zone->pin = -1;
+    zone->target = NAN;
+    zone->watts = 2.5;
+    snprintf(zone->controller, sizeof(zone->controller), "bang");
+    return zone;
+}
+
+/**
+ * \brief Adds an interlock input, pulled up and active low by default
+ *
+ * \returns The interlock, or NULL if there are too many
+ */
+struct config_interlock* config_add_interlock(struct config* cfg,
+                                              const char* name)
+{
+    struct config_interlock* in;
+    if (cfg->ninterlocks == CONFIG_MAX_INTERLOCKS) {
+        return NULL;
+    }
+    in = &cfg->interlocks[cfg->ninterlocks++];
+    memset(in, 0, sizeof(*in));
+    snprintf(in->name, sizeof(in->name), "%s", name);
+    in->pin = -1;
+    in->pull = 2;
+    return in;
+}
+
+/**
+ * \brief Checks that a pin can be given to a zone or an interlock
+ *
+ * \returns NULL if it can, otherwise why not
+ */
+const char* config_check_pin(int pin)
+{
+    if (pin < 0 || pin > 53) {
+        return "pin must be 0 to 53";
+    }
+    // making one of these an input or output takes it off SPI0 and stops
+    // every zone's ADC reads
+    if (pin >= CONFIG_SPI_FIRST_PIN && pin <= CONFIG_SPI_LAST_PIN) {
+        return "pins 7 to 11 are used by SPI0";
+    }
+    return NULL;
+}
+
+/**
+ * \brief Checks the interlocks of a configuration and works out their masks
+ *
+ * \returns 0 if they are usable, -1 otherwise
+ */
+int config_finish_interlocks(struct config* cfg, char* err, size_t len)
+{
+    int i, y;
+    for (i = 0; i < cfg->ninterlocks; i++) {
+        const struct config_interlock* in = &cfg->interlocks[i];
+        const char* bad = config_check_pin(in->pin);
+        uint32_t bit;
+        if (bad != NULL) {
+            snprintf(err, len, "interlock %s: %s", in->name, bad);
+            return -1;
+        }
+        bit = 1u << in->pin % 32;
+        for (y = 0; y < cfg->nzones; y++) {
+            if (cfg->zones[y].pin == in->pin) {
+                snprintf(err, len, "zone %s and interlock %s share pin %d",
+                         cfg->zones[y].name, in->name, in->pin);
+                return -1;
+            }
+        }
+        if (cfg->interlock_mask[in->pin / 32] & bit) {
+            snprintf(err, len, "interlock %s: pin %d is used twice",
+                     in->name, in->pin);
+            return -1;
+        }
+        cfg->interlock_mask[in->pin / 32] |= bit;
+        cfg->interlock_high[in->pin / 32] |= in->active_high ? bit : 0;
+    }
+    if (cfg->debounce_ms == 0) {
+        snprintf(err, len, "debounce_ms must be positive");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Checks a configuration and works out the per zone tables
+ *
+ * \param cfg   the configuration
+ * \param err   receives the problem found, if any
+ * \param len   the size of err
+ *
+ * \returns 0 if the configuration is usable, -1 otherwise
+ */
+int config_finish(struct config* cfg, char* err, size_t len)
+{
+    struct controller test;
+    int z, y;
+    if (cfg->nzones == 0) {
+        snprintf(err, len, "no zones");
+        return -1;
+    }
+    for (z = 0; z < cfg->nzones; z++) {
+        struct config_zone* zone = &cfg->zones[z];
+        const char* bad = config_check_pin(zone->pin);
+        if (bad != NULL) {
+            snprintf(err, len, "zone %s: %s", zone->name, bad);
+            return -1;
+        }
+        if (zone->channel < 0 || zone->channel > 1) {
+            snprintf(err, len, "zone %s: channel must be 0 or 1", zone->name);
+            return -1;
+        }
+        if (!(zone->target >= CONFIG_MIN_TARGET &&
+              zone->target <= CONFIG_MAX_TARGET)) {
+            snprintf(err, len, "zone %s: target must be %d to %d",
+                     zone->name, CONFIG_MIN_TARGET, CONFIG_MAX_TARGET);
+            return -1;
+        }
+        if (zone->watts < 0) {
+            snprintf(err, len, "zone %s: watts can't be negative",
+                     zone->name);
+            return -1;
+        }
+        if (controller_init(&test, zone->controller, zone->target) < 0) {
+            snprintf(err, len, "zone %s: unknown controller %s", zone->name,
+                     zone->controller);
+            return -1;
+        }
+        for (y = 0; y < z; y++) {
+            if (cfg->zones[y].pin == zone->pin) {
+                snprintf(err, len, "zones %s and %s share pin %d",
+                         cfg->zones[y].name, zone->name, zone->pin);
+                return -1;
+            }
+            if (strcmp(cfg->zones[y].name, zone->name) == 0) {
+                snprintf(err, len, "two zones are called %s", zone->name);
+                return -1;
+            }
+        }
+        zone->adc_command = 0x68 | zone->channel << 4;
+        zone->gpio_word = zone->pin / 32;
+        zone->gpio_mask = 1u << zone->pin % 32;
+    }
+    if (cfg->budget_watts < 0 || cfg->deadline_us == 0 || cfg->spi_hz == 0) {
+        snprintf(err, len, "budget, deadline_us and spi_hz must be positive");
+        return -1;
+    }
+    return config_finish_interlocks(cfg, err, len);
+}
+
+/**
+ * \brief Removes leading and trailing white space in place
+ */
+char* config_trim(char* s)
+{
+    char* end;
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+/**
+ * \brief Parses a number, failing if anything else is in the value
+ */
+int config_number(const char* value, double* out)
+{
+    char* end;
+    errno = 0;
+    *out = strtod(value, &end);
+    return errno == 0 && end != value && *end == '\0' ? 0 : -1;
+}
+
+/**
+ * \brief Applies one key = value line of a section
+ *
+ * \returns 0 on success, -1 if the key or value is not valid
+ */
+int config_set(struct config* cfg, const char* section, const char* key,
+               const char* value)
+{
+    struct config_zone* zone = cfg->nzones > 0
+                               ? &cfg->zones[cfg->nzones - 1] : NULL;
+    struct config_interlock* in = cfg->ninterlocks > 0
+                                  ? &cfg->interlocks[cfg->ninterlocks - 1]
+                                  : NULL;
+    double n = 0;
+    int numeric = config_number(value, &n) == 0;
+
+    if (strcmp(section, "control") == 0) {
+        if (strcmp(key, "name") == 0) {
+            snprintf(cfg->name, sizeof(cfg->name), "%s", value);
+        } else if (strcmp(key, "state") == 0) {
+            snprintf(cfg->state_path, sizeof(cfg->state_path), "%s", value);
+        } else if (strcmp(key, "budget") == 0 && numeric) {
+            cfg->budget_watts = n;
+        } else if (strcmp(key, "deadline_us") == 0 && numeric && n > 0) {
+            cfg->deadline_us = n;
+        } else if (strcmp(key, "spi_hz") == 0 && numeric && n > 0) {
+            cfg->spi_hz = n;
+        } else if (strcmp(key, "debounce_ms") == 0 && numeric && n >= 1) {
+            cfg->debounce_ms = n;
+        } else if (strcmp(key, "filter_hz") == 0 && numeric && n > 0) {
+            cfg->filter_hz = n;
+        } else {
+            return -1;
+        }
+    } else if (strcmp(section, "log") == 0) {
+        if (strcmp(key, "dir") == 0) {
+            snprintf(cfg->log_dir, sizeof(cfg->log_dir), "%s", value);
+        } else if (strcmp(key, "options") == 0) {
+            snprintf(cfg->log_options, sizeof(cfg->log_options), "%s",
+                     value);
+        } else {
+            return -1;
+        }
+    } else if (strcmp(section, "zone") == 0 && zone != NULL) {
+        if (strcmp(key, "pin") == 0 && numeric && n == (int)n) {
+            zone->pin = n;
+        } else if (strcmp(key, "channel") == 0 && numeric && n == (int)n) {
+            zone->channel = n;
+        } else if (strcmp(key, "target") == 0 && numeric) {
+            zone->target = n;
+        } else if (strcmp(key, "watts") == 0 && numeric) {
+            zone->watts = n;
+        } else if (strcmp(key, "priority") == 0 && numeric && n == (int)n) {
+            zone->priority = n;
+        } else if (strcmp(key, "controller") == 0) {
+            snprintf(zone->controller, sizeof(zone->controller), "%s", value);
+        } else if (strcmp(key, "smooth_s") == 0 && numeric && n >= 0) {
+            zone->smooth_s = n;
+        } else {
+            return -1;
+        }
+    } else if (strcmp(section, "interlock") == 0 && in != NULL) {
+        if (strcmp(key, "pin") == 0 && numeric && n == (int)n) {
+            in->pin = n;
+        } else if (strcmp(key, "pull") == 0 && strcmp(value, "none") == 0) {
+            in->pull = 0;
+        } else if (strcmp(key, "pull") == 0 && strcmp(value, "down") == 0) {
+            in->pull = 1;
+        } else if (strcmp(key, "pull") == 0 && strcmp(value, "up") == 0) {
+            in->pull = 2;
+        } else if (strcmp(key, "active") == 0 &&
+                   (strcmp(value, "low") == 0 || strcmp(value, "high") == 0)) {
+            in->active_high = strcmp(value, "high") == 0;
+        } else {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Reads and checks a configuration file
+ *
+ * \param path   the file
+ * \param cfg    receives the configuration
+ * \param err    receives the problem found, if any, with its line number
+ * \param len    the size of err
+ *
+ * \returns 0 on success, -1 if the file can't be read or is not valid
+ */
+int config_load(const char* path, struct config* cfg, char* err, size_t len)
+{
+    char line[CONFIG_LINE_MAX];
+    char section[CONFIG_NAME_MAX] = "";
+    int lineno = 0;
+    FILE* f;
+
+    config_defaults(cfg);
+    if ((f = fopen(path, "r")) == NULL) {
+        snprintf(err, len, "%s: %s", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* s = line;
+        char* eq;
+        lineno++;
+        s[strcspn(s, "#\n")] = '\0';
+        s = config_trim(s);
+        if (*s == '\0') {
+            continue;
+        }
+        if (*s == '[') {
+            char kind[CONFIG_NAME_MAX], name[CONFIG_NAME_MAX], extra[2];
+            char* end = strchr(s, ']');
+            int named, n;
+            if (end == NULL || end[1] != '\0') {
+                snprintf(err, len, "%s:%d: bad section", path, lineno);
+                fclose(f);
+                return -1;
+            }
+            *end = '\0';
+            // zones and interlocks take a name, the other sections don't
+            n = sscanf(s + 1, "%31s %31s %1s", kind, name, extra);
+            named = n >= 1 && (strcmp(kind, "zone") == 0 ||
+                               strcmp(kind, "interlock") == 0);
+            if (named && n == 1) {
+                snprintf(err, len, "%s:%d: %ss need a name", path, lineno,
+                         kind);
+                fclose(f);
+                return -1;
+            }
+            if (n < 1 || n != (named ? 2 : 1)) {
+                snprintf(err, len, "%s:%d: bad section", path, lineno);
+                fclose(f);
+                return -1;
+            }
+            if (named && ((strcmp(kind, "zone") == 0 &&
+                           config_add_zone(cfg, name) == NULL) ||
+                          (strcmp(kind, "interlock") == 0 &&
+                           config_add_interlock(cfg, name) == NULL))) {
+                snprintf(err, len, "%s:%d: too many %ss", path, lineno,
+                         kind);
+                fclose(f);
+                return -1;
+            }
+            strcpy(section, kind);
+            continue;
+        }
+        if ((eq = strchr(s, '=')) == NULL) {
+            snprintf(err, len, "%s:%d: expected key = value", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        *eq = '\0';
+        if (config_set(cfg, section, config_trim(s), config_trim(eq + 1)) <
+            0) {
+            snprintf(err, len, "%s:%d: invalid %s in [%s]", path, lineno,
+                     config_trim(s), section);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    if (config_finish(cfg, err, len) < 0) {
+        char problem[CONFIG_LINE_MAX];
+        snprintf(problem, sizeof(problem), "%s", err);
+        snprintf(err, len, "%s: %s", path, problem);
+        return -1;
+    }
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Hot reload
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Catches SIGHUP, which asks the watcher to reload the file
+ */
+void config_hangup_handler(int sig)
+{
+    (void)sig;
+    config_hangup = 1;
+}
+
+/**
+ * \brief Builds a new table from the file and queues it for the control
+ *        thread, keeping the current one if the file is not valid
+ */
+void config_rebuild(struct config_watcher* w)
+{
+    struct config* cfg = malloc(sizeof(*cfg));
+    struct config* old;
+    char err[CONFIG_LINE_MAX];
+    if (cfg == NULL) {
+        return;
+    }
+    if (config_load(w->path, cfg, err, sizeof(err)) < 0) {
+        printf("config: keeping the current settings, %s\n", err);
+        fflush(stdout);
+        w->rejected++;
+        free(cfg);
+        return;
+    }
+    cfg->generation = ++w->generation;
+    // a table the control thread never picked up is simply replaced
+    old = __atomic_exchange_n(&w->pending, cfg, __ATOMIC_ACQ_REL);
+    free(old);
+    w->reloads++;
+}
+
+/**
+ * \brief Frees a chain of retired tables
+ */
+void config_free_retired(struct config* cfg)
+{
+    while (cfg != NULL) {
+        struct config* next = cfg->next_retired;
+        free(cfg);
+        cfg = next;
+    }
+}
+
+/**
+ * \brief Body of the watcher thread
+ */
+void* config_watch_thread(void* arg)
+{
+    struct config_watcher* w = arg;
+    char copy[CONFIG_PATH_MAX];
+    const char* base;
+    union {
+        struct inotify_event event;
+        char buf[4096];
+    } events;
+
+    snprintf(copy, sizeof(copy), "%s", w->path);
+    base = basename(copy);
+    while (__atomic_load_n(&w->running, __ATOMIC_ACQUIRE)) {
+        struct pollfd p = { w->fd, POLLIN, 0 };
+        int changed = 0;
+        config_free_retired(__atomic_exchange_n(&w->retired, NULL,
+                                                __ATOMIC_ACQUIRE));
+        if (w->fd >= 0 && poll(&p, 1, CONFIG_POLL_MS) > 0) {
+            ssize_t n = read(w->fd, events.buf, sizeof(events.buf));
+            ssize_t i = 0;
+            while (n > 0 && i < n) {
+                const struct inotify_event* e =
+                    (const struct inotify_event*)(events.buf + i);
+                changed |= e->len > 0 && strcmp(e->name, base) == 0;
+                i += sizeof(*e) + e->len;
+            }
+        } else if (w->fd < 0) {
+            poll(NULL, 0, CONFIG_POLL_MS);
+        }
+        if (config_hangup) {
+            config_hangup = 0;
+            changed = 1;
+        }
+        if (changed) {
+            config_rebuild(w);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Starts watching a configuration file for changes
+ *
+ * \note Editors often replace a file rather than write it, so the directory
+ *       is watched for the file being written, moved in or created.
+ *
+ * \returns 0 on success, -1 if the watcher thread can't be started
+ */
+int config_watch(struct config_watcher* w, const char* path)
+{
+    char dir[CONFIG_PATH_MAX];
+    memset(w, 0, sizeof(*w));
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+        inotify_add_watch(w->fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO |
+                          IN_CREATE) < 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    if (w->fd < 0) {
+        printf("config: can't watch %s, reload with SIGHUP\n", path);
+    }
+    signal(SIGHUP, config_hangup_handler);
+    w->running = 1;
+    if (pthread_create(&w->thread, NULL, config_watch_thread, w)) {
+        printf("config: can't start the watcher thread\n");
+        w->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Takes the newest table built by the watcher, called by the control
+ *        thread at the start of a tick
+ *
+ * \returns The new table, or NULL if there is none
+ */
+struct config* config_take(struct config_watcher* w)
+{
+    if (__atomic_load_n(&w->pending, __ATOMIC_RELAXED) == NULL) {
+        return NULL;
+    }
+    return __atomic_exchange_n(&w->pending, NULL, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * \brief Hands a table that is no longer used back to the watcher to free
+ *
+ * \note Tables retired before the watcher gets round to them are chained,
+ *       so the control thread never frees one itself.
+ */
+void config_retire(struct config_watcher* w, struct config* cfg)
+{
+    if (cfg == NULL) {
+        return;
+    }
+    cfg->next_retired = __atomic_load_n(&w->retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&w->retired, &cfg->next_retired, cfg,
+                                        1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+/**
+ * \brief Stops the watcher thread and frees the tables it still holds
+ */
+void config_unwatch(struct config_watcher* w)
+{
+    if (!w->running) {
+        return;
+    }
+    __atomic_store_n(&w->running, 0, __ATOMIC_RELEASE);
+    pthread_join(w->thread, NULL);
+    if (w->fd >= 0) {
+        close(w->fd);
+    }
+    free(w->pending);
+    config_free_retired(w->retired);
+    w->pending = w->retired = NULL;
+}
+
+#endif
@@ -0,0 +1,162 @@
+/**
+ * \file controllers.h
+ *
+ * \brief Heater controllers that can be swapped in for the bang-bang decision
+ *        made by check_temp() in temp_control.c, or compared against it.
+ *
+ * Every controller is a struct controller: its step function is called once
+ * per tick with the temperature read from the ADC and returns the new heater
+ * state. Parameters and internal state are kept in small fixed arrays so a
+ * controller can be copied with a plain assignment and checkpointed into the
+ * ctl field of a ctl_zone_state (see ctl_state.h).
+ */
+#ifndef CONTROLLERS_H
+#define CONTROLLERS_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct controller {
+    char name[32];
+    int (*step)(struct controller* c, double temp, uint64_t t_us);
+    double target;
+    double param[4];
+    double state[4];
+};
+
+/////////////////////////////////////////////////////////////////////
+// Controllers
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Same decision as check_temp(): heat while the whole degrees read are
+ *        below the target
+ */
+int controller_bang_bang_step(struct controller* c, double temp, uint64_t t_us)
+{
+    (void)t_us;
+    return floor(temp) < c->target;
+}
+
+/**
+ * \brief Switches on below target - band and off at target + band, holding
+ *        the last state in between
+ *
+ * param[0] is the band, state[0] the heater state
+ */
+int controller_hysteresis_step(struct controller* c, double temp,
+                               uint64_t t_us)
+{
+    (void)t_us;
+    if (temp < c->target - c->param[0]) {
+        c->state[0] = 1;
+    } else if (temp >= c->target + c->param[0]) {
+        c->state[0] = 0;
+    }
+    return c->state[0] != 0;
+}
+
+/**
+ * \brief PI controller whose output sets the duty cycle of a fixed length
+ *        on/off window, so the heater still switches at most twice per window
+ *
+ * param[0] is kp (duty per C), param[1] ki (duty per C s), param[2] the
+ * window in seconds. state[0] is the integral term, state[1] the time of the
+ * previous step, state[2] the start of the current window.
+ */
+int controller_pi_step(struct controller* c, double temp, uint64_t t_us)
+{
+    double err = c->target - temp;
+    double now = t_us * 1e-6;
+    double dt = c->state[1] > 0 ? now - c->state[1] : 0;
+    double duty, integral = c->state[0] + c->param[1] * err * dt;
+
+    c->state[1] = now;
+    // anti-windup: the integral alone never asks for more than 0-100%
+    c->state[0] = integral < 0 ? 0 : integral > 1 ? 1 : integral;
+    duty = c->param[0] * err + c->state[0];
+    if (now - c->state[2] >= c->param[2]) {
+        c->state[2] = now;
+    }
+    return now - c->state[2] < duty * c->param[2];
+}
+
+/**
+ * \brief Shifts the windows of a time proportioned controller, so zones that
+ *        share a supply do not all switch on at the start of the same window
+ *
+ * \param c        the controller
+ * \param offset   how far into its window the controller is at t_us, s
+ * \param t_us     the time of the controller's next step, or one close to it
+ */
+void controller_stagger(struct controller* c, double offset, uint64_t t_us)
+{
+    if (c->step == controller_pi_step) {
+        c->state[2] = t_us * 1e-6 - offset;
+    }
+}
+
+/**
+ * \brief Restores the internal state of a controller from a checkpoint
+ *
+ * The PI controller keeps its integral but not its timing: the gap since the
+ * checkpoint is not integrated over, and its window is staggered again as
+ * the timebase may have been reset since.
+ *
+ * \param c        the controller, set up with controller_init()
+ * \param state    the saved state
+ * \param offset   as for controller_stagger()
+ * \param t_us     as for controller_stagger()
+ */
+void controller_resume(struct controller* c, const double* state,
+                       double offset, uint64_t t_us)
+{
+    memcpy(c->state, state, sizeof(c->state));
+    if (c->step == controller_pi_step) {
+        c->state[1] = 0;
+        controller_stagger(c, offset, t_us);
+    }
+}
+
+/**
+ * \brief Sets up a controller from a description
+ *
+ *     bang                   check_temp's bang-bang decision
+ *     hyst:BAND              hysteresis of +-BAND degrees
+ *     pi:KP,KI[,WINDOW]      time proportioned PI, window in seconds
+ *
+ * \param c        the controller to set up
+ * \param spec     the description
+ * \param target   the target temperature
+ *
+ * \returns 0 on success, -1 if the description was not understood
+ */
+int controller_init(struct controller* c, const char* spec, double target)
+{
+    memset(c, 0, sizeof(*c));
+    snprintf(c->name, sizeof(c->name), "%s", spec);
+    c->target = target;
+    if (strcmp(spec, "bang") == 0) {
+        c->step = controller_bang_bang_step;
+    } else if (strncmp(spec, "hyst:", 5) == 0 &&
+               sscanf(spec + 5, "%lf", &c->param[0]) == 1) {
+        c->step = controller_hysteresis_step;
+    } else if (strncmp(spec, "pi:", 3) == 0 &&
+               sscanf(spec + 3, "%lf,%lf,%lf", &c->param[0], &c->param[1],
+                      &c->param[2]) >= 2) {
+        c->param[2] = c->param[2] > 0 ? c->param[2] : 2;
+        c->step = controller_pi_step;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+#endif
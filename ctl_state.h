@@ -0,0 +1,214 @@
+/**
+ * \file ctl_state.h
+ *
+ * \brief Small memory mapped file holding periodic checkpoints of the
+ *        controller state, so a restarted temp_control can carry on where the
+ *        previous process stopped instead of starting from scratch.
+ *
+ * The file holds two snapshot slots. Each checkpoint is written into the slot
+ * that does not hold the newest snapshot and carries a sequence number and a
+ * CRC, so a process killed halfway through a checkpoint always leaves the
+ * previous snapshot intact. Checkpointing is a handful of stores into the
+ * mapping; the kernel writes the page back, and it survives a process restart
+ * even if the page never reached the disk.
+ */
+#ifndef CTL_STATE_H
+#define CTL_STATE_H
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "tslog.h"        // for tslog_crc32
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define CTL_STATE_MAGIC       0x5453434c    // "LCST"
+#define CTL_STATE_VERSION     2
+#define CTL_STATE_MAX_ZONES   64
+#define CTL_STATE_NAME_MAX    32
+#define CTL_STATE_PERIOD_US   100000        // time between checkpoints
+#define CTL_STATE_MAX_AGE_S   60            // older snapshots are ignored
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Everything needed to resume controlling one zone
+ */
+struct ctl_zone_state {
+    uint32_t target;          // target temperature
+    uint32_t last_temp;       // temperature measured on the last sample
+    uint32_t overshoot;       // highest temperature reached
+    uint32_t heater;          // control pin state
+    double ctl[4];            // controller and estimator internal state
+    char name[CTL_STATE_NAME_MAX];        // zone, which restores match on
+    char controller[CTL_STATE_NAME_MAX];  // the ctl state belongs to
+};
+
+struct ctl_snapshot {
+    uint64_t seq;             // 0 means the slot was never written
+    int64_t wall_us;          // Unix time of the checkpoint
+    uint32_t nzones;
+    uint32_t crc;             // CRC-32 of the snapshot with crc = 0
+    struct ctl_zone_state zones[CTL_STATE_MAX_ZONES];
+};
+
+struct ctl_state_file {
+    uint32_t magic;
+    uint32_t version;
+    struct ctl_snapshot slot[2];
+};
+
+struct ctl_state {
+    struct ctl_state_file* file;
+    uint64_t seq;             // sequence number of the newest snapshot
+    uint64_t last_us;         // timebase value of the last checkpoint
+};
+
+/////////////////////////////////////////////////////////////////////
+// Functions
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Computes the checksum of a snapshot
+ */
+uint32_t ctl_snapshot_crc(const struct ctl_snapshot* snap)
+{
+    uint32_t crc = tslog_crc32(0, snap, offsetof(struct ctl_snapshot, crc));
+    return tslog_crc32(crc, snap->zones,
+                       snap->nzones * sizeof(struct ctl_zone_state));
+}
+
+/**
+ * \brief Returns the current Unix time in microseconds
+ */
+int64_t ctl_wall_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * \brief Maps the state file, creating it if it does not exist yet
+ *
+ * \param state   receives the mapping
+ * \param path    the state file
+ *
+ * \returns 0 on success, -1 on failure
+ */
+int ctl_state_open(struct ctl_state* state, const char* path)
+{
+    int fd;
+    void* map;
+    memset(state, 0, sizeof(*state));
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        printf("can't open state file %s\n", path);
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(struct ctl_state_file)) < 0) {
+        printf("can't size state file %s\n", path);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, sizeof(struct ctl_state_file), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("can't map state file %s\n", path);
+        return -1;
+    }
+    state->file = map;
+    if (state->file->magic != CTL_STATE_MAGIC ||
+        state->file->version != CTL_STATE_VERSION) {
+        memset(state->file, 0, sizeof(struct ctl_state_file));
+        state->file->magic = CTL_STATE_MAGIC;
+        state->file->version = CTL_STATE_VERSION;
+    }
+    return 0;
+}
+
+/**
+ * \brief Finds the newest intact snapshot, if it is recent enough to resume
+ *        from
+ *
+ * \param state     the mapped state file
+ * \param max_age   the oldest snapshot to accept, in seconds
+ *
+ * \returns The snapshot to resume from, or NULL to start cold
+ */
+const struct ctl_snapshot* ctl_state_restore(struct ctl_state* state,
+                                             int max_age)
+{
+    const struct ctl_snapshot* best = NULL;
+    int i;
+    for (i = 0; i < 2; i++) {
+        const struct ctl_snapshot* snap = &state->file->slot[i];
+        if (snap->seq == 0 || snap->nzones > CTL_STATE_MAX_ZONES ||
+            ctl_snapshot_crc(snap) != snap->crc) {
+            continue;
+        }
+        if (best == NULL || snap->seq > best->seq) {
+            best = snap;
+        }
+    }
+    if (best == NULL) {
+        return NULL;
+    }
+    state->seq = best->seq;
+    if (ctl_wall_us() - best->wall_us > (int64_t)max_age * 1000000) {
+        return NULL;
+    }
+    return best;
+}
+
+/**
+ * \brief Starts a checkpoint, returning the slot to fill in. The caller sets
+ *        nzones and the zone states, then calls ctl_state_commit().
+ */
+struct ctl_snapshot* ctl_state_begin(struct ctl_state* state)
+{
+    struct ctl_snapshot* snap = &state->file->slot[(state->seq + 1) & 1];
+    // invalidate the slot first so a half written snapshot is never trusted
+    snap->seq = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return snap;
+}
+
+/**
+ * \brief Seals the snapshot filled in since ctl_state_begin()
+ *
+ * \param state   the mapped state file
+ * \param snap    the slot returned by ctl_state_begin()
+ * \param now_us  the current timebase value
+ */
+void ctl_state_commit(struct ctl_state* state, struct ctl_snapshot* snap,
+                      uint64_t now_us)
+{
+    snap->wall_us = ctl_wall_us();
+    snap->crc = 0;
+    snap->seq = state->seq + 1;
+    snap->crc = ctl_snapshot_crc(snap);
+    state->seq = snap->seq;
+    state->last_us = now_us;
+}
+
+/**
+ * \brief Forces the state file to disk, used on a clean shutdown
+ */
+void ctl_state_sync(struct ctl_state* state)
+{
+    if (state->file != NULL) {
+        msync(state->file, sizeof(struct ctl_state_file), MS_SYNC);
+    }
+}
+
+#endif
@@ -0,0 +1,568 @@
+/*  \file ctlbench.c
+ *
+ *  \brief Benchmarks heater controllers against a plant fitted to a logged
+ *         trace, reporting control quality and CPU cost per tick relative to
+ *         the bang-bang decision made by temp_control today.
+ *
+ *  The trace is the raw CSV output of tsquery (time,zone,temp,raw,heater),
+ *  from a file or - for stdin:
+ *
+ *      ./tsquery -z 0 -s 10:00 -e 11:00 logs | ./ctlbench - 45
+ *
+ *  The trace is averaged into fixed periods, a first order plant with dead
+ *  time is fitted to them (see plant.h), and every candidate controller is
+ *  run closed loop against its own copy of the plant for the length of the
+ *  trace, at the tick rate of the logged run. Candidates run in parallel.
+ *
+ *  With -N the candidates run instead against a thermal network (see
+ *  thermal_net.h), one copy of the controller per zone, to see how
+ *  controllers on zones that heat each other interact. The figures are then
+ *  per zone: IAE, switches and duty are averaged over the zones and the
+ *  overshoot is the worst zone's. -B puts a power budget (see power_budget.h)
+ *  between the controllers and the heaters, and time proportioned windows are
+ *  staggered across the zones.
+ *
+ *  \note The CPU cost is measured by re-running each chunk of ticks through
+ *        a copy of the controller with the readings it was fed, so the cost
+ *        of simulating the plant is not included.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "controllers.h"
+#include "plant.h"
+#include "power_budget.h"
+#include "thermal_net.h"
+
+#define MAX_CANDIDATES   32
+#define MAX_THREADS      64
+#define CHUNK_TICKS      4096   // ticks simulated between cost measurements
+#define MAX_DEAD_TIME_S  30     // longest dead time tried by the fit
+#define MAX_GAP_S        60     // longer gaps in a trace are cut out
+
+/**
+ * \brief Control quality of one run, simulated or logged
+ */
+struct result {
+    double iae;                 // integral of |temp - target|, C s
+    double overshoot;           // highest temp above the target, C
+    double on_time;             // s
+    double duration;            // s
+    uint64_t switches;
+    uint64_t ticks;
+    double cost_ns;             // controller CPU time, simulated runs only
+    struct power_stats power;   // with a power budget
+};
+
+struct candidate {
+    struct controller ctl;
+    struct result result;
+};
+
+struct bench {
+    double target;
+    double period;              // fit period, s
+    double tick;                // simulated tick, s
+    double duration;            // s
+    double start_temp;
+    int replay;                 // replay the fit residuals as disturbances
+    const char* net;            // thermal network to use instead of a fit
+    double budget;              // W the heaters may draw together, 0 for any
+    struct plant_rc_params params;
+
+    // trace averaged into periods
+    size_t nperiods;
+    double* temp;
+    double* duty;
+    float* residual;
+    uint64_t samples;
+    struct result logged;
+
+    struct candidate candidates[MAX_CANDIDATES];
+    int ncandidates;
+    int next_candidate;
+};
+
+/////////////////////////////////////////////////////////////////////
+// Trace
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Adds one sample to the quality figures of a run
+ */
+void result_add(struct result* r, double target, double temp, int heater,
+                int last_heater, double dt)
+{
+    r->iae += fabs(temp - target) * dt;
+    r->overshoot = fmax(r->overshoot, temp - target);
+    r->on_time += heater ? dt : 0;
+    r->duration += dt;
+    r->switches += heater != last_heater;
+    r->ticks++;
+}
+
+/**
+ * \brief Reads a trace and averages it into periods
+ *
+ * \returns 0 on success, -1 if the trace could not be read or was too short
+ */
+int load_trace(struct bench* b, const char* path)
+{
+    FILE* f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    double* sum = NULL;
+    uint32_t* count = NULL;
+    uint32_t* on = NULL;
+    size_t cap = 0, k, gaps = 0;
+    double t0 = 0, last_t = 0;
+    int zone = -1, last_heater = 0, ok = 1;
+    char line[256];
+
+    if (f == NULL) {
+        printf("can't open trace %s\n", path);
+        return -1;
+    }
+    b->nperiods = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        double t, temp, dt;
+        int z, heater;
+        unsigned raw;
+        size_t p;
+        if (sscanf(line, "%lf,%d,%lf,%u,%d", &t, &z, &temp, &raw,
+                   &heater) != 5) {
+            continue;           // the header line
+        }
+        if (zone < 0) {
+            zone = z;
+            t0 = last_t = t;
+            b->start_temp = temp;
+        }
+        if (z != zone || t < last_t) {
+            continue;
+        }
+        // the logger stopped or the clock jumped, carry on one period later
+        dt = t - last_t;
+        if (dt > MAX_GAP_S) {
+            t0 += dt - b->period;
+            dt = b->period;
+            gaps++;
+        }
+        p = (size_t)((t - t0) / b->period);
+        if (p >= cap) {
+            size_t n = cap;
+            double* sum2;
+            uint32_t *count2, *on2;
+            cap = p + 1 > cap * 2 ? p + 1 : cap * 2;
+            if ((sum2 = realloc(sum, cap * sizeof(double))) != NULL) {
+                sum = sum2;
+            }
+            if ((count2 = realloc(count, cap * sizeof(uint32_t))) != NULL) {
+                count = count2;
+            }
+            if ((on2 = realloc(on, cap * sizeof(uint32_t))) != NULL) {
+                on = on2;
+            }
+            if (sum2 == NULL || count2 == NULL || on2 == NULL) {
+                ok = 0;
+                break;
+            }
+            memset(sum + n, 0, (cap - n) * sizeof(double));
+            memset(count + n, 0, (cap - n) * sizeof(uint32_t));
+            memset(on + n, 0, (cap - n) * sizeof(uint32_t));
+        }
+        sum[p] += temp;
+        count[p]++;
+        on[p] += heater != 0;
+        b->nperiods = p + 1 > b->nperiods ? p + 1 : b->nperiods;
+        result_add(&b->logged, b->target, temp, heater != 0, last_heater,
+                   dt);
+        last_heater = heater != 0;
+        last_t = t;
+        b->samples++;
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    if (!ok) {
+        printf("out of memory reading trace %s\n", path);
+    } else if (b->samples < 2 || b->nperiods < 16) {
+        printf("trace %s is too short to fit a plant to\n", path);
+        ok = 0;
+    } else {
+        b->temp = malloc(b->nperiods * sizeof(double));
+        b->duty = malloc(b->nperiods * sizeof(double));
+        b->residual = malloc(b->nperiods * sizeof(float));
+        if (b->temp == NULL || b->duty == NULL || b->residual == NULL) {
+            printf("out of memory reading trace %s\n", path);
+            free(b->temp);
+            free(b->duty);
+            free(b->residual);
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        free(sum);
+        free(count);
+        free(on);
+        return -1;
+    }
+    if (gaps > 0) {
+        printf("trace %s: cut out %zu gaps longer than %d s\n", path, gaps,
+               MAX_GAP_S);
+    }
+    for (k = 0; k < b->nperiods; k++) {
+        b->temp[k] = count[k] > 0 ? sum[k] / count[k] : NAN;
+        b->duty[k] = count[k] > 0 ? (double)on[k] / count[k] : NAN;
+    }
+    b->duration = last_t - t0;
+    free(sum);
+    free(count);
+    free(on);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Simulation
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Creates the plant a candidate runs against
+ */
+struct plant* bench_plant(const struct bench* b)
+{
+    if (b->net != NULL) {
+        return thermal_net_open(b->net);
+    }
+    return plant_rc_new(&b->params, b->tick, b->replay ? b->residual : NULL,
+                        b->nperiods, b->period);
+}
+
+/**
+ * \brief Runs one candidate against its own copy of the plant, with a copy
+ *        of the controller on every zone
+ */
+void run_candidate(const struct bench* b, struct candidate* c)
+{
+    static __thread float readings[CHUNK_TICKS][TN_MAX_ZONES];
+    struct plant* plant = bench_plant(b);
+    struct controller ctl[TN_MAX_ZONES];
+    struct power_budget pb;
+    uint64_t nticks = (uint64_t)(b->duration / b->tick);
+    double tick_us = b->tick * 1e6;
+    uint8_t heater[TN_MAX_ZONES], last_heater[TN_MAX_ZONES];
+    volatile int sink = 0;
+    uint64_t k;
+    int nzones, z;
+
+    memset(&c->result, 0, sizeof(c->result));
+    if (plant == NULL) {
+        return;
+    }
+    nzones = plant->nzones;
+    power_budget_init(&pb, b->budget, c->ctl.step == controller_pi_step ?
+                      c->ctl.param[2] * 1000 : 1000);
+    for (z = 0; z < nzones; z++) {
+        ctl[z] = c->ctl;
+        last_heater[z] = 0;
+        power_budget_add_zone(&pb, b->net != NULL ?
+                              ((struct thermal_net*)plant)->power[z] : 1, 0);
+    }
+    for (z = 0; z < nzones && b->budget > 0; z++) {
+        controller_stagger(&ctl[z], pb.zones[z].phase_us * 1e-6, 0);
+    }
+    plant->reset(plant, b->start_temp);
+    for (k = 0; k < nticks; k += CHUNK_TICKS) {
+        struct controller copy[TN_MAX_ZONES];
+        struct timespec start, end;
+        unsigned m = nticks - k < CHUNK_TICKS ? nticks - k : CHUNK_TICKS;
+        unsigned i;
+        int on = 0;
+
+        memcpy(copy, ctl, nzones * sizeof(ctl[0]));
+        for (i = 0; i < m; i++) {
+            uint64_t t_us = (uint64_t)((k + i) * tick_us);
+            for (z = 0; z < nzones; z++) {
+                double temp = plant_sense(plant->temp(plant, z), NULL);
+                readings[i][z] = temp;
+                heater[z] = ctl[z].step(&ctl[z], temp, t_us);
+                power_budget_request(&pb, z, heater[z], b->target - temp);
+            }
+            if (b->budget > 0) {
+                power_budget_allocate(&pb, t_us, heater);
+            }
+            for (z = 0; z < nzones; z++) {
+                result_add(&c->result, b->target, readings[i][z], heater[z],
+                           last_heater[z], b->tick);
+                last_heater[z] = heater[z];
+            }
+            plant->step(plant, b->tick, heater);
+        }
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        for (i = 0; i < m; i++) {
+            uint64_t t_us = (uint64_t)((k + i) * tick_us);
+            for (z = 0; z < nzones; z++) {
+                on += copy[z].step(&copy[z], readings[i][z], t_us);
+            }
+        }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        sink += on;
+        c->result.cost_ns += (end.tv_sec - start.tv_sec) * 1e9 +
+                             (end.tv_nsec - start.tv_nsec);
+    }
+    c->result.iae /= nzones;
+    c->result.power = pb.stats;
+    plant->free(plant);
+}
+
+/**
+ * \brief Finds a first order model of zone 0 of a thermal network from its
+ *        open loop response (every heater on for half the run, then off), so
+ *        the PI controller can be tuned for it
+ *
+ * \returns 0 on success, -1 if the network could not be loaded or fitted
+ */
+int identify_net(struct bench* b)
+{
+    struct plant* plant = thermal_net_open(b->net);
+    uint8_t heater[TN_MAX_ZONES];
+    size_t k;
+    int ok;
+
+    if (plant == NULL) {
+        return -1;
+    }
+    b->nperiods = (size_t)(b->duration / b->period);
+    b->temp = malloc(b->nperiods * sizeof(double));
+    b->duty = malloc(b->nperiods * sizeof(double));
+    plant->reset(plant, NAN);
+    for (k = 0; k < b->nperiods; k++) {
+        memset(heater, k < b->nperiods / 2, sizeof(heater));
+        b->temp[k] = plant->temp(plant, 0);
+        b->duty[k] = heater[0];
+        plant->step(plant, b->period, heater);
+    }
+    printf("plant: %s, %d nodes, %d zones\n", b->net,
+           ((struct thermal_net*)plant)->n, plant->nzones);
+    plant->free(plant);
+    ok = plant_rc_fit(b->temp, b->duty, b->nperiods, b->period,
+                      (int)(MAX_DEAD_TIME_S / b->period), &b->params, NULL);
+    return ok;
+}
+
+/**
+ * \brief Body of the worker threads, which take candidates until none are
+ *        left
+ */
+void* worker(void* arg)
+{
+    struct bench* b = arg;
+    int n;
+    while ((n = __atomic_fetch_add(&b->next_candidate, 1, __ATOMIC_RELAXED)) <
+           b->ncandidates) {
+        run_candidate(b, &b->candidates[n]);
+    }
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Output
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Picks PI gains for the fitted plant with the SIMC rules, counting
+ *        half of the switching window as extra dead time
+ */
+void auto_tune_pi(const struct plant_rc_params* p, char* spec, size_t len)
+{
+    double window = 2;
+    double gain = p->heat / p->loss;
+    double tau = 1 / p->loss;
+    double theta = p->dead_time + window / 2;
+    double kp = tau / (gain * 2 * theta);
+    double ti = fmin(tau, 8 * theta);
+    snprintf(spec, len, "pi:%.3g,%.3g,%g", kp, kp / ti, window);
+}
+
+void print_result(const char* name, const struct result* r,
+                  const struct result* base)
+{
+    printf("%-24s %10.1f", name, r->iae);
+    if (base != NULL && base->iae > 0) {
+        printf(" %7.2fx", r->iae / base->iae);
+    } else {
+        printf(" %8s", "");
+    }
+    printf(" %12.2f %13.2f %6.3f", r->overshoot,
+           r->duration > 0 ? r->switches / (r->duration / 60) : 0,
+           r->duration > 0 ? r->on_time / r->duration : 0);
+    if (base != NULL && r->ticks > 0) {
+        printf(" %8.2f", r->cost_ns / r->ticks);
+        if (base->cost_ns > 0) {
+            printf(" %7.2fx", r->cost_ns / base->cost_ns);
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+    static struct bench b;
+    pthread_t threads[MAX_THREADS];
+    const char* specs[MAX_CANDIDATES];
+    char pi_spec[64];
+    int nspecs = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    double tick_us = 0;
+    int opt, i;
+
+    b.period = 0.5;
+    b.duration = 600;
+    while ((opt = getopt(argc, argv, "B:N:c:d:j:p:rt:")) != -1) {
+        switch (opt) {
+        case 'B':
+            b.budget = strtod(optarg, NULL);
+            break;
+        case 'N':
+            b.net = optarg;
+            break;
+        case 'd':
+            b.duration = strtod(optarg, NULL);
+            break;
+        case 'c':
+            if (nspecs < MAX_CANDIDATES - 1) {
+                specs[nspecs++] = optarg;
+            }
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'p':
+            b.period = strtod(optarg, NULL);
+            break;
+        case 'r':
+            b.replay = 1;
+            break;
+        case 't':
+            tick_us = strtod(optarg, NULL);
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind != (b.net != NULL ? 1 : 2) || b.period <= 0 ||
+        b.duration <= 0 || (b.budget > 0 && b.net == NULL)) {
+        printf("Incorrect call to ctlbench. The correct format is\n");
+        printf("\t./ctlbench [-c controller]... [-p fit_period_s] "
+               "[-t tick_us] [-r] [-j threads] trace.csv target\n");
+        printf("\t./ctlbench -N network [-B watts] [-c controller]... "
+               "[-d seconds] [-t tick_us]\n\t\t[-j threads] target\n");
+        printf("where trace.csv is raw tsquery output (- for stdin), -r "
+               "replays the fit\nresiduals as disturbances, network is a "
+               "thermal network file or grid:WxH[:ZONES]\n");
+        printf("(see thermal_net.h) and controller is one of\n");
+        printf("\tbang  hyst:BAND  pi:KP,KI[,WINDOW_S]  pi (tuned to the "
+               "fitted plant)\n");
+        return 1;
+    }
+    b.target = strtod(argv[argc - 1], NULL);
+    if (b.net != NULL) {
+        // the network is the plant, it is only fitted to tune the PI
+        b.start_temp = NAN;
+        if (identify_net(&b) < 0) {
+            printf("can't fit zone 0 of %s\n", b.net);
+            return 3;
+        }
+        b.tick = tick_us > 0 ? tick_us * 1e-6 : 1e-3;
+    } else {
+        if (load_trace(&b, argv[optind]) < 0) {
+            return 2;
+        }
+        if (plant_rc_fit(b.temp, b.duty, b.nperiods, b.period,
+                         (int)(MAX_DEAD_TIME_S / b.period), &b.params,
+                         b.residual) < 0) {
+            printf("can't fit a plant, the trace has to include both heating "
+                   "and cooling\n");
+            return 3;
+        }
+        b.tick = tick_us > 0 ? tick_us * 1e-6 : b.logged.duration / b.samples;
+        printf("trace: %llu samples over %.1f s in %zu periods of %.3f s\n",
+               (unsigned long long)b.samples, b.duration, b.nperiods,
+               b.period);
+    }
+    b.tick = fmin(fmax(b.tick, 1e-6), b.period);
+
+    // the baseline always runs first
+    auto_tune_pi(&b.params, pi_spec, sizeof(pi_spec));
+    if (controller_init(&b.candidates[b.ncandidates++].ctl, "bang",
+                        b.target) < 0) {
+        return 4;
+    }
+    if (nspecs == 0) {
+        specs[nspecs++] = "hyst:0.5";
+        specs[nspecs++] = "hyst:1";
+        specs[nspecs++] = "pi";
+    }
+    for (i = 0; i < nspecs; i++) {
+        const char* spec = strcmp(specs[i], "pi") == 0 ? pi_spec : specs[i];
+        if (strcmp(spec, "bang") == 0) {
+            continue;
+        }
+        if (controller_init(&b.candidates[b.ncandidates].ctl, spec,
+                            b.target) < 0) {
+            printf("unknown controller %s\n", spec);
+            return 1;
+        }
+        b.ncandidates++;
+    }
+
+    printf("%s: heat %.4f C/s  time constant %.1f s  ambient %.2f C  "
+           "dead time %.2f s  rms residual %.4f C\n",
+           b.net != NULL ? "zone 0" : "plant", b.params.heat,
+           1 / b.params.loss, b.params.ambient, b.params.dead_time,
+           b.params.rms_residual);
+    printf("simulating %.0f ticks of %.1f us per controller%s\n",
+           floor(b.duration / b.tick), b.tick * 1e6,
+           b.replay ? " with replayed disturbances" : "");
+
+    nthreads = nthreads < 1 ? 1 : nthreads > MAX_THREADS ? MAX_THREADS
+                                                         : nthreads;
+    nthreads = nthreads > b.ncandidates ? b.ncandidates : nthreads;
+    for (i = 0; i < nthreads - 1; i++) {
+        pthread_create(&threads[i], NULL, worker, &b);
+    }
+    worker(&b);
+    for (i = 0; i < nthreads - 1; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("\n%-24s %10s %8s %12s %13s %6s %8s %8s\n", "controller",
+           "IAE C*s", "vs base", "overshoot C", "switches/min", "duty",
+           "ns/tick", "vs base");
+    if (b.net == NULL) {
+        print_result("logged", &b.logged, NULL);
+    }
+    for (i = 0; i < b.ncandidates; i++) {
+        print_result(b.candidates[i].ctl.name, &b.candidates[i].result,
+                     &b.candidates[0].result);
+    }
+    if (b.budget > 0) {
+        printf("\n%-24s %10s %8s %12s %13s\n", "power budget", "throttled",
+               "denied", "not deliv. J", "peak demand W");
+        for (i = 0; i < b.ncandidates; i++) {
+            const struct power_stats* st = &b.candidates[i].result.power;
+            printf("%-24s %9.2f%% %8llu %12.1f %13.1f\n",
+                   b.candidates[i].ctl.name,
+                   st->ticks > 0 ? 100.0 * st->throttled / st->ticks : 0,
+                   (unsigned long long)st->denied, st->denied_joules,
+                   st->peak_demand);
+        }
+    }
+    return 0;
+}
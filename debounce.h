@@ -0,0 +1,132 @@
+/**
+ * \file debounce.h
+ *
+ * \brief Debounces every GPIO input at once from snapshots of the GPLEV
+ *        registers, with a vertical counter per line.
+ *
+ * Each line has a two bit counter of the samples in a row that differ from
+ * its debounced state, but the counters are kept "vertically": bit 0 of all
+ * 32 counters of a bank is one word and bit 1 another. A sample updates all
+ * of them with a handful of bitwise operations, whatever the number of lines
+ * in use, and a line changes state after DEBOUNCE_SAMPLES samples in a row
+ * at its new level. Any sample back at the old level starts it over.
+ *
+ * Samples are taken every period_us, so a change is only accepted after it
+ * has held for DEBOUNCE_SAMPLES periods however fast the caller ticks.
+ */
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define DEBOUNCE_BANKS     2    // GPLEV0 and GPLEV1, pins 0-31 and 32-53
+#define DEBOUNCE_SAMPLES   4    // the two bit counters wrap after four
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct debounce_bank {
+    uint32_t state;             // debounced level of each line
+    uint32_t count0, count1;    // bits 0 and 1 of the counters
+    uint32_t rose, fell;        // lines that changed on the last sample
+};
+
+struct debouncer {
+    uint64_t period_us;         // time between samples
+    uint64_t next_us;           // when the next sample is due
+    uint64_t samples;
+    struct debounce_bank banks[DEBOUNCE_BANKS];
+};
+
+/////////////////////////////////////////////////////////////////////
+// Functions
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Starts debouncing with every line stable at its current level
+ *
+ * \param d           the debouncer
+ * \param levels      the GPLEV words, DEBOUNCE_BANKS of them
+ * \param period_us   the time between samples
+ * \param now_us      the current system timer value
+ */
+void debounce_init(struct debouncer* d, const uint32_t* levels,
+                   uint64_t period_us, uint64_t now_us)
+{
+    int b;
+    memset(d, 0, sizeof(*d));
+    d->period_us = period_us;
+    d->next_us = now_us + period_us;
+    for (b = 0; b < DEBOUNCE_BANKS; b++) {
+        d->banks[b].state = levels[b];
+    }
+}
+
+/**
+ * \brief Returns 1 if the next sample is due
+ */
+int debounce_due(const struct debouncer* d, uint64_t now_us)
+{
+    return now_us >= d->next_us;
+}
+
+/**
+ * \brief Feeds one sample of a bank to its counters
+ *
+ * \returns The lines whose debounced state changed
+ */
+uint32_t debounce_bank_update(struct debounce_bank* b, uint32_t sample)
+{
+    uint32_t delta = sample ^ b->state;
+    // lines at their old level reset, the others count up and toggle when
+    // their counter wraps from 3
+    uint32_t toggle = delta & b->count0 & b->count1;
+    b->count1 = (b->count1 ^ b->count0) & delta;
+    b->count0 = ~b->count0 & delta;
+    b->state ^= toggle;
+    b->rose = toggle & b->state;
+    b->fell = toggle & ~b->state;
+    return toggle;
+}
+
+/**
+ * \brief Feeds a sample of every bank to the debouncer
+ *
+ * \param d        the debouncer
+ * \param levels   the GPLEV words, DEBOUNCE_BANKS of them
+ * \param now_us   the current system timer value
+ *
+ * \returns Nonzero if any line changed state
+ */
+uint32_t debounce_sample(struct debouncer* d, const uint32_t* levels,
+                         uint64_t now_us)
+{
+    uint32_t changed = 0;
+    int b;
+    for (b = 0; b < DEBOUNCE_BANKS; b++) {
+        changed |= debounce_bank_update(&d->banks[b], levels[b]);
+    }
+    d->samples++;
+    // keep to the period, but don't try to catch up on missed samples
+    d->next_us += d->period_us;
+    if (d->next_us <= now_us) {
+        d->next_us = now_us + d->period_us;
+    }
+    return changed;
+}
+
+/**
+ * \brief Returns the debounced level of a pin
+ */
+int debounce_level(const struct debouncer* d, int pin)
+{
+    return d->banks[pin / 32].state >> pin % 32 & 1;
+}
+
+#endif
@@ -0,0 +1,188 @@
+/**
+ * \file energy.h
+ *
+ * \brief Heater on time and energy of each zone, integrated from the 64-bit
+ *        system timer, with rolling duty cycles over the last second, minute
+ *        and hour.
+ *
+ * energy_update() is called every tick with the state the heater was just
+ * driven to. On time is only accounted when the state changes or a one
+ * second bucket ends, so on most ticks the update is two comparisons. Each
+ * second's on time goes into a ring of seconds and a ring of minutes, which
+ * the rolling duty cycles are read from.
+ */
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define ENERGY_SECONDS   60     // seconds of history
+#define ENERGY_MINUTES   61     // an hour of whole minutes and the current one
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct energy_zone {
+    double watts;               // heater load when on
+    int on;                     // heater state since mark_us
+    uint64_t mark_us;           // time accounted up to
+    uint64_t second_end_us;     // end of the current second
+    uint64_t second;            // seconds since energy_init()
+
+    uint64_t on_us;             // total on time
+    double joules;              // total energy, at the load of each interval
+    uint64_t elapsed_us;        // total time accounted
+    uint32_t seconds[ENERGY_SECONDS];   // on time in each second, us
+    uint32_t minutes[ENERGY_MINUTES];   // on time in each minute, us
+};
+
+/////////////////////////////////////////////////////////////////////
+// Functions
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Starts accounting a zone with its heater off
+ *
+ * \param ez       the zone
+ * \param watts    the heater load when on
+ * \param now_us   the current system timer value
+ */
+void energy_init(struct energy_zone* ez, double watts, uint64_t now_us)
+{
+    memset(ez, 0, sizeof(*ez));
+    ez->watts = watts;
+    ez->mark_us = now_us;
+    ez->second_end_us = now_us + 1000000;
+}
+
+/**
+ * \brief Accounts dt of the current state into the totals and buckets
+ */
+void energy_add(struct energy_zone* ez, uint64_t dt)
+{
+    ez->elapsed_us += dt;
+    if (ez->on) {
+        ez->on_us += dt;
+        ez->joules += dt * 1e-6 * ez->watts;
+        ez->seconds[ez->second % ENERGY_SECONDS] += dt;
+        ez->minutes[ez->second / 60 % ENERGY_MINUTES] += dt;
+    }
+}
+
+/**
+ * \brief Accounts the time up to now, closing every second bucket passed
+ */
+void energy_advance(struct energy_zone* ez, uint64_t now_us)
+{
+    while (now_us >= ez->second_end_us) {
+        energy_add(ez, ez->second_end_us - ez->mark_us);
+        ez->mark_us = ez->second_end_us;
+        ez->second_end_us += 1000000;
+        ez->second++;
+        ez->seconds[ez->second % ENERGY_SECONDS] = 0;
+        if (ez->second % 60 == 0) {
+            ez->minutes[ez->second / 60 % ENERGY_MINUTES] = 0;
+        }
+    }
+    energy_add(ez, now_us - ez->mark_us);
+    ez->mark_us = now_us;
+}
+
+/**
+ * \brief Records the state the heater of a zone was driven to
+ *
+ * \param ez       the zone
+ * \param on       the heater state
+ * \param now_us   the current system timer value
+ */
+void energy_update(struct energy_zone* ez, int on, uint64_t now_us)
+{
+    if (on == ez->on && now_us < ez->second_end_us) {
+        return;
+    }
+    energy_advance(ez, now_us);
+    ez->on = on;
+}
+
+/**
+ * \brief Changes the heater load of a zone, accounting the time before now
+ *        at the old one
+ */
+void energy_set_watts(struct energy_zone* ez, double watts, uint64_t now_us)
+{
+    energy_advance(ez, now_us);
+    ez->watts = watts;
+}
+
+/**
+ * \brief Returns the duty cycle over up to n whole buckets before the
+ *        current one of a ring
+ */
+double energy_ring_duty(const uint32_t* ring, unsigned size, uint64_t current,
+                        unsigned n, double bucket_us)
+{
+    uint64_t sum = 0;
+    unsigned i, k = current < n ? current : n;
+    for (i = 1; i <= k; i++) {
+        sum += ring[(current - i) % size];
+    }
+    return k > 0 ? sum / (k * bucket_us) : 0;
+}
+
+/**
+ * \brief Returns the duty cycle of the last whole second
+ */
+double energy_duty_second(const struct energy_zone* ez)
+{
+    return energy_ring_duty(ez->seconds, ENERGY_SECONDS, ez->second, 1, 1e6);
+}
+
+/**
+ * \brief Returns the duty cycle of the last whole minute
+ */
+double energy_duty_minute(const struct energy_zone* ez)
+{
+    return energy_ring_duty(ez->minutes, ENERGY_MINUTES, ez->second / 60, 1,
+                            60e6);
+}
+
+/**
+ * \brief Returns the duty cycle of the last hour, or of every whole minute
+ *        so far if that is less
+ */
+double energy_duty_hour(const struct energy_zone* ez)
+{
+    return energy_ring_duty(ez->minutes, ENERGY_MINUTES, ez->second / 60, 60,
+                            60e6);
+}
+
+/**
+ * \brief Returns the energy the heater has used, in joules
+ */
+double energy_joules(const struct energy_zone* ez)
+{
+    return ez->joules;
+}
+
+/**
+ * \brief Prints the on time, energy and duty cycles of a zone
+ */
+void energy_print_stats(const struct energy_zone* ez, int zone)
+{
+    printf("energy: zone %d on %.1f s of %.1f s, duty %.3f, %.1f J "
+           "(%.3f Wh)\n", zone, ez->on_us * 1e-6, ez->elapsed_us * 1e-6,
+           ez->elapsed_us > 0 ? (double)ez->on_us / ez->elapsed_us : 0,
+           energy_joules(ez), energy_joules(ez) / 3600);
+    printf("energy: zone %d duty last second %.3f, last minute %.3f, "
+           "last hour %.3f\n", zone, energy_duty_second(ez),
+           energy_duty_minute(ez), energy_duty_hour(ez));
+}
+
+#endif
@@ -0,0 +1,226 @@
+/**
+ * \file filter_bank.h
+ *
+ * \brief IIR smoothing of many channels at once: a biquad per channel, with
+ *        every coefficient and state kept in its own array so one tick
+ *        updates FILTER_BANK_LANES channels per instruction.
+ *
+ * Each channel is a biquad in transposed direct form II,
+ *
+ *     y  = b0 x + s1
+ *     s1 = b1 x - a1 y + s2
+ *     s2 = b2 x - a2 y
+ *
+ * which covers the first order low-pass used for smoothing as well as any
+ * second order section. The inputs are written to in[], filter_bank_step()
+ * runs every channel and the outputs are read from out[].
+ *
+ * The kernel is picked at compile time: NEON on the Pi (with -mfpu=neon),
+ * AVX (with -mavx) or SSE on hosts, and a scalar loop otherwise. Channels are
+ * padded to a whole number of vectors with zero coefficients, so the kernels
+ * never need a scalar tail.
+ */
+#ifndef FILTER_BANK_H
+#define FILTER_BANK_H
+
+#include <math.h>
+#include <string.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FILTER_BANK_NEON
+#define FILTER_BANK_LANES 4
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define FILTER_BANK_AVX
+#define FILTER_BANK_LANES 8
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define FILTER_BANK_SSE
+#define FILTER_BANK_LANES 4
+#else
+#define FILTER_BANK_LANES 1
+#endif
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define FILTER_BANK_MAX   256   // channels, a multiple of every vector width
+#define FILTER_BANK_ALIGN 32
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+#define FILTER_BANK_ARRAY(name) \
+    float name[FILTER_BANK_MAX] __attribute__((aligned(FILTER_BANK_ALIGN)))
+
+struct filter_bank {
+    int n;                      // channels in use
+    int padded;                 // n rounded up to whole vectors
+    FILTER_BANK_ARRAY(b0);
+    FILTER_BANK_ARRAY(b1);
+    FILTER_BANK_ARRAY(b2);
+    FILTER_BANK_ARRAY(a1);
+    FILTER_BANK_ARRAY(a2);
+    FILTER_BANK_ARRAY(s1);
+    FILTER_BANK_ARRAY(s2);
+    FILTER_BANK_ARRAY(in);
+    FILTER_BANK_ARRAY(out);
+};
+
+/////////////////////////////////////////////////////////////////////
+// Setup
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Empties a bank
+ */
+void filter_bank_init(struct filter_bank* fb)
+{
+    memset(fb, 0, sizeof(*fb));
+}
+
+/**
+ * \brief Adds a channel with the given biquad coefficients, a0 being 1
+ *
+ * \returns The channel, or -1 if the bank is full
+ */
+int filter_bank_add(struct filter_bank* fb, double b0, double b1, double b2,
+                    double a1, double a2)
+{
+    int ch = fb->n;
+    if (ch == FILTER_BANK_MAX) {
+        return -1;
+    }
+    fb->b0[ch] = b0;
+    fb->b1[ch] = b1;
+    fb->b2[ch] = b2;
+    fb->a1[ch] = a1;
+    fb->a2[ch] = a2;
+    fb->s1[ch] = fb->s2[ch] = 0;
+    fb->n++;
+    fb->padded = (fb->n + FILTER_BANK_LANES - 1) /
+                 FILTER_BANK_LANES * FILTER_BANK_LANES;
+    return ch;
+}
+
+/**
+ * \brief Adds a first order low-pass channel
+ *
+ * \param fb      the bank
+ * \param tau_s   the time constant, 0 to pass the input straight through
+ * \param dt_s    the time between steps
+ *
+ * \returns The channel, or -1 if the bank is full
+ */
+int filter_bank_add_lowpass(struct filter_bank* fb, double tau_s, double dt_s)
+{
+    double alpha = tau_s > 0 ? 1 - exp(-dt_s / tau_s) : 1;
+    return filter_bank_add(fb, alpha, 0, 0, alpha - 1, 0);
+}
+
+/**
+ * \brief Settles a channel as if its input had been x for ever
+ */
+void filter_bank_reset(struct filter_bank* fb, int ch, double x)
+{
+    double gain = (fb->b0[ch] + fb->b1[ch] + fb->b2[ch]) /
+                  (1 + fb->a1[ch] + fb->a2[ch]);
+    double y = gain * x;
+    fb->s2[ch] = fb->b2[ch] * x - fb->a2[ch] * y;
+    fb->s1[ch] = fb->b1[ch] * x - fb->a1[ch] * y + fb->s2[ch];
+    fb->in[ch] = x;
+    fb->out[ch] = y;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Kernels
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Runs every channel one step, a channel at a time
+ */
+void filter_bank_step_scalar(struct filter_bank* fb)
+{
+    int i;
+    for (i = 0; i < fb->padded; i++) {
+        float x = fb->in[i];
+        float y = fb->b0[i] * x + fb->s1[i];
+        fb->s1[i] = fb->b1[i] * x - fb->a1[i] * y + fb->s2[i];
+        fb->s2[i] = fb->b2[i] * x - fb->a2[i] * y;
+        fb->out[i] = y;
+    }
+}
+
+/**
+ * \brief Runs every channel one step, FILTER_BANK_LANES at a time
+ */
+void filter_bank_step(struct filter_bank* fb)
+{
+#if defined(FILTER_BANK_NEON)
+    int i;
+    for (i = 0; i < fb->padded; i += 4) {
+        float32x4_t x = vld1q_f32(fb->in + i);
+        float32x4_t y = vmlaq_f32(vld1q_f32(fb->s1 + i),
+                                  vld1q_f32(fb->b0 + i), x);
+        float32x4_t s1 = vmlaq_f32(vld1q_f32(fb->s2 + i),
+                                   vld1q_f32(fb->b1 + i), x);
+        float32x4_t s2 = vmulq_f32(vld1q_f32(fb->b2 + i), x);
+        vst1q_f32(fb->s1 + i, vmlsq_f32(s1, vld1q_f32(fb->a1 + i), y));
+        vst1q_f32(fb->s2 + i, vmlsq_f32(s2, vld1q_f32(fb->a2 + i), y));
+        vst1q_f32(fb->out + i, y);
+    }
+#elif defined(FILTER_BANK_AVX)
+    int i;
+    for (i = 0; i < fb->padded; i += 8) {
+        __m256 x = _mm256_load_ps(fb->in + i);
+        __m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(fb->b0 + i), x),
+                                 _mm256_load_ps(fb->s1 + i));
+        __m256 s1 = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(fb->b1 + i),
+                                                x),
+                                  _mm256_load_ps(fb->s2 + i));
+        __m256 s2 = _mm256_mul_ps(_mm256_load_ps(fb->b2 + i), x);
+        s1 = _mm256_sub_ps(s1, _mm256_mul_ps(_mm256_load_ps(fb->a1 + i), y));
+        s2 = _mm256_sub_ps(s2, _mm256_mul_ps(_mm256_load_ps(fb->a2 + i), y));
+        _mm256_store_ps(fb->s1 + i, s1);
+        _mm256_store_ps(fb->s2 + i, s2);
+        _mm256_store_ps(fb->out + i, y);
+    }
+#elif defined(FILTER_BANK_SSE)
+    int i;
+    for (i = 0; i < fb->padded; i += 4) {
+        __m128 x = _mm_load_ps(fb->in + i);
+        __m128 y = _mm_add_ps(_mm_mul_ps(_mm_load_ps(fb->b0 + i), x),
+                              _mm_load_ps(fb->s1 + i));
+        __m128 s1 = _mm_add_ps(_mm_mul_ps(_mm_load_ps(fb->b1 + i), x),
+                               _mm_load_ps(fb->s2 + i));
+        __m128 s2 = _mm_mul_ps(_mm_load_ps(fb->b2 + i), x);
+        s1 = _mm_sub_ps(s1, _mm_mul_ps(_mm_load_ps(fb->a1 + i), y));
+        s2 = _mm_sub_ps(s2, _mm_mul_ps(_mm_load_ps(fb->a2 + i), y));
+        _mm_store_ps(fb->s1 + i, s1);
+        _mm_store_ps(fb->s2 + i, s2);
+        _mm_store_ps(fb->out + i, y);
+    }
+#else
+    filter_bank_step_scalar(fb);
+#endif
+}
+
+/**
+ * \brief Returns the name of the kernel filter_bank_step() was built with
+ */
+const char* filter_bank_kernel()
+{
+#if defined(FILTER_BANK_NEON)
+    return "neon";
+#elif defined(FILTER_BANK_AVX)
+    return "avx";
+#elif defined(FILTER_BANK_SSE)
+    return "sse";
+#else
+    return "scalar";
+#endif
+}
+
+#endif
@@ -0,0 +1,156 @@
+/*  \file filterbench.c
+ *
+ *  \brief Benchmarks the filter bank against smoothing each zone on its own,
+ *         reporting the cost per channel per tick as the number of zones
+ *         grows.
+ *
+ *      ./filterbench [-t ticks] [-m max_zones]
+ *
+ *  Three ways of running the same low-pass on every zone are timed:
+ *
+ *    - zone    a filter struct per zone, updated one after the other, the way
+ *              smoothing would be added to check_temp()
+ *    - scalar  the filter bank's arrays with filter_bank_step_scalar()
+ *    - bank    filter_bank_step() with the kernel it was built with
+ *
+ *  and the outputs of all three are checked against each other. Build with
+ *  -mavx on an x86 host or -mfpu=neon on the Pi to time those kernels.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "filter_bank.h"
+
+#define DEFAULT_TICKS    (1 << 24)      // channel steps per measurement
+#define INPUT_TICKS      64             // ticks of inputs cycled through
+
+/**
+ * \brief A filter kept with its zone, as a zone by zone loop would have it
+ */
+struct zone_filter {
+    float b0, b1, b2, a1, a2;
+    float s1, s2;
+    float out;
+};
+
+/**
+ * \brief Runs one zone's filter one step
+ */
+void zone_filter_step(struct zone_filter* f, float x)
+{
+    float y = f->b0 * x + f->s1;
+    f->s1 = f->b1 * x - f->a1 * y + f->s2;
+    f->s2 = f->b2 * x - f->a2 * y;
+    f->out = y;
+}
+
+// the readings of every zone over INPUT_TICKS ticks, a ramp so the filters
+// always have work to do, made up front so they cost the same everywhere
+float inputs[INPUT_TICKS][FILTER_BANK_MAX];
+
+/**
+ * \brief Returns the CPU time of the thread in ns
+ */
+double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char* argv[])
+{
+    static struct filter_bank bank, scalar;
+    static struct zone_filter zones[FILTER_BANK_MAX];
+    long ticks_total = DEFAULT_TICKS, t;
+    int max_zones = FILTER_BANK_MAX;
+    int opt, n;
+
+    while ((opt = getopt(argc, argv, "m:t:")) != -1) {
+        switch (opt) {
+        case 'm':
+            max_zones = atoi(optarg);
+            break;
+        case 't':
+            ticks_total = atol(optarg);
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind != 0 || max_zones < 1 || max_zones > FILTER_BANK_MAX ||
+        ticks_total < 1) {
+        printf("Incorrect call to filterbench. The correct format is\n");
+        printf("\t./filterbench [-t channel_steps] [-m max_zones]\n");
+        printf("where max_zones is at most %d\n", FILTER_BANK_MAX);
+        return 1;
+    }
+
+    for (t = 0; t < INPUT_TICKS; t++) {
+        for (n = 0; n < FILTER_BANK_MAX; n++) {
+            inputs[t][n] = 20 + n * 0.1f + t * 0.01f;
+        }
+    }
+    printf("filter bank kernel %s, %d lanes\n", filter_bank_kernel(),
+           FILTER_BANK_LANES);
+    printf("%6s %12s %12s %12s %9s %10s\n", "zones", "zone ns/ch",
+           "scalar ns/ch", "bank ns/ch", "speedup", "max diff");
+    for (n = 1; n <= max_zones; n *= 2) {
+        long ticks = ticks_total / n;
+        double start, zone_ns, scalar_ns, bank_ns, diff = 0;
+        int z;
+
+        filter_bank_init(&bank);
+        filter_bank_init(&scalar);
+        for (z = 0; z < n; z++) {
+            // time constants from 0.5 to 5 s at 100 Hz
+            double tau = 0.5 + 4.5 * z / n;
+            filter_bank_add_lowpass(&bank, tau, 0.01);
+            filter_bank_add_lowpass(&scalar, tau, 0.01);
+            zones[z].b0 = bank.b0[z];
+            zones[z].b1 = bank.b1[z];
+            zones[z].b2 = bank.b2[z];
+            zones[z].a1 = bank.a1[z];
+            zones[z].a2 = bank.a2[z];
+            zones[z].s1 = zones[z].s2 = 0;
+        }
+
+        start = now_ns();
+        for (t = 0; t < ticks; t++) {
+            const float* in = inputs[t % INPUT_TICKS];
+            for (z = 0; z < n; z++) {
+                zone_filter_step(&zones[z], in[z]);
+            }
+        }
+        zone_ns = now_ns() - start;
+
+        start = now_ns();
+        for (t = 0; t < ticks; t++) {
+            memcpy(scalar.in, inputs[t % INPUT_TICKS], n * sizeof(float));
+            filter_bank_step_scalar(&scalar);
+        }
+        scalar_ns = now_ns() - start;
+
+        start = now_ns();
+        for (t = 0; t < ticks; t++) {
+            memcpy(bank.in, inputs[t % INPUT_TICKS], n * sizeof(float));
+            filter_bank_step(&bank);
+        }
+        bank_ns = now_ns() - start;
+
+        for (z = 0; z < n; z++) {
+            diff = fmax(diff, fabs(bank.out[z] - zones[z].out));
+            diff = fmax(diff, fabs(scalar.out[z] - zones[z].out));
+        }
+        printf("%6d %12.2f %12.2f %12.2f %8.2fx %10.2g\n", n,
+               zone_ns / ticks / n, scalar_ns / ticks / n, bank_ns / ticks / n,
+               zone_ns / bank_ns, diff);
+    }
+    return 0;
+}
@@ -0,0 +1,915 @@
+/**
+ * \file log_writer.h
+ *
+ * \brief Asynchronous sample logger. The control loop pushes fixed size
+ *        records into a lock-free single producer ring, and a background
+ *        thread batches them into large aligned writes, rotates the segment
+ *        files by size and age, and hands closed segments to a second thread
+ *        that compresses them.
+ *
+ * Durability uses group commit: written data is made durable with a single
+ * fdatasync once sync_ms has passed or sync_bytes have accumulated, so a power
+ * failure loses at most flush_ms + sync_ms worth of samples. When the logger
+ * starts it repairs the segment that was open when the previous run stopped,
+ * cutting off any torn record at its tail.
+ *
+ * Segments are either text (one line per sample, gzipped once closed) or the
+ * columnar block format from tslog.h, which the logger encodes as samples
+ * arrive and which is already compact enough that it is never gzipped.
+ *
+ * \note The producer side (log_push) never blocks and never makes a system
+ *       call. When the ring is full the record is dropped and counted instead.
+ * \note Given an arena, the ring, the chunk buffer and the block encoders are
+ *       carved from it instead of the heap, and never freed.
+ */
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "arena.h"
+#include "trace.h"
+#include "tslog.h"
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define LOG_RING_SIZE        8192           // records, must be a power of 2
+#define LOG_CHUNK_SIZE       (64 * 1024)    // bytes handed to each write()
+#define LOG_CHUNK_ALIGN      4096           // alignment of the chunk buffer
+#define LOG_POLL_MS          10             // how often the ring is drained
+#define LOG_COMPRESS_QUEUE   16             // closed segments waiting for gzip
+#define LOG_PATH_MAX         256
+#define LOG_LINE_MAX         64             // longest formatted text record
+#define LOG_INDEX_BATCH      128            // index entries buffered per write
+#define LOG_MAX_ZONES        256
+#define LOG_RETRY_MS         10000          // longest wait to retry an open
+
+// Segment formats
+#define LOG_FORMAT_TSB       0              // tslog.h blocks plus .idx file
+#define LOG_FORMAT_TEXT      1              // one text line per sample
+
+// Defaults used when the corresponding log_config field is left at 0
+#define LOG_DEFAULT_PREFIX        "temp"
+#define LOG_DEFAULT_SEGMENT_BYTES (64 * 1024 * 1024)
+#define LOG_DEFAULT_SEGMENT_SECS  3600
+#define LOG_DEFAULT_FLUSH_MS      1000
+#define LOG_DEFAULT_SYNC_MS       1000
+#define LOG_DEFAULT_SYNC_BYTES    (1024 * 1024)
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief One control loop sample, exactly as pushed by the control thread
+ */
+struct log_sample {
+    uint64_t t_us;      // system timer timestamp of the conversion
+    float    temp;      // converted temperature in Celsius
+    uint16_t raw;       // raw 10-bit ADC response
+    uint8_t  zone;      // zone the sample belongs to
+    uint8_t  heater;    // control pin state decided from this sample
+};
+
+/**
+ * \brief Settings for the log writer, fixed once log_start() is called
+ */
+struct log_config {
+    const char* dir;          // directory the segments are written to
+    const char* prefix;       // segment file name prefix
+    size_t segment_bytes;     // rotate once a segment reaches this size
+    unsigned segment_secs;    // rotate once a segment is this old
+    unsigned flush_ms;        // longest time a record waits in memory
+    int compress;             // gzip closed text segments in the background
+    int format;               // LOG_FORMAT_TSB or LOG_FORMAT_TEXT
+    int64_t epoch_offset_us;  // Unix time minus sample time, in us
+    unsigned sync_ms;         // longest time written data stays unsynced
+    size_t sync_bytes;        // sync early once this much is unsynced
+    struct arena* arena;      // buffers are carved from here if set, see
+                              // log_arena_size()
+};
+
+/**
+ * \brief Counters kept by the log writer
+ *
+ * \note pushed and dropped are only written by the producer, everything else
+ *       is only written by the logger threads
+ */
+struct log_stats {
+    uint64_t pushed;            // records accepted into the ring
+    uint64_t dropped;           // records rejected because the ring was full
+    uint64_t written_bytes;     // bytes written to segment files
+    uint64_t writes;            // write() calls made
+    uint64_t write_errors;      // failed writes (the chunk is discarded)
+    uint64_t segments;          // segments opened
+    uint64_t open_errors;       // segments that could not be opened
+    uint64_t blocks;            // tslog blocks encoded
+    uint64_t syncs;             // group commits (one fdatasync per file)
+    uint64_t sync_us;           // total time spent in fdatasync
+    uint64_t recovered_bytes;   // torn tail bytes cut off at startup
+    uint64_t compressed;        // segments successfully compressed
+    uint64_t compress_failed;   // gzip exited with an error
+    uint64_t compress_skipped;  // segments left uncompressed, queue full
+};
+
+struct log_writer {
+    struct log_config config;
+    struct log_stats stats;
+
+    // producer and consumer indices live on their own cache lines so the
+    // control thread and the logger thread don't fight over them
+    uint64_t head;                       // next slot the producer fills
+    char pad0[64 - sizeof(uint64_t)];
+    uint64_t tail;                       // next slot the logger drains
+    char pad1[64 - sizeof(uint64_t)];
+    struct log_sample* ring;
+
+    // state owned by the logger thread
+    pthread_t thread;
+    int running;
+    int fd;
+    unsigned seq;
+    char path[LOG_PATH_MAX];
+    size_t segment_len;
+    struct timespec segment_opened;      // or the last failed attempt
+    int open_failed;                     // the last open failed
+    struct timespec last_flush;
+    char* chunk;
+    size_t chunk_len;
+    size_t unsynced;                     // bytes written since the last sync
+    struct timespec last_sync;
+
+    // block format state, encoders are allocated the first time a zone logs
+    struct tslog_encoder* encoders[LOG_MAX_ZONES];
+    int idx_fd;
+    struct tslog_index_entry idx[LOG_INDEX_BATCH];
+    unsigned idx_len;
+
+    // closed segments waiting for the compressor thread
+    pthread_t compressor;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int compress_stop;
+    unsigned compress_head, compress_tail;
+    char compress_queue[LOG_COMPRESS_QUEUE][LOG_PATH_MAX];
+};
+
+/////////////////////////////////////////////////////////////////////
+// Producer side
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Queues a sample for the logger thread without blocking
+ *
+ * \param lw       the log writer to push to
+ * \param sample   the sample to copy into the ring
+ *
+ * \returns 0 if the sample was queued, -1 if it was dropped
+ */
+int log_push(struct log_writer* lw, const struct log_sample* sample)
+{
+    uint64_t head = lw->head;
+    if (lw->ring == NULL) {
+        return -1;
+    }
+    if (head - __atomic_load_n(&lw->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        lw->stats.dropped++;
+        return -1;
+    }
+    lw->ring[head & (LOG_RING_SIZE - 1)] = *sample;
+    __atomic_store_n(&lw->head, head + 1, __ATOMIC_RELEASE);
+    lw->stats.pushed++;
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Logger thread
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Returns the number of milliseconds between two timestamps
+ */
+long log_elapsed_ms(const struct timespec* from, const struct timespec* to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000 +
+           (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/**
+ * \brief Writes a buffer to a file, retrying short writes
+ *
+ * \returns The number of bytes actually written
+ */
+size_t log_write_all(struct log_writer* lw, int fd, const void* buf, size_t len)
+{
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, (const char*)buf + off, len - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        lw->stats.writes++;
+        if (n <= 0) {
+            lw->stats.write_errors++;
+            break;
+        }
+        off += n;
+    }
+    return off;
+}
+
+/**
+ * \brief Writes out the chunk buffer followed by the index entries of the
+ *        blocks it contains
+ *
+ * \note After a failed or short write only the blocks that made it to the
+ *       file in full are indexed, the rest are dropped.
+ */
+void log_write_chunk(struct log_writer* lw)
+{
+    uint64_t t = trace_begin();
+    uint64_t start = lw->segment_len, end;
+    size_t off = log_write_all(lw, lw->fd, lw->chunk, lw->chunk_len);
+    unsigned n;
+    lw->stats.written_bytes += off;
+    lw->segment_len += off;
+    lw->unsynced += off;
+    // the entries are in chunk order, a block ends where the next one starts
+    for (n = 0; n < lw->idx_len; n++) {
+        end = n + 1 < lw->idx_len ? lw->idx[n + 1].offset
+                                  : start + lw->chunk_len;
+        if (end > start + off) {
+            break;
+        }
+    }
+    lw->chunk_len = 0;
+    if (n > 0) {
+        lw->stats.written_bytes += log_write_all(lw, lw->idx_fd, lw->idx,
+            n * sizeof(struct tslog_index_entry));
+    }
+    lw->idx_len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &lw->last_flush);
+    trace_end("log_flush", t);
+}
+
+/**
+ * \brief Makes everything written so far durable. The data is synced before
+ *        the index so a synced index entry never points at unsynced data.
+ */
+void log_sync(struct log_writer* lw)
+{
+    struct timespec start, end;
+    uint64_t t = trace_begin();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (lw->fd >= 0) {
+        fdatasync(lw->fd);
+    }
+    if (lw->idx_fd >= 0) {
+        fdatasync(lw->idx_fd);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    lw->stats.syncs++;
+    lw->stats.sync_us += (end.tv_sec - start.tv_sec) * 1000000 +
+                         (end.tv_nsec - start.tv_nsec) / 1000;
+    lw->unsynced = 0;
+    lw->last_sync = end;
+    trace_end("log_sync", t);
+}
+
+/**
+ * \brief Runs a group commit if enough data or time has built up
+ */
+void log_maybe_sync(struct log_writer* lw, const struct timespec* now)
+{
+    if (lw->unsynced > 0 &&
+        (lw->unsynced >= lw->config.sync_bytes ||
+         log_elapsed_ms(&lw->last_sync, now) >= (long)lw->config.sync_ms)) {
+        log_sync(lw);
+    }
+}
+
+/**
+ * \brief Syncs the log directory so newly created segment names survive a
+ *        power failure along with their contents
+ */
+void log_sync_dir(const struct log_writer* lw)
+{
+    int fd = open(lw->config.dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/**
+ * \brief Moves a finished block from an encoder into the chunk buffer and
+ *        records it in the index
+ */
+void log_finish_block(struct log_writer* lw, struct tslog_encoder* e)
+{
+    struct tslog_index_entry* entry;
+    if (e->count == 0) {
+        return;
+    }
+    if (LOG_CHUNK_SIZE - lw->chunk_len < TSLOG_BLOCK_MAX ||
+        lw->idx_len == LOG_INDEX_BATCH) {
+        log_write_chunk(lw);
+    }
+    entry = &lw->idx[lw->idx_len++];
+    memset(entry, 0, sizeof(*entry));
+    entry->t_first = e->t_first;
+    entry->t_last = e->t_prev;
+    entry->offset = lw->segment_len + lw->chunk_len;
+    entry->count = e->count;
+    entry->zone = e->zone;
+    lw->chunk_len += tslog_encoder_finish(e, (uint8_t*)lw->chunk + lw->chunk_len);
+    lw->stats.blocks++;
+}
+
+/**
+ * \brief Closes the partial block of every zone so it can be written out
+ */
+void log_finish_blocks(struct log_writer* lw)
+{
+    unsigned i;
+    for (i = 0; i < LOG_MAX_ZONES; i++) {
+        if (lw->encoders[i] != NULL) {
+            log_finish_block(lw, lw->encoders[i]);
+        }
+    }
+}
+
+/**
+ * \brief Hands a closed segment to the compressor thread, or counts it as
+ *        skipped if the compressor has fallen too far behind
+ */
+void log_queue_compress(struct log_writer* lw, const char* path)
+{
+    pthread_mutex_lock(&lw->lock);
+    if (lw->compress_head - lw->compress_tail >= LOG_COMPRESS_QUEUE) {
+        lw->stats.compress_skipped++;
+    } else {
+        strcpy(lw->compress_queue[lw->compress_head % LOG_COMPRESS_QUEUE], path);
+        lw->compress_head++;
+        pthread_cond_signal(&lw->wake);
+    }
+    pthread_mutex_unlock(&lw->lock);
+}
+
+/**
+ * \brief Flushes and closes the current segment (if any)
+ */
+void log_close_segment(struct log_writer* lw)
+{
+    if (lw->fd < 0) {
+        return;
+    }
+    if (lw->config.format == LOG_FORMAT_TSB) {
+        log_finish_blocks(lw);
+    }
+    if (lw->chunk_len > 0 || lw->idx_len > 0) {
+        log_write_chunk(lw);
+    }
+    // closed segments are always complete on disk before they are compressed
+    log_sync(lw);
+    close(lw->fd);
+    lw->fd = -1;
+    if (lw->idx_fd >= 0) {
+        close(lw->idx_fd);
+        lw->idx_fd = -1;
+    }
+    if (lw->config.compress && lw->config.format == LOG_FORMAT_TEXT) {
+        log_queue_compress(lw, lw->path);
+    }
+}
+
+/**
+ * \brief Opens the next segment file in the log directory
+ *
+ * \returns 0 on success, -1 if the file could not be created
+ */
+int log_open_segment(struct log_writer* lw)
+{
+    int tsb = lw->config.format == LOG_FORMAT_TSB;
+    unsigned seq = lw->seq + 1;
+    snprintf(lw->path, sizeof(lw->path), "%s/%s-%06u.%s",
+             lw->config.dir, lw->config.prefix, seq, tsb ? "tsb" : "log");
+    lw->fd = open(lw->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (lw->fd < 0) {
+        printf("can't open log segment %s: %s\n", lw->path, strerror(errno));
+        return -1;
+    }
+    lw->segment_len = 0;
+    if (tsb) {
+        char idx_path[LOG_PATH_MAX];
+        struct tslog_file_header h;
+        snprintf(idx_path, sizeof(idx_path), "%s/%s-%06u.idx",
+                 lw->config.dir, lw->config.prefix, seq);
+        lw->idx_fd = open(idx_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (lw->idx_fd < 0) {
+            printf("can't open log index %s: %s\n", idx_path, strerror(errno));
+            close(lw->fd);
+            lw->fd = -1;
+            return -1;
+        }
+        memset(&h, 0, sizeof(h));
+        h.magic = TSLOG_FILE_MAGIC;
+        h.version = TSLOG_VERSION;
+        h.header_size = sizeof(h);
+        h.epoch_offset_us = lw->config.epoch_offset_us;
+        memcpy(lw->chunk, &h, sizeof(h));
+        lw->chunk_len = sizeof(h);
+    }
+    // the number is only used up once the segment exists
+    lw->seq = seq;
+    lw->stats.segments++;
+    log_sync_dir(lw);
+    clock_gettime(CLOCK_MONOTONIC, &lw->segment_opened);
+    return 0;
+}
+
+/**
+ * \brief Closes the current segment and opens the next one if the current
+ *        one has grown too large or too old
+ *
+ * \note While segments can't be opened (disk full, permissions) an open is
+ *       only retried once per segment age or LOG_RETRY_MS, whichever is
+ *       sooner, rather than on every poll.
+ */
+void log_maybe_rotate(struct log_writer* lw, const struct timespec* now)
+{
+    long age_ms = log_elapsed_ms(&lw->segment_opened, now);
+    long max_age_ms = (long)lw->config.segment_secs * 1000;
+    if (lw->fd >= 0 &&
+        lw->segment_len + lw->chunk_len < lw->config.segment_bytes &&
+        age_ms < max_age_ms) {
+        return;
+    }
+    if (lw->fd < 0 && lw->open_failed &&
+        age_ms < (max_age_ms < LOG_RETRY_MS ? max_age_ms : LOG_RETRY_MS)) {
+        return;
+    }
+    log_close_segment(lw);
+    lw->open_failed = log_open_segment(lw) < 0;
+    if (lw->open_failed) {
+        lw->stats.open_errors++;
+        lw->segment_opened = *now;
+    }
+}
+
+/**
+ * \brief Formats a sample as a text line in the chunk buffer
+ */
+void log_append_text(struct log_writer* lw, const struct log_sample* s,
+                     const struct timespec* now)
+{
+    int len;
+    if (LOG_CHUNK_SIZE - lw->chunk_len < LOG_LINE_MAX) {
+        log_write_chunk(lw);
+        log_maybe_rotate(lw, now);
+    }
+    len = snprintf(lw->chunk + lw->chunk_len, LOG_LINE_MAX,
+                   "%llu %u %.3f %u %u\n", (unsigned long long)s->t_us,
+                   s->zone, s->temp, s->raw, s->heater);
+    if (len < 0) {
+        return;
+    }
+    // a line that didn't fit was cut short, it still ends the line
+    if (len >= LOG_LINE_MAX) {
+        len = LOG_LINE_MAX - 1;
+        lw->chunk[lw->chunk_len + len - 1] = '\n';
+    }
+    lw->chunk_len += len;
+}
+
+/**
+ * \brief Adds a sample to the block encoder of its zone, moving the block
+ *        into the chunk buffer once it is full
+ */
+void log_append_block(struct log_writer* lw, const struct log_sample* s,
+                      const struct timespec* now)
+{
+    struct tslog_encoder* e = lw->encoders[s->zone];
+    if (e == NULL) {
+        e = lw->encoders[s->zone] = lw->config.arena != NULL
+            ? ARENA_NEW(lw->config.arena, struct tslog_encoder, 1)
+            : malloc(sizeof(struct tslog_encoder));
+        if (e == NULL) {
+            lw->stats.write_errors++;
+            return;
+        }
+        tslog_encoder_init(e, s->zone);
+    }
+    if (tslog_encoder_add(e, s->t_us, s->raw, s->temp, s->heater)) {
+        log_finish_block(lw, e);
+        if (lw->chunk_len == 0) {
+            log_maybe_rotate(lw, now);
+        }
+    }
+}
+
+/**
+ * \brief Drains every record currently in the ring into the chunk buffer,
+ *        writing the buffer out each time it fills and whenever the flush
+ *        interval has passed
+ */
+void log_service(struct log_writer* lw)
+{
+    struct timespec now;
+    uint64_t tail = lw->tail;
+    uint64_t head = __atomic_load_n(&lw->head, __ATOMIC_ACQUIRE);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    log_maybe_rotate(lw, &now);
+    if (lw->fd < 0) {
+        // nowhere to write, discard rather than let the producer stall
+        __atomic_store_n(&lw->tail, head, __ATOMIC_RELEASE);
+        return;
+    }
+
+    for (; tail != head; tail++) {
+        const struct log_sample* s = &lw->ring[tail & (LOG_RING_SIZE - 1)];
+        if (lw->config.format == LOG_FORMAT_TSB) {
+            log_append_block(lw, s, &now);
+        } else {
+            log_append_text(lw, s, &now);
+        }
+        // release slots in batches so the producer sees free space early
+        if ((tail & 255) == 255) {
+            __atomic_store_n(&lw->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_store_n(&lw->tail, tail, __ATOMIC_RELEASE);
+
+    if (lw->fd >= 0 &&
+        log_elapsed_ms(&lw->last_flush, &now) >= (long)lw->config.flush_ms) {
+        if (lw->config.format == LOG_FORMAT_TSB) {
+            log_finish_blocks(lw);
+        }
+        if (lw->chunk_len > 0) {
+            log_write_chunk(lw);
+        }
+    }
+    if (lw->fd >= 0) {
+        log_maybe_sync(lw, &now);
+    }
+}
+
+/**
+ * \brief Body of the logger thread
+ */
+void* log_thread(void* arg)
+{
+    struct log_writer* lw = arg;
+    struct timespec poll = { 0, LOG_POLL_MS * 1000000L };
+
+    trace_thread("logger");
+    while (__atomic_load_n(&lw->running, __ATOMIC_ACQUIRE)) {
+        uint64_t t = trace_begin();
+        log_service(lw);
+        trace_end("log_service", t);
+        nanosleep(&poll, NULL);
+    }
+    // pick up whatever the producer pushed before it stopped
+    log_service(lw);
+    log_close_segment(lw);
+    return NULL;
+}
+
+/**
+ * \brief Body of the compressor thread, which gzips closed segments one at a
+ *        time so the logger thread never waits on compression
+ */
+void* log_compress_thread(void* arg)
+{
+    extern char** environ;
+    struct log_writer* lw = arg;
+    char path[LOG_PATH_MAX];
+
+    trace_thread("compressor");
+    pthread_mutex_lock(&lw->lock);
+    for (;;) {
+        pid_t pid;
+        int status;
+        uint64_t t;
+        char* argv[] = { "gzip", "-f", "-q", path, NULL };
+
+        while (lw->compress_tail == lw->compress_head && !lw->compress_stop) {
+            pthread_cond_wait(&lw->wake, &lw->lock);
+        }
+        if (lw->compress_tail == lw->compress_head) {
+            break;
+        }
+        strcpy(path, lw->compress_queue[lw->compress_tail % LOG_COMPRESS_QUEUE]);
+        lw->compress_tail++;
+        pthread_mutex_unlock(&lw->lock);
+
+        t = trace_begin();
+        if (posix_spawnp(&pid, "gzip", NULL, NULL, argv, environ) == 0 &&
+            waitpid(pid, &status, 0) == pid &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            lw->stats.compressed++;
+        } else {
+            lw->stats.compress_failed++;
+        }
+        trace_end("compress", t);
+        pthread_mutex_lock(&lw->lock);
+    }
+    pthread_mutex_unlock(&lw->lock);
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Setup and teardown
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Finds the highest segment number already in the log directory so a
+ *        restarted logger never overwrites an earlier run
+ */
+unsigned log_last_seq(const struct log_config* config)
+{
+    DIR* dir = opendir(config->dir);
+    struct dirent* ent;
+    size_t len = strlen(config->prefix);
+    unsigned last = 0;
+
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, config->prefix, len) == 0 &&
+            ent->d_name[len] == '-') {
+            unsigned seq = strtoul(ent->d_name + len + 1, NULL, 10);
+            last = seq > last ? seq : last;
+        }
+    }
+    closedir(dir);
+    return last;
+}
+
+/**
+ * \brief Repairs the segment that was being written when the previous run
+ *        stopped: a block segment is cut back to its last intact block and its
+ *        index rebuilt, a text segment is cut back to its last full line and
+ *        queued for compression
+ */
+void log_recover(struct log_writer* lw)
+{
+    char path[LOG_PATH_MAX], idx_path[LOG_PATH_MAX];
+    int fd, idx_fd;
+    int64_t cut;
+
+    if (lw->seq == 0) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%s-%06u.tsb",
+             lw->config.dir, lw->config.prefix, lw->seq);
+    snprintf(idx_path, sizeof(idx_path), "%s/%s-%06u.idx",
+             lw->config.dir, lw->config.prefix, lw->seq);
+    if ((fd = open(path, O_RDWR)) >= 0) {
+        idx_fd = open(idx_path, O_RDWR | O_CREAT, 0644);
+        cut = idx_fd >= 0 ? tslog_recover(fd, idx_fd) : -1;
+        if (cut < 0) {
+            // not even the file header made it to disk
+            printf("discarding unrecoverable log segment %s\n", path);
+            unlink(path);
+            unlink(idx_path);
+        } else {
+            lw->stats.recovered_bytes += cut;
+            fdatasync(fd);
+            fdatasync(idx_fd);
+        }
+        close(fd);
+        if (idx_fd >= 0) {
+            close(idx_fd);
+        }
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s-%06u.log",
+             lw->config.dir, lw->config.prefix, lw->seq);
+    if ((fd = open(path, O_RDWR)) >= 0) {
+        char buf[LOG_LINE_MAX];
+        off_t end = lseek(fd, 0, SEEK_END);
+        off_t keep = end;
+        // walk back to the newline that ends the last complete line
+        while (keep > 0) {
+            off_t from = keep > LOG_LINE_MAX ? keep - LOG_LINE_MAX : 0;
+            ssize_t n = pread(fd, buf, keep - from, from);
+            while (n > 0 && buf[n - 1] != '\n') {
+                n--;
+            }
+            if (n > 0 || from == 0) {
+                keep = from + (n > 0 ? n : 0);
+                break;
+            }
+            keep = from;
+        }
+        if (keep < end && ftruncate(fd, keep) == 0) {
+            lw->stats.recovered_bytes += end - keep;
+            fdatasync(fd);
+        }
+        close(fd);
+        if (lw->config.compress) {
+            log_queue_compress(lw, path);
+        }
+    }
+}
+
+/**
+ * \brief Returns the arena space a log writer needs for up to zones zones
+ */
+size_t log_arena_size(unsigned zones)
+{
+    return ARENA_SIZE(LOG_RING_SIZE * sizeof(struct log_sample), ARENA_ALIGN) +
+           ARENA_SIZE(LOG_CHUNK_SIZE, LOG_CHUNK_ALIGN) +
+           zones * ARENA_SIZE(sizeof(struct tslog_encoder), ARENA_ALIGN);
+}
+
+/**
+ * \brief Frees the block encoders, unless they came from an arena
+ */
+void log_free_encoders(struct log_writer* lw)
+{
+    unsigned i;
+    for (i = 0; i < LOG_MAX_ZONES; i++) {
+        if (lw->config.arena == NULL) {
+            free(lw->encoders[i]);
+        }
+        lw->encoders[i] = NULL;
+    }
+}
+
+/**
+ * \brief Creates the log directory and opens the first segment, without
+ *        starting any threads
+ *
+ * A program with a single thread can use the log writer this way: it calls
+ * log_push() and then log_service() itself, and log_close() at the end.
+ * Closed text segments are only compressed with log_start().
+ *
+ * \param lw       the log writer to set up
+ * \param config   the log settings (zero fields are replaced by defaults)
+ *
+ * \returns 0 on success, -1 on failure
+ */
+int log_open(struct log_writer* lw, const struct log_config* config)
+{
+    memset(lw, 0, sizeof(*lw));
+    lw->config = *config;
+    lw->fd = -1;
+    lw->idx_fd = -1;
+    if (lw->config.prefix == NULL) {
+        lw->config.prefix = LOG_DEFAULT_PREFIX;
+    }
+    if (lw->config.segment_bytes == 0) {
+        lw->config.segment_bytes = LOG_DEFAULT_SEGMENT_BYTES;
+    }
+    if (lw->config.segment_secs == 0) {
+        lw->config.segment_secs = LOG_DEFAULT_SEGMENT_SECS;
+    }
+    if (lw->config.flush_ms == 0) {
+        lw->config.flush_ms = LOG_DEFAULT_FLUSH_MS;
+    }
+    if (lw->config.sync_ms == 0) {
+        lw->config.sync_ms = LOG_DEFAULT_SYNC_MS;
+    }
+    if (lw->config.sync_bytes == 0) {
+        lw->config.sync_bytes = LOG_DEFAULT_SYNC_BYTES;
+    }
+    pthread_mutex_init(&lw->lock, NULL);
+    pthread_cond_init(&lw->wake, NULL);
+
+    if (mkdir(lw->config.dir, 0755) < 0 && errno != EEXIST) {
+        printf("can't create log directory %s: %s\n", lw->config.dir,
+               strerror(errno));
+        return -1;
+    }
+    if (lw->config.arena != NULL) {
+        lw->ring = ARENA_NEW(lw->config.arena, struct log_sample,
+                             LOG_RING_SIZE);
+        lw->chunk = arena_alloc(lw->config.arena, LOG_CHUNK_SIZE,
+                                LOG_CHUNK_ALIGN);
+    } else {
+        lw->ring = calloc(LOG_RING_SIZE, sizeof(struct log_sample));
+        if (posix_memalign((void**)&lw->chunk, LOG_CHUNK_ALIGN,
+                           LOG_CHUNK_SIZE)) {
+            lw->chunk = NULL;
+        }
+    }
+    if (lw->ring == NULL || lw->chunk == NULL) {
+        printf("can't allocate log buffers\n");
+        return -1;
+    }
+    lw->seq = log_last_seq(&lw->config);
+    log_recover(lw);
+    if (log_open_segment(lw) < 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &lw->last_flush);
+    lw->last_sync = lw->last_flush;
+    return 0;
+}
+
+/**
+ * \brief Creates the log directory, opens the first segment and starts the
+ *        logger and compressor threads
+ *
+ * \param lw       the log writer to start
+ * \param config   the log settings (zero fields are replaced by defaults)
+ *
+ * \returns 0 on success, -1 on failure
+ */
+int log_start(struct log_writer* lw, const struct log_config* config)
+{
+    if (log_open(lw, config) < 0) {
+        return -1;
+    }
+    lw->running = 1;
+    if (pthread_create(&lw->compressor, NULL, log_compress_thread, lw) ||
+        pthread_create(&lw->thread, NULL, log_thread, lw)) {
+        printf("can't start logger threads\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Stops the logger thread after it has written every queued record,
+ *        then waits for the compressor to finish the segments it was given
+ */
+void log_stop(struct log_writer* lw)
+{
+    if (!lw->running) {
+        return;
+    }
+    __atomic_store_n(&lw->running, 0, __ATOMIC_RELEASE);
+    pthread_join(lw->thread, NULL);
+
+    pthread_mutex_lock(&lw->lock);
+    lw->compress_stop = 1;
+    pthread_cond_signal(&lw->wake);
+    pthread_mutex_unlock(&lw->lock);
+    pthread_join(lw->compressor, NULL);
+
+    log_free_encoders(lw);
+}
+
+/**
+ * \brief Writes out every queued record and closes a log writer set up with
+ *        log_open()
+ */
+void log_close(struct log_writer* lw)
+{
+    log_service(lw);
+    log_close_segment(lw);
+    log_free_encoders(lw);
+}
+
+/**
+ * \brief Prints the logger counters to the console
+ */
+void log_print_stats(const struct log_writer* lw)
+{
+    const struct log_stats* s = &lw->stats;
+    printf("log: %llu records, %llu dropped, %llu bytes in %llu writes "
+           "(%llu failed)\n",
+           (unsigned long long)s->pushed, (unsigned long long)s->dropped,
+           (unsigned long long)s->written_bytes,
+           (unsigned long long)s->writes,
+           (unsigned long long)s->write_errors);
+    printf("log: %llu segments (%llu failed to open), %llu compressed, "
+           "%llu compress failures, %llu left uncompressed\n",
+           (unsigned long long)s->segments,
+           (unsigned long long)s->open_errors,
+           (unsigned long long)s->compressed,
+           (unsigned long long)s->compress_failed,
+           (unsigned long long)s->compress_skipped);
+    printf("log: %llu syncs averaging %.0f us, %llu torn bytes recovered\n",
+           (unsigned long long)s->syncs,
+           s->syncs ? (double)s->sync_us / s->syncs : 0.0,
+           (unsigned long long)s->recovered_bytes);
+    if (lw->config.format == LOG_FORMAT_TSB && s->pushed > 0 &&
+        s->written_bytes > 0) {
+        printf("log: %llu blocks, %.1fx smaller than fixed size records\n",
+               (unsigned long long)s->blocks,
+               (double)s->pushed * sizeof(struct log_sample) /
+               s->written_bytes);
+    }
+}
+
+#endif
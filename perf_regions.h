@@ -0,0 +1,233 @@
+/**
+ * \file perf_regions.h
+ *
+ * \brief Optional hardware counter sampling around named code regions, to
+ *        tell whether a region is bound by uncached register accesses,
+ *        branch misses, cache misses or being descheduled.
+ *
+ * The counters are opened once with perf_event_open() as a single group on
+ * the calling thread, so one read() returns all of them at the same instant.
+ * A region is only measured on one call in every N, since each read is a
+ * system call that would otherwise dominate a short region.
+ *
+ * Usage:
+ *     struct perf_region region = PERF_REGION("check_temp");
+ *     perf_region_begin(&region);
+ *     ...
+ *     perf_region_end(&region);
+ *
+ * \note When the counters cannot be opened (no PMU, perf_event_paranoid, no
+ *       kernel support) a message is printed once and the region calls do
+ *       nothing. Counters the PMU does not have are left out of the report.
+ */
+#ifndef PERF_REGIONS_H
+#define PERF_REGIONS_H
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define PERF_NCOUNTERS   5
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct perf_region {
+    const char* name;
+    uint64_t calls;                     // times the region was entered
+    uint64_t samples;                   // times it was measured
+    int active;                         // set between a sampled begin and end
+    uint64_t start[PERF_NCOUNTERS];
+    uint64_t total[PERF_NCOUNTERS];     // sums over the measured calls
+};
+
+#define PERF_REGION(name)   { name, 0, 0, 0, { 0 }, { 0 } }
+
+const struct {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} perf_counters[PERF_NCOUNTERS] = {
+    { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+// group leader fd, -1 while sampling is off
+int perf_fd = -1;
+// each counter's fd and position in a group read, -1 if it did not open
+int perf_fds[PERF_NCOUNTERS];
+int perf_slot[PERF_NCOUNTERS];
+int perf_nopen = 0;
+unsigned perf_every = 1;
+
+/////////////////////////////////////////////////////////////////////
+// Functions
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Opens the counters for the calling thread
+ *
+ * \param every   measure one call in this many for each region
+ *
+ * \returns 0 if at least one counter is counting, -1 otherwise
+ */
+int perf_open(unsigned every)
+{
+    struct perf_event_attr attr;
+    int i, fd, err = 0;
+
+    perf_every = every > 0 ? every : 1;
+    for (i = 0; i < PERF_NCOUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_counters[i].type;
+        attr.config = perf_counters[i].config;
+        attr.disabled = perf_fd < 0;
+        // software events such as context switches are counted by the
+        // kernel, so excluding it would leave them at 0
+        attr.exclude_kernel = perf_counters[i].type != PERF_TYPE_SOFTWARE;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, perf_fd, 0);
+        perf_fds[i] = fd;
+        if (fd < 0) {
+            perf_slot[i] = -1;
+            err = errno;
+            continue;
+        }
+        if (perf_fd < 0) {
+            perf_fd = fd;
+        }
+        perf_slot[i] = perf_nopen++;
+    }
+    if (perf_fd < 0) {
+        printf("perf: counters unavailable (%s), region sampling off\n",
+               strerror(err));
+        return -1;
+    }
+    for (i = 0; i < PERF_NCOUNTERS; i++) {
+        if (perf_slot[i] < 0) {
+            printf("perf: %s unavailable\n", perf_counters[i].name);
+        }
+    }
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+}
+
+/**
+ * \brief Reads every open counter at once
+ *
+ * \returns 0 on success, -1 if the read failed
+ */
+int perf_read(uint64_t* values)
+{
+    uint64_t buf[1 + PERF_NCOUNTERS];
+    int i;
+    if (read(perf_fd, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t) ||
+        buf[0] != (uint64_t)perf_nopen) {
+        return -1;
+    }
+    for (i = 0; i < PERF_NCOUNTERS; i++) {
+        values[i] = perf_slot[i] >= 0 ? buf[1 + perf_slot[i]] : 0;
+    }
+    return 0;
+}
+
+/**
+ * \brief Marks the start of a region, taking a reading if this call is
+ *        sampled
+ */
+void perf_region_begin(struct perf_region* r)
+{
+    if (perf_fd < 0 || r->calls++ % perf_every != 0) {
+        return;
+    }
+    r->active = perf_read(r->start) == 0;
+}
+
+/**
+ * \brief Marks the end of a region, adding the counts since
+ *        perf_region_begin() to the region's totals if it was sampled
+ */
+void perf_region_end(struct perf_region* r)
+{
+    uint64_t now[PERF_NCOUNTERS];
+    int i;
+    if (!r->active) {
+        return;
+    }
+    r->active = 0;
+    if (perf_read(now) < 0) {
+        return;
+    }
+    for (i = 0; i < PERF_NCOUNTERS; i++) {
+        r->total[i] += now[i] - r->start[i];
+    }
+    r->samples++;
+}
+
+/**
+ * \brief Prints the average counts per measured call of each region
+ *
+ * \param regions    the regions to report
+ * \param nregions   the number of regions
+ */
+void perf_print_regions(const struct perf_region* const* regions,
+                        int nregions)
+{
+    int i, c;
+    if (perf_fd < 0) {
+        return;
+    }
+    for (i = 0; i < nregions; i++) {
+        const struct perf_region* r = regions[i];
+        printf("perf: %-16s %llu of %llu calls sampled\n", r->name,
+               (unsigned long long)r->samples, (unsigned long long)r->calls);
+        if (r->samples == 0) {
+            continue;
+        }
+        for (c = 0; c < PERF_NCOUNTERS; c++) {
+            if (perf_slot[c] >= 0) {
+                printf("perf: %-16s   %-16s %12.1f per call\n", "",
+                       perf_counters[c].name,
+                       (double)r->total[c] / r->samples);
+            }
+        }
+        if (perf_slot[0] >= 0 && perf_slot[1] >= 0 && r->total[0] > 0) {
+            printf("perf: %-16s   %-16s %12.2f\n", "", "ipc",
+                   (double)r->total[1] / r->total[0]);
+        }
+    }
+}
+
+/**
+ * \brief Closes the counters
+ */
+void perf_close()
+{
+    int i;
+    if (perf_fd < 0) {
+        return;
+    }
+    for (i = PERF_NCOUNTERS - 1; i >= 0; i--) {
+        if (perf_fds[i] >= 0) {
+            close(perf_fds[i]);
+        }
+    }
+    perf_fd = -1;
+}
+
+#endif
@@ -0,0 +1,431 @@
+/**
+ * \file pi_helpers.c
+ *
+ * \brief The Raspberry Pi helpers built into libpihelpers: mapping the
+ *        peripherals, pin functions and pulls, checked pin accesses, sleeps
+ *        and SPI setup. The per tick accessors are inline in pi_helpers.h.
+ */
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include "pi_helpers.h"
+
+// Pointer that will be memory mapped when pioInit() is called
+volatile unsigned int *gpio; //pointer to base of gpio
+
+// Pointer that will be memory mapped when pTimerInit() is called
+volatile unsigned int *sys_timer; //pointer to base of sys_timer
+
+// Pointer that will be memory mapped when spiInit() is called
+volatile unsigned int *spi0; //pointer to base of spi0
+
+// Set when PI_HELPERS_MEM points the register blocks at a file shared with
+// plantsim instead of /dev/mem. Plain memory has none of the side effects of
+// the real registers, so the few places relying on them tell plantsim what
+// the hardware would have done (see plantsim.c).
+int pi_emulated = 0;
+
+// Set by pio_init() on a BCM2711 (Pi 4), which has the newer pull registers
+int pi_bcm2711 = 0;
+
+/////////////////////////////////////////////////////////////////////
+// Rasperry Pi Helper Functions
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Maps one 4KB peripheral register block from /dev/mem
+ *
+ * \param base   the physical address of the register block
+ * \param name   the name of the peripheral, for error messages
+ *
+ * \returns A pointer to the mapped registers (exits on failure)
+ *
+ * \note /dev/mem is only opened once, however many blocks get mapped, and is
+ *       kept open so later init calls don't pay for the open again
+ * \note If PI_HELPERS_MEM names a file, it is mapped instead of /dev/mem, at
+ *       the offset of the block from the start of the peripheral window
+ */
+volatile unsigned int* map_peripheral(off_t base, const char* name)
+{
+    static int mem_fd = -1;
+    static const char* emulated = NULL;
+    void *reg_map;
+
+#ifdef PI_REGTRACE
+    // a replay runs without the hardware, on zeroed pages; a run recorded
+    // against plantsim is replayed with PI_HELPERS_MEM set as well, so it
+    // makes the accesses emulation adds
+    if (regtrace_init() == REGTRACE_REPLAY) {
+        pi_emulated = getenv("PI_HELPERS_MEM") != NULL;
+        return regtrace_map(calloc(1, BLOCK_SIZE), name);
+    }
+#endif
+
+    if (mem_fd < 0 && (emulated = getenv("PI_HELPERS_MEM")) != NULL) {
+        if ((mem_fd = open(emulated, O_RDWR)) < 0) {
+            printf("can't open %s \n", emulated);
+            exit(-1);
+        }
+        pi_emulated = 1;
+    }
+    // /dev/mem is a psuedo-driver for accessing memory in the Linux filesystem
+    if (mem_fd < 0 && (mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
+        printf("can't open /dev/mem \n");
+        exit(-1);
+    }
+    if (pi_emulated) {
+        base -= BCM2836_PERI_BASE;
+    }
+
+    reg_map = mmap(
+        NULL,                 //Address at which to start local mapping (null means don't-care)
+        BLOCK_SIZE,           //Size of mapped memory block
+        PROT_READ|PROT_WRITE, // Enable both reading and writing to the mapped memory
+        MAP_SHARED,           // This program does not have exclusive access to this memory
+        mem_fd,               // Map to /dev/mem
+        base);                // Offset to the peripheral
+
+    if (reg_map == MAP_FAILED) {
+        printf("%s mmap error %p\n", name, reg_map);
+        exit(-1);
+    }
+
+#ifdef PI_REGTRACE
+    return regtrace_map((volatile unsigned *)reg_map, name);
+#else
+    return (volatile unsigned *)reg_map;
+#endif
+}
+
+/**
+ * \brief Returns 1 if the device tree says this is a BCM2711
+ */
+int pi_is_bcm2711()
+{
+    char buf[256];
+    size_t len, i;
+    FILE* f = fopen("/proc/device-tree/compatible", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+    // a list of NUL terminated strings, most specific first
+    for (i = 0; i < len; i += strlen(buf + i) + 1) {
+        if (strcmp(buf + i, "brcm,bcm2711") == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Maps memory used by GPIO functions
+ *
+ * \note Must be run as sudo
+ */
+void pio_init() {
+    gpio = map_peripheral(GPIO_BASE, "gpio");
+    pi_bcm2711 = !pi_emulated && pi_is_bcm2711();
+}
+
+/**
+ * \brief Starts an empty batch of pin function changes
+ */
+void fsel_batch_init(struct fsel_batch* batch)
+{
+    int i;
+    for (i = 0; i < GPFSEL_WORDS; i++) {
+        batch->mask[i] = batch->value[i] = 0;
+    }
+}
+
+/**
+ * \brief Adds a pin to a batch of function changes, replacing an earlier
+ *        change of the same pin
+ *
+ * \param batch      the batch
+ * \param pin        the pin to set the mode of
+ * \param function   the new GPFSEL value for the specified pin
+ *
+ * \returns 0 on success, -1 if the pin or function is not valid
+ */
+int fsel_batch_add(struct fsel_batch* batch, int pin, int function)
+{
+    unsigned int offset, shift;
+    if (pin > 53 || pin < 0) {
+        printf("bad pin, got pin %d\n", pin);
+        return -1;
+    } else if (function > 7 || function < 0) {
+        printf("bad function, got function %d\n", function);
+        return -1;
+    }
+    offset = pin / 10;
+    shift = (pin % 10) * 3;
+    batch->mask[offset] |= 7u << shift;
+    batch->value[offset] = (batch->value[offset] & ~(7u << shift)) |
+                           (unsigned int)function << shift;
+    return 0;
+}
+
+/**
+ * \brief Sets the functions of every pin in a batch
+ *
+ * \note Each GPFSEL word the batch touches is read and written once, so a
+ *       pin goes straight from its old function to its new one.
+ */
+void fsel_batch_apply(const struct fsel_batch* batch)
+{
+    int i;
+    for (i = 0; i < GPFSEL_WORDS; i++) {
+        if (batch->mask[i] != 0) {
+            REG_WRITE(gpio, i, (REG_READ(gpio, i) & ~batch->mask[i]) |
+                               batch->value[i]);
+        }
+    }
+}
+
+/**
+ * \brief Sets the mode of a pin
+ * 
+ * \param pin        the pin to set the mode of
+ * \param function   the new GPFSEL value for the specified pin
+ *
+ * \note Use a struct fsel_batch to set several pins, which writes each
+ *       GPFSEL word only once.
+ */
+void pin_mode(int pin, int function)
+{
+    struct fsel_batch batch;
+    fsel_batch_init(&batch);
+    if (fsel_batch_add(&batch, pin, function) == 0) {
+        fsel_batch_apply(&batch);
+    }
+}
+
+/**
+ * \brief Mirrors a write to GPSET or GPCLR into GPLEV, which is how plantsim
+ *        sees the pins
+ */
+void gpio_mirror_level(unsigned int word, unsigned int mask, int val)
+{
+    unsigned int lev = REG_READ(gpio, GPLEV0 + word);
+    REG_WRITE(gpio, GPLEV0 + word, val ? lev | mask : lev & ~mask);
+}
+
+/**
+ * \brief Writes the specified value to the specified pin
+ *
+ * \param pin    the pin to write to
+ * \param val    the values to write to the specified pin
+ *
+ * \note The value parameter will either write a low voltage if the val
+ *       parameter is 0 or a high voltage if the value parameter is not 0
+ */
+void digital_write(int pin, int val)
+{
+    if (pin > 53 || pin < 0) {
+        printf("bad pin, got pin %d\n", pin);
+        return;
+    }
+    gpio_write_mask(pin / 32, 1u << pin % 32, val);
+}
+
+/**
+ * \brief Read the value from the specified pin
+ *
+ * \param pin    the pin to read from
+ */
+int digital_read(int pin)
+{
+    if (pin > 53 || pin < 0) {
+        printf("bad pin, got pin %d\n", pin);
+        return 0;
+    }
+    return gpio_read_mask(pin / 32, 1u << pin % 32);
+}
+
+/**
+ * \brief Starts an empty batch of pull changes
+ */
+void pull_batch_init(struct pull_batch* batch)
+{
+    batch->pins[PULL_NONE] = batch->pins[PULL_DOWN] = 0;
+    batch->pins[PULL_UP] = 0;
+}
+
+/**
+ * \brief Adds a pin to a batch of pull changes, replacing an earlier change
+ *        of the same pin
+ *
+ * \param batch   the batch
+ * \param pin     the pin to set the pull of
+ * \param pull    PULL_NONE, PULL_DOWN or PULL_UP
+ *
+ * \returns 0 on success, -1 if the pin or pull is not valid
+ */
+int pull_batch_add(struct pull_batch* batch, int pin, int pull)
+{
+    uint64_t bit;
+    if (pin > 53 || pin < 0) {
+        printf("bad pin, got pin %d\n", pin);
+        return -1;
+    } else if (pull > PULL_UP || pull < PULL_NONE) {
+        printf("bad pull, got pull %d\n", pull);
+        return -1;
+    }
+    bit = (uint64_t)1 << pin;
+    batch->pins[PULL_NONE] &= ~bit;
+    batch->pins[PULL_DOWN] &= ~bit;
+    batch->pins[PULL_UP] &= ~bit;
+    batch->pins[pull] |= bit;
+    return 0;
+}
+
+/**
+ * \brief Waits out the setup time of the GPPUD control signal
+ *
+ * \note Counted in loop iterations rather than with the system timer, which
+ *       may not be mapped yet when the pins are set up.
+ */
+void gppud_wait()
+{
+    int i;
+    for (i = 0; i < GPPUD_SETUP_CYCLES; i++) {
+        __asm__ __volatile__("" ::: "memory");
+    }
+}
+
+/**
+ * \brief Sets the pulls of every pin in a batch
+ *
+ * \note On a BCM2711 each GPIO_PUP_PDN_CNTRL word the batch touches is
+ *       read and written once. Older chips need the GPPUD sequence once per
+ *       kind of pull in the batch, clocking in all of its pins at once.
+ */
+void pull_batch_apply(const struct pull_batch* batch)
+{
+    int pull, w;
+    if (pi_bcm2711) {
+        // the BCM2711 swaps the encoding, 1 is up and 2 is down
+        static const unsigned int code[3] = { 0, 2, 1 };
+        for (w = 0; w < 4; w++) {
+            unsigned int mask = 0, value = 0;
+            int pin;
+            for (pin = w * 16; pin < w * 16 + 16 && pin <= 53; pin++) {
+                for (pull = PULL_NONE; pull <= PULL_UP; pull++) {
+                    if (batch->pins[pull] >> pin & 1) {
+                        mask |= 3u << (pin % 16) * 2;
+                        value |= code[pull] << (pin % 16) * 2;
+                    }
+                }
+            }
+            if (mask != 0) {
+                REG_WRITE(gpio, GPPUP_PDN_CNTRL0 + w,
+                          (REG_READ(gpio, GPPUP_PDN_CNTRL0 + w) & ~mask) |
+                          value);
+            }
+        }
+        return;
+    }
+    for (pull = PULL_NONE; pull <= PULL_UP; pull++) {
+        uint64_t pins = batch->pins[pull];
+        if (pins == 0) {
+            continue;
+        }
+        REG_WRITE(gpio, GPPUD, pull);
+        gppud_wait();
+        REG_WRITE(gpio, GPPUDCLK0, (unsigned int)pins);
+        REG_WRITE(gpio, GPPUDCLK0 + 1, (unsigned int)(pins >> 32));
+        gppud_wait();
+        REG_WRITE(gpio, GPPUD, PULL_NONE);
+        REG_WRITE(gpio, GPPUDCLK0, 0);
+        REG_WRITE(gpio, GPPUDCLK0 + 1, 0);
+    }
+}
+
+/**
+ * \brief Sets the pull-up or pull-down of a pin
+ *
+ * \param pin    the pin
+ * \param pull   PULL_NONE, PULL_DOWN or PULL_UP
+ *
+ * \note Use a struct pull_batch to set several pins, which on older chips
+ *       takes one GPPUD sequence per kind of pull rather than one per pin.
+ */
+void pull_mode(int pin, int pull)
+{
+    struct pull_batch batch;
+    pull_batch_init(&batch);
+    if (pull_batch_add(&batch, pin, pull) == 0) {
+        pull_batch_apply(&batch);
+    }
+}
+
+/**
+ * \brief Maps memory used by timer functions
+ *
+ * \note Must be run as sudo
+ */
+void timer_init() {
+    sys_timer = map_peripheral(SYS_TIMER_BASE, "sys_timer");
+}
+
+/**
+ * \brief Sleeps the running process for the specified number of mircoseconds
+ *
+ * \param micros    the number of microseconds to sleep for
+ */
+void sleep_micros(int micros)
+{
+    if (micros == 0) {
+        return;
+    }
+    // C1 = CLO + micros
+    REG_WRITE(sys_timer, 4, REG_READ(sys_timer, 1) + micros);
+    // clear M1 (0x2 is same as 0b0010), plantsim needs it written as 0
+    REG_WRITE(sys_timer, 0, pi_emulated ? 0 : 0x2);
+    while (!!(REG_READ(sys_timer, 0) & 0x2) == 0);  // wait for M1 to go high
+}
+
+/**
+ * \brief Sleeps the running process for the specified number of milliseconds
+ *
+ * \param millis    the number of milliseconds to sleep for
+ */
+void sleep_millis(int millis)
+{
+    sleep_micros(1000 * millis);     // sleep 1000 microseconds for each millisecond
+}
+
+/**
+ * \brief Maps the memory used by the SPI protocol functions and configures
+ *        the Pi master port 0 for SPI communication
+ *
+ * \param freq       the frequency of the SPI clock to use, in Hz
+ * \param settings   any SPI settings to set
+ */
+void spi_init(int freq, int settings)
+{
+    struct fsel_batch batch;
+    int pin;
+    spi0 = map_peripheral(SPIO_BASE, "spi0");
+    
+    // set pins 8-11 to be used for spi0, 8 and 9 share GPFSEL0 and 10 and
+    // 11 share GPFSEL1
+    fsel_batch_init(&batch);
+    for (pin = 8; pin <= 11; pin++) {
+        fsel_batch_add(&batch, pin, ALT0);
+    }
+    fsel_batch_apply(&batch);
+
+    REG_WRITE(spi0, 2, 250000000 / freq);   // set clock rate
+    REG_WRITE(spi0, 0, settings);           // set the settings
+    REG_WRITE(spi0, 0, REG_READ(spi0, 0) | 0x00000080);  // set Transfer Active
+}
@@ -3,12 +3,17 @@
  *
  * \brief Contains functions for interacting with the GPIO pins, system timer,
  *        and SPI interface of the Raspberry Pi 2.
+ *
+ * The functions are built into libpihelpers (see pi_helpers.c). The accessors
+ * called on every tick are static inline here, so they cost the same as
+ * before in every program linking the library.
  */
-#include <sys/mman.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <fcntl.h>
-#include <unistd.h>
+#ifndef PI_HELPERS_H
+#define PI_HELPERS_H
+
+#include <sched.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 /////////////////////////////////////////////////////////////////////
 // Constants
@@ -31,6 +36,34 @@
 #define INPUT  0
 #define OUTPUT 1
 
+#define GPFSEL_WORDS 6   // ten pins per word, for pins 0 to 53
+
+// GPIO pull types, in the encoding of the GPPUD register
+#define PULL_NONE 0
+#define PULL_DOWN 1
+#define PULL_UP   2
+
+// Pull registers. The BCM2835 to BCM2837 latch GPPUD into the pins selected
+// in GPPUDCLK0/1, the BCM2711 sets two bits per pin in GPIO_PUP_PDN_CNTRL.
+#define GPPUD              37
+#define GPPUDCLK0          38
+#define GPPUP_PDN_CNTRL0   57    // sixteen pins per word
+#define GPPUD_SETUP_CYCLES 150   // the control signal needs this long
+
+// Word offsets of the first GPSET, GPCLR and GPLEV registers, pins 32 to 53
+// are in the word after
+#define GPSET0   7
+#define GPCLR0   10
+#define GPLEV0   13
+
+// Word and bit of a constant pin in GPSET, GPCLR and GPLEV, both folded at
+// compile time. A pin out of range, or one that is not a constant, fails to
+// compile (the bit-field width must be a positive integer constant).
+#define PIN_CHECK(pin) \
+    (0 * sizeof(struct { int pin_out_of_range : (pin) >= 0 && (pin) <= 53; }))
+#define PIN_WORD(pin)  ((pin) / 32 + PIN_CHECK(pin))
+#define PIN_BIT(pin)   (1u << (pin) % 32)
+
 // Physical addresses
 #define BCM2836_PERI_BASE       0x3F000000
 #define GPIO_BASE               (BCM2836_PERI_BASE + 0x200000)
@@ -38,224 +71,131 @@
 #define SYS_TIMER_BASE          (BCM2836_PERI_BASE + 0x3000)
 #define SPIO_BASE               (BCM2836_PERI_BASE + 0x204000)
 
-// Pointer that will be memory mapped when pioInit() is called
-volatile unsigned int *gpio; //pointer to base of gpio
-
-// Pointer that will be memory mapped when pTimerInit() is called
-volatile unsigned int *sys_timer; //pointer to base of sys_timer
-
-// Pointer that will be memory mapped when spiInit() is called
-volatile unsigned int *spi0; //pointer to base of spi0
+// Every register access goes through these, so a -DPI_REGTRACE build can
+// record or replay them (see regtrace.h)
+#ifdef PI_REGTRACE
+#define REG_READ(base, i)       regtrace_read(base, i)
+#define REG_WRITE(base, i, v)   regtrace_write(base, i, v)
+#else
+#define REG_READ(base, i)       ((base)[i])
+#define REG_WRITE(base, i, v)   ((base)[i] = (v))
+#endif
+
+#ifdef PI_REGTRACE
+#include "regtrace.h"       // for regtrace_read() and regtrace_write()
+#endif
+
+// Pointers to the register blocks, mapped by pio_init(), timer_init() and
+// spi_init()
+extern volatile unsigned int *gpio;
+extern volatile unsigned int *sys_timer;
+extern volatile unsigned int *spi0;
+
+// Set when PI_HELPERS_MEM points the register blocks at a file shared with
+// plantsim instead of /dev/mem (see pi_helpers.c)
+extern int pi_emulated;
+
+// Set by pio_init() on a BCM2711 (Pi 4), which has the newer pull registers
+extern int pi_bcm2711;
+
+// Function changes for several pins, collected so each GPFSEL word is
+// written once with its final value (see fsel_batch_apply())
+struct fsel_batch {
+    unsigned int mask[GPFSEL_WORDS];    // function bits replaced in each word
+    unsigned int value[GPFSEL_WORDS];   // their new value
+};
+
+// Pull changes for several pins, applied together by pull_batch_apply()
+struct pull_batch {
+    uint64_t pins[3];                   // the pins to set to each PULL_*
+};
 
 /////////////////////////////////////////////////////////////////////
 // Rasperry Pi Helper Functions
 /////////////////////////////////////////////////////////////////////
 
-/**
- * \brief Maps memory used by GPIO functions
- *
- * \note Must be run as sudo
- */
-void pio_init() {
-    int  mem_fd;
-    void *reg_map;
-    
-    // /dev/mem is a psuedo-driver for accessing memory in the Linux filesystem
-    if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
-        printf("can't open /dev/mem \n");
-        exit(-1);
-    }
-    
-    reg_map = mmap(
-        NULL,                 //Address at which to start local mapping (null means don't-care)
-        BLOCK_SIZE,           //Size of mapped memory block
-        PROT_READ|PROT_WRITE, // Enable both reading and writing to the mapped memory
-        MAP_SHARED,           // This program does not have exclusive access to this memory
-        mem_fd,               // Map to /dev/mem
-        GPIO_BASE);           // Offset to GPIO peripheral
-
-    if (reg_map == MAP_FAILED) {
-        printf("gpio mmap error %d\n", (int)reg_map);
-        close(mem_fd);
-        exit(-1);
-    }
-
-    gpio = (volatile unsigned *)reg_map;
-}
+// Setup, see pi_helpers.c for each of these
+volatile unsigned int* map_peripheral(off_t base, const char* name);
+int pi_is_bcm2711(void);
+void pio_init(void);
+void timer_init(void);
+void spi_init(int freq, int settings);
+
+// GPIO functions
+void fsel_batch_init(struct fsel_batch* batch);
+int fsel_batch_add(struct fsel_batch* batch, int pin, int function);
+void fsel_batch_apply(const struct fsel_batch* batch);
+void pin_mode(int pin, int function);
+void pull_batch_init(struct pull_batch* batch);
+int pull_batch_add(struct pull_batch* batch, int pin, int pull);
+void pull_batch_apply(const struct pull_batch* batch);
+void pull_mode(int pin, int pull);
+void gpio_mirror_level(unsigned int word, unsigned int mask, int val);
+void digital_write(int pin, int val);
+int digital_read(int pin);
+
+// Timer functions
+void sleep_micros(int micros);
+void sleep_millis(int millis);
 
-/**
- * \brief Sets the mode of a pin
- * 
- * \param pin        the pin to set the mode of
- * \param function   the new GPFSEL value for the specified pin
- */
-void pin_mode(int pin, int function)
-{
-    unsigned int offset, shift;
-    if (pin > 53 || pin < 0) {
-        printf("bad pin, got pin %d\n", pin);
-        return;
-    } else if (function > 7 || function < 0) {
-        printf("bad function, got function %d\n", function);
-    }
-    offset = pin / 10;
-    shift = (pin % 10) * 3;
-    
-    // AND gpio[offset] with all 1s and function at the proper location
-    gpio[offset] &= ~((~function & 7) << shift);
-    // OR gpio[offset] with all 0s and function at the proper location
-    gpio[offset] |= function << shift;
-}
+/////////////////////////////////////////////////////////////////////
+// Hot paths
+/////////////////////////////////////////////////////////////////////
 
 /**
- * \brief Writes the specified value to the specified pin
+ * \brief Drives the pins of a mask high or low, without checking them
  *
- * \param pin    the pin to write to
- * \param val    the values to write to the specified pin
+ * \param word   the GPSET/GPCLR word of the pins, pin / 32
+ * \param mask   the pins within the word, 1 << pin % 32 for each
+ * \param val    0 for low, anything else for high
  *
- * \note The value parameter will either write a low voltage if the val
- *       parameter is 0 or a high voltage if the value parameter is not 0
+ * \note With constants for word and val this is a single store, plus a
+ *       branch that is never taken outside of emulation.
  */
-void digital_write(int pin, int val)
+static inline void gpio_write_mask(unsigned int word, unsigned int mask,
+                                   int val)
 {
-    unsigned int set, clr;
-    if (pin > 53 || pin < 0) {
-        printf("bad pin, got pin %d\n", pin);
-        return;
-    }
-    
-    if (val){
-        set = pin < 32 ? 7 : 8;             // select the proper set address
-        gpio[set] = 0x1 << (pin % 32);      // write to the set address
-    } else {
-        clr = pin < 32 ? 10 : 11;           // select the proper clear address
-        gpio[clr] = 0x1 << (pin % 32);      // write to the clear address
+    REG_WRITE(gpio, (val ? GPSET0 : GPCLR0) + word, mask);
+    if (__builtin_expect(pi_emulated, 0)) {
+        gpio_mirror_level(word, mask, val);
     }
 }
 
 /**
- * \brief Read the value from the specified pin
+ * \brief Reads the level of a pin, without checking it
  *
- * \param pin    the pin to read from
+ * \param word   the GPLEV word of the pin, pin / 32
+ * \param mask   1 << pin % 32
  */
-int digital_read(int pin)
+static inline int gpio_read_mask(unsigned int word, unsigned int mask)
 {
-    int out;
-    if (pin > 53 || pin < 0) {
-        printf("bad pin, got pin %d\n", pin);
-        return 0;
-    }
-    
-    // read from the proper address (depends on the pin number)
-    if (pin < 32) {
-        out = (gpio[13] >> pin) & 1;
-    } else {
-        out = (gpio[14] >> (pin - 32)) & 1;
-    }
-    return out;
-}
-
-/**
- * \brief Maps memory used by timer functions
- *
- * \note Must be run as sudo
- */
-void timer_init() {
-    int  mem_fd;
-    void *reg_map;
-    
-    // /dev/mem is a psuedo-driver for accessing memory in the Linux filesystem
-    if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
-        printf("can't open /dev/mem \n");
-        exit(-1);
-    }
-
-    reg_map = mmap(
-        NULL,                 //Address at which to start local mapping (null means don't-care)
-        BLOCK_SIZE,           //Size of mapped memory block
-        PROT_READ|PROT_WRITE, // Enable both reading and writing to the mapped memory
-        MAP_SHARED,           // This program does not have exclusive access to this memory
-        mem_fd,               // Map to /dev/mem
-        SYS_TIMER_BASE);      // Offset to SYS_TIMER peripheral
-    
-    if (reg_map == MAP_FAILED) {
-        printf("sys_timer mmap error %d\n", (int)reg_map);
-        close(mem_fd);
-        exit(-1);
-    }
-    
-    sys_timer = (volatile unsigned *)reg_map;
+    return (REG_READ(gpio, GPLEV0 + word) & mask) != 0;
 }
 
+// Accessors for a pin known at compile time, which resolve the register and
+// mask at compile time and refuse pins out of range. Use digital_write() and
+// digital_read() for pins only known at run time.
+#define PIN_SET(pin)          gpio_write_mask(PIN_WORD(pin), PIN_BIT(pin), 1)
+#define PIN_CLEAR(pin)        gpio_write_mask(PIN_WORD(pin), PIN_BIT(pin), 0)
+#define PIN_WRITE(pin, val)   gpio_write_mask(PIN_WORD(pin), PIN_BIT(pin), val)
+#define PIN_READ(pin)         gpio_read_mask(PIN_WORD(pin), PIN_BIT(pin))
 
 /**
- * \brief Sleeps the running process for the specified number of mircoseconds
+ * \brief Reads the free running 64-bit system timer counter
  *
- * \param micros    the number of microseconds to sleep for
- */
-void sleep_micros(int micros)
-{
-    if (micros == 0) {
-        return;
-    }
-    sys_timer[4] = sys_timer[1] + micros;    // C1 = CLO + micros
-    sys_timer[0] = 0x2;                   // clear M1 (0x2 is same as 0b0010)
-    while (!!(sys_timer[0] & 0x2) == 0);  // wait for M1 to go high again
-}
-
-/**
- * \brief Sleeps the running process for the specified number of milliseconds
+ * \returns The number of microseconds counted since the timer started
  *
- * \param millis    the number of milliseconds to sleep for
+ * \note The counter is split across CHI and CLO, so CHI is read on both sides
+ *       of CLO and the read is retried if CLO wrapped in between
  */
-void sleep_millis(int millis)
+static inline uint64_t timer_micros()
 {
-    sleep_micros(1000 * millis);     // sleep 1000 microseconds for each millisecond
-}
-
-/**
- * \brief Maps the memory used by the SPI protocol functions and configures
- *        the Pi master port 0 for SPI communication
- *
- * \param freq       the frequency of the SPI clock to use, in Hz
- * \param settings   any SPI settings to set
- */
-void spi_init(int freq, int settings)
-{
-    int  mem_fd;
-    void *reg_map;
-  
-    // /dev/mem is a psuedo-driver for accessing memory in the Linux filesystem
-    if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
-        printf("can't open /dev/mem \n");
-        exit(-1);
-    }
-    
-    reg_map = mmap(
-        NULL,                 //Address at which to start local mapping (null means don't-care)
-        BLOCK_SIZE,           //Size of mapped memory block
-        PROT_READ|PROT_WRITE, // Enable both reading and writing to the mapped memory
-        MAP_SHARED,           // This program does not have exclusive access to this memory
-        mem_fd,               // Map to /dev/mem
-        SPIO_BASE);      // Offset to SYS_TIMER peripheral
-    
-    if (reg_map == MAP_FAILED) {
-        printf("sys_timer mmap error %d\n", (int)reg_map);
-        close(mem_fd);
-        exit(-1);
-    }
-    
-    spi0 = (volatile unsigned *)reg_map;
-    
-    // set pins 8-11 to be used for spi0
-    pin_mode(8, ALT0);
-    pin_mode(9, ALT0);
-    pin_mode(10, ALT0);
-    pin_mode(11, ALT0);
-
-    spi0[2] = 250000000 / freq;     // set clock rate
-    spi0[0] = settings;             // set the settings
-    spi0[0] |= 0x00000080;          // set Transfer Active bit
+    unsigned int hi, lo;
+    do {
+        hi = REG_READ(sys_timer, 2);
+        lo = REG_READ(sys_timer, 1);
+    } while (hi != REG_READ(sys_timer, 2));
+    return ((uint64_t)hi << 32) | lo;
 }
 
 /**
@@ -266,10 +206,24 @@ void spi_init(int freq, int settings)
  * 
  * \returns A character containing the 8 bits of data read back from the slave
  */
-char spi_send_receive(char send)
+static inline char spi_send_receive(char send)
 {
-    spi0[1] = send;
-    while (!(spi0[0] & 0x00010000));
-    return spi0[1];
+    REG_WRITE(spi0, 1, send);
+    if (pi_emulated) {
+        // the hardware clears DONE when the FIFO is written, and plantsim
+        // answers once it sees DONE clear
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        REG_WRITE(spi0, 0, REG_READ(spi0, 0) & ~0x00010000);
+    }
+    while (!(REG_READ(spi0, 0) & 0x00010000)) {
+        if (pi_emulated) {
+            sched_yield();      // plantsim may be waiting for this core
+        }
+    }
+    if (pi_emulated) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }
+    return REG_READ(spi0, 1);
 }
 
+#endif
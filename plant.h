@@ -0,0 +1,315 @@
+/**
+ * \file plant.h
+ *
+ * \brief Simulated thermal plants for trying out controllers away from the
+ *        hardware, and the fitting that builds one from a logged trace.
+ *
+ * A plant is driven through struct plant: every model embeds it as its first
+ * member and fills in the function pointers, so the benchmark and simulator
+ * code can step any model the same way. Temperatures are in degrees Celsius
+ * and heater inputs are 0 (off) or 1 (on), one per zone.
+ *
+ * The model provided here is a first order RC (one thermal mass losing heat
+ * to ambient) with a dead time between the heater and the sensor:
+ *
+ *     dT/dt = heat * u(t - dead_time) - loss * (T - ambient)
+ *
+ * plant_rc_fit() finds its parameters by least squares on a logged trace.
+ * The fit residuals can be kept and replayed as disturbances, so the plant
+ * reproduces the drifts and disturbances in the trace that the model
+ * itself cannot explain.
+ */
+#ifndef PLANT_H
+#define PLANT_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+// the ADC conversion done by get_current_temp() in temp_control.c
+#define PLANT_ADC_MAX         1023
+#define PLANT_DEG_PER_COUNT   (5 * 31.25 / 1024)
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct plant {
+    const char* name;
+    int nzones;
+    void (*reset)(struct plant* p, double temp);
+    void (*step)(struct plant* p, double dt, const uint8_t* heater);
+    double (*temp)(const struct plant* p, int zone);
+    void (*free)(struct plant* p);
+};
+
+struct plant_rc_params {
+    double heat;              // heating rate at full power, C/s
+    double loss;              // 1 / time constant, 1/s
+    double ambient;           // C
+    double dead_time;         // s
+    double rms_residual;      // fit quality, C per fit period
+};
+
+struct plant_rc {
+    struct plant base;
+    struct plant_rc_params params;
+    double temp;
+    double t;                 // simulated time since reset, s
+
+    // heater history covering the dead time
+    uint8_t* delay;
+    size_t delay_len, delay_pos;
+
+    // disturbances replayed at the fit period, may be NULL
+    const float* residual;
+    size_t nresidual, next_residual;
+    double residual_period;
+};
+
+/////////////////////////////////////////////////////////////////////
+// Sensor model
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Converts a true temperature into what temp_control would read
+ *
+ * \param temp   the temperature at the sensor
+ * \param raw    if not NULL, receives the 10-bit ADC value
+ *
+ * \returns The temperature as quantized by the ADC
+ */
+double plant_sense(double temp, unsigned int* raw)
+{
+    double counts = floor(temp / PLANT_DEG_PER_COUNT);
+    unsigned int r = counts < 0 ? 0 : counts > PLANT_ADC_MAX ? PLANT_ADC_MAX
+                                                             : counts;
+    if (raw != NULL) {
+        *raw = r;
+    }
+    return r * PLANT_DEG_PER_COUNT;
+}
+
+/////////////////////////////////////////////////////////////////////
+// First order RC plant
+/////////////////////////////////////////////////////////////////////
+
+void plant_rc_reset(struct plant* p, double temp)
+{
+    struct plant_rc* rc = (struct plant_rc*)p;
+    rc->temp = temp;
+    rc->t = 0;
+    rc->next_residual = 0;
+    rc->delay_pos = 0;
+    memset(rc->delay, 0, rc->delay_len);
+}
+
+void plant_rc_step(struct plant* p, double dt, const uint8_t* heater)
+{
+    struct plant_rc* rc = (struct plant_rc*)p;
+    const struct plant_rc_params* k = &rc->params;
+    uint8_t u = rc->delay[rc->delay_pos];
+
+    rc->delay[rc->delay_pos] = heater[0];
+    if (++rc->delay_pos == rc->delay_len) {
+        rc->delay_pos = 0;
+    }
+    rc->temp += dt * (k->heat * u - k->loss * (rc->temp - k->ambient));
+    rc->t += dt;
+    while (rc->residual != NULL && rc->next_residual < rc->nresidual &&
+           rc->t >= (rc->next_residual + 1) * rc->residual_period) {
+        rc->temp += rc->residual[rc->next_residual++];
+    }
+}
+
+double plant_rc_temp(const struct plant* p, int zone)
+{
+    (void)zone;
+    return ((const struct plant_rc*)p)->temp;
+}
+
+void plant_rc_free(struct plant* p)
+{
+    struct plant_rc* rc = (struct plant_rc*)p;
+    free(rc->delay);
+    free(rc);
+}
+
+/**
+ * \brief Creates a first order plant
+ *
+ * \param params     the model parameters
+ * \param dt         the step size the plant will be run at, in seconds
+ * \param residual   disturbances to add once per period, or NULL
+ * \param nresidual  the number of disturbances
+ * \param period     the time between disturbances, in seconds
+ *
+ * \returns The plant, or NULL if out of memory
+ */
+struct plant* plant_rc_new(const struct plant_rc_params* params, double dt,
+                           const float* residual, size_t nresidual,
+                           double period)
+{
+    struct plant_rc* rc = calloc(1, sizeof(*rc));
+    if (rc == NULL) {
+        return NULL;
+    }
+    rc->base.name = "rc";
+    rc->base.nzones = 1;
+    rc->base.reset = plant_rc_reset;
+    rc->base.step = plant_rc_step;
+    rc->base.temp = plant_rc_temp;
+    rc->base.free = plant_rc_free;
+    rc->params = *params;
+    rc->delay_len = (size_t)lround(params->dead_time / dt) + 1;
+    rc->delay = calloc(rc->delay_len, 1);
+    rc->residual = residual;
+    rc->nresidual = nresidual;
+    rc->residual_period = period;
+    if (rc->delay == NULL) {
+        free(rc);
+        return NULL;
+    }
+    plant_rc_reset(&rc->base, params->ambient);
+    return &rc->base;
+}
+
+/**
+ * \brief Solves the 3x3 system a x = b by Gaussian elimination
+ *
+ * \returns 0 on success, -1 if the system is singular
+ */
+int plant_solve3(double a[3][3], double b[3], double x[3])
+{
+    int i, j, k;
+    for (i = 0; i < 3; i++) {
+        int pivot = i;
+        for (j = i + 1; j < 3; j++) {
+            if (fabs(a[j][i]) > fabs(a[pivot][i])) {
+                pivot = j;
+            }
+        }
+        if (fabs(a[pivot][i]) < 1e-12) {
+            return -1;
+        }
+        for (k = 0; k < 3; k++) {
+            double t = a[i][k];
+            a[i][k] = a[pivot][k];
+            a[pivot][k] = t;
+        }
+        double t = b[i];
+        b[i] = b[pivot];
+        b[pivot] = t;
+        for (j = i + 1; j < 3; j++) {
+            double f = a[j][i] / a[i][i];
+            for (k = i; k < 3; k++) {
+                a[j][k] -= f * a[i][k];
+            }
+            b[j] -= f * b[i];
+        }
+    }
+    for (i = 2; i >= 0; i--) {
+        x[i] = b[i];
+        for (k = i + 1; k < 3; k++) {
+            x[i] -= a[i][k] * x[k];
+        }
+        x[i] /= a[i][i];
+    }
+    return 0;
+}
+
+/**
+ * \brief Fits a first order plant to a trace resampled at a fixed period
+ *
+ * Every dead time from 0 to max_delay periods is tried, and the one leaving
+ * the smallest squared error is kept.
+ *
+ * \param temp        mean temperature of each period, NAN where there is
+ *                    no data
+ * \param duty        fraction of each period the heater was on
+ * \param n           the number of periods
+ * \param period      the length of a period, in seconds
+ * \param max_delay   the longest dead time to try, in periods
+ * \param params      receives the fitted parameters
+ * \param residual    if not NULL, receives the n temperature changes the
+ *                    model does not explain (0 where there is no data)
+ *
+ * \returns 0 on success, -1 if the trace does not determine the model
+ */
+int plant_rc_fit(const double* temp, const double* duty, size_t n,
+                 double period, int max_delay, struct plant_rc_params* params,
+                 float* residual)
+{
+    double best_sse = INFINITY, best[3] = { 0, 0, 0 };
+    size_t used = 0;
+    int best_delay = -1, d;
+    size_t k;
+
+    for (d = 0; d <= max_delay && (size_t)d + 1 < n; d++) {
+        double a[3][3] = { { 0 } }, b[3] = { 0 }, x[3], sse = 0;
+        size_t m = 0;
+        for (k = d; k + 1 < n; k++) {
+            double row[3] = { 1, duty[k - d], temp[k] };
+            double y = (temp[k + 1] - temp[k]) / period;
+            int i, j;
+            if (isnan(temp[k]) || isnan(temp[k + 1]) || isnan(duty[k - d])) {
+                continue;
+            }
+            for (i = 0; i < 3; i++) {
+                for (j = 0; j < 3; j++) {
+                    a[i][j] += row[i] * row[j];
+                }
+                b[i] += row[i] * y;
+            }
+            m++;
+        }
+        if (m < 10 || plant_solve3(a, b, x) < 0) {
+            continue;
+        }
+        for (k = d; k + 1 < n; k++) {
+            double e;
+            if (isnan(temp[k]) || isnan(temp[k + 1]) || isnan(duty[k - d])) {
+                continue;
+            }
+            e = (temp[k + 1] - temp[k]) / period -
+                (x[0] + x[1] * duty[k - d] + x[2] * temp[k]);
+            sse += e * e;
+        }
+        if (sse < best_sse) {
+            best_sse = sse;
+            best_delay = d;
+            used = m;
+            memcpy(best, x, sizeof(best));
+        }
+    }
+    // the plant has to lose heat and the heater has to add it
+    if (best_delay < 0 || best[2] >= 0 || best[1] <= 0) {
+        return -1;
+    }
+    params->heat = best[1];
+    params->loss = -best[2];
+    params->ambient = best[0] / params->loss;
+    params->dead_time = best_delay * period;
+    params->rms_residual = sqrt(best_sse / used) * period;
+
+    if (residual != NULL) {
+        memset(residual, 0, n * sizeof(float));
+        for (k = best_delay; k + 1 < n; k++) {
+            if (isnan(temp[k]) || isnan(temp[k + 1]) ||
+                isnan(duty[k - best_delay])) {
+                continue;
+            }
+            residual[k] = (temp[k + 1] - temp[k]) - period *
+                          (best[0] + best[1] * duty[k - best_delay] +
+                           best[2] * temp[k]);
+        }
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,297 @@
+/*  \file plantsim.c
+ *
+ *  \brief Hardware in the loop simulator: stands in for the Pi's peripherals
+ *         so the unmodified temp_control binary can run closed loop against a
+ *         simulated plant.
+ *
+ *  plantsim creates a file laid out like the peripheral window (gpio, spi0
+ *  and sys_timer at their offsets from BCM2836_PERI_BASE) and keeps it up to
+ *  date, and temp_control maps it instead of /dev/mem when PI_HELPERS_MEM
+ *  names it:
+ *
+ *      ./plantsim /dev/shm/pi_regs &
+ *      PI_HELPERS_MEM=/dev/shm/pi_regs ./temp_control 45
+ *
+ *  The simulator
+ *    - runs the system timer (CLO/CHI and the M1 match) from the simulated
+ *      clock, which runs at -x times real time
+ *    - steps the plant with each zone's heater on while its control pin is
+ *      an output and its GPLEV bit is set
+ *    - answers SPI transfers as the MCP3002 would, with the temperature of
+ *      zone 0 (channel 0) or 1 (channel 1) seen through the LM35, amplifier
+ *      and ADC, with a fraction of them replaced by random glitches (-g)
+ *
+ *  The plant is a single node RC model (-P) or a thermal network with any
+ *  number of zones (-N, see thermal_net.h), one control pin per zone (-p).
+ *
+ *  \note Plain memory does not clear SPI DONE or M1 on its own, so in this
+ *        mode pi_helpers.h clears them itself and plantsim sets them, and
+ *        digital_write() mirrors the pin into GPLEV.
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "pi_helpers.h"
+#include "plant.h"
+#include "thermal_net.h"
+
+#define SIM_FILE_SIZE    (SPIO_BASE - BCM2836_PERI_BASE + BLOCK_SIZE)
+#define SIM_STEP_S       0.001  // plant step in simulated time
+#define SPI_DONE         0x00010000
+#define TIMER_M1         0x2
+#define MCP3002_START    0x40   // start bit of the first byte of a transfer
+#define MCP3002_ODD      0x10   // selects channel 1 in single ended mode
+
+volatile sig_atomic_t running = 1;
+
+struct sim {
+    volatile unsigned int* gpio;
+    volatile unsigned int* timer;
+    volatile unsigned int* spi;
+    struct plant* plant;
+    int pins[TN_MAX_ZONES];
+    int npins;
+    double step;                // plant step in simulated time, s
+    double speed;               // simulated seconds per real second
+    double noise;               // standard deviation of the sensor noise, C
+    double glitch;              // fraction of conversions that are garbage
+
+    double t;                   // simulated time the plant has reached, s
+    unsigned int raw;           // ADC value latched by the last start bit
+    uint64_t transfers;
+    uint64_t glitches;
+    uint64_t on_steps, steps;
+};
+
+void int_handler(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+double now_s()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/**
+ * \brief Returns normally distributed noise (Box-Muller)
+ */
+double gaussian(double sigma)
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+/**
+ * \brief Returns 1 if temp_control is driving a heater pin on
+ */
+int heater_on(const struct sim* s, int pin)
+{
+    unsigned int fsel = __atomic_load_n(&s->gpio[pin / 10], __ATOMIC_ACQUIRE);
+    unsigned int lev = __atomic_load_n(&s->gpio[13 + pin / 32],
+                                       __ATOMIC_ACQUIRE);
+    return ((fsel >> (pin % 10) * 3) & 7) == OUTPUT && (lev >> (pin % 32) & 1);
+}
+
+/**
+ * \brief Publishes the simulated clock through the system timer registers
+ */
+void update_timer(struct sim* s, uint64_t us)
+{
+    unsigned int cs, c1;
+    // CLO before CHI, so timer_micros() retries across a wrap
+    __atomic_store_n(&s->timer[1], (unsigned int)us, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->timer[2], (unsigned int)(us >> 32),
+                     __ATOMIC_RELEASE);
+    cs = __atomic_load_n(&s->timer[0], __ATOMIC_ACQUIRE);
+    c1 = __atomic_load_n(&s->timer[4], __ATOMIC_ACQUIRE);
+    if (!(cs & TIMER_M1) && (int32_t)((unsigned int)us - c1) >= 0) {
+        __atomic_store_n(&s->timer[0], cs | TIMER_M1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * \brief Answers an SPI transfer if one is waiting
+ *
+ * \returns 1 if there was one, 0 otherwise
+ */
+int serve_spi(struct sim* s)
+{
+    unsigned int cs = __atomic_load_n(&s->spi[0], __ATOMIC_ACQUIRE);
+    unsigned int in, out;
+    if (cs & SPI_DONE) {
+        return 0;
+    }
+    in = __atomic_load_n(&s->spi[1], __ATOMIC_ACQUIRE) & 0xff;
+    if (in & MCP3002_START) {
+        // sample on the start bit, the result comes back over two bytes
+        int zone = (in & MCP3002_ODD) && s->plant->nzones > 1;
+        double temp = s->plant->temp(s->plant, zone) + gaussian(s->noise);
+        plant_sense(temp, &s->raw);
+        if (s->glitch > 0 && rand() < s->glitch * RAND_MAX) {
+            s->raw = rand() & 0x3ff;
+            s->glitches++;
+        }
+        out = (s->raw >> 8) & 0x03;
+    } else {
+        out = s->raw & 0xff;
+    }
+    s->transfers++;
+    __atomic_store_n(&s->spi[1], out, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->spi[0], cs | SPI_DONE, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    struct plant_rc_params params = { 0.4, 0.01, 22, 1.5, 0 };
+    struct sim s;
+    double start_temp = NAN, tau = 100, start, last_report;
+    volatile unsigned int* regs;
+    const char* path;
+    const char* net = NULL;
+    char* pin;
+    int fd, opt, z;
+
+    memset(&s, 0, sizeof(s));
+    s.pins[s.npins++] = 17;
+    s.speed = 1;
+    s.step = SIM_STEP_S;
+    while ((opt = getopt(argc, argv, "N:P:g:n:p:s:t:x:")) != -1) {
+        switch (opt) {
+        case 'N':
+            net = optarg;
+            break;
+        case 'P':
+            if (sscanf(optarg, "%lf,%lf,%lf,%lf", &params.heat, &tau,
+                       &params.ambient, &params.dead_time) < 3 || tau <= 0) {
+                argc = 0;
+            }
+            break;
+        case 'g':
+            s.glitch = strtod(optarg, NULL);
+            break;
+        case 'n':
+            s.noise = strtod(optarg, NULL);
+            break;
+        case 'p':
+            s.npins = 0;
+            for (pin = strtok(optarg, ","); pin != NULL && s.npins <
+                 TN_MAX_ZONES; pin = strtok(NULL, ",")) {
+                s.pins[s.npins] = atoi(pin);
+                if (s.pins[s.npins] < 0 || s.pins[s.npins++] > 53) {
+                    argc = 0;
+                }
+            }
+            break;
+        case 's':
+            s.step = strtod(optarg, NULL) * 1e-3;
+            break;
+        case 't':
+            start_temp = strtod(optarg, NULL);
+            break;
+        case 'x':
+            s.speed = strtod(optarg, NULL);
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind != 1 || s.speed <= 0 || s.step <= 0) {
+        printf("Incorrect call to plantsim. The correct format is\n");
+        printf("\t./plantsim [-P heat,tau,ambient[,dead_time] | -N network] "
+               "[-t start_temp] [-n noise] [-g glitches]\n\t\t"
+               "[-p pin[,pin...]] [-s step_ms] [-x speed] register_file\n");
+        printf("then run temp_control with PI_HELPERS_MEM=register_file\n");
+        return 1;
+    }
+    path = argv[optind];
+    params.loss = 1 / tau;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0 ||
+        ftruncate(fd, SIM_FILE_SIZE) < 0) {
+        printf("can't create %s\n", path);
+        return 2;
+    }
+    regs = mmap(NULL, SIM_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                0);
+    close(fd);
+    if (regs == MAP_FAILED) {
+        printf("can't map %s\n", path);
+        return 2;
+    }
+    s.gpio = regs + (GPIO_BASE - BCM2836_PERI_BASE) / 4;
+    s.timer = regs + (SYS_TIMER_BASE - BCM2836_PERI_BASE) / 4;
+    s.spi = regs + (SPIO_BASE - BCM2836_PERI_BASE) / 4;
+    s.spi[0] = SPI_DONE;
+
+    if (net != NULL) {
+        s.plant = thermal_net_open(net);
+    } else {
+        s.plant = plant_rc_new(&params, s.step, NULL, 0, 0);
+        start_temp = isnan(start_temp) ? params.ambient : start_temp;
+    }
+    if (s.plant == NULL) {
+        return 2;
+    }
+    s.plant->reset(s.plant, start_temp);
+    signal(SIGINT, int_handler);
+    signal(SIGTERM, int_handler);
+    printf("plantsim: serving %s at %gx real time, %s plant with %d zones\n",
+           path, s.speed, s.plant->name, s.plant->nzones);
+
+    start = last_report = now_s();
+    while (running) {
+        double real = now_s();
+        double t = (real - start) * s.speed;
+        update_timer(&s, (uint64_t)(t * 1e6));
+        while (s.t + s.step <= t) {
+            uint8_t heater[TN_MAX_ZONES] = { 0 };
+            for (z = 0; z < s.npins && z < s.plant->nzones; z++) {
+                heater[z] = heater_on(&s, s.pins[z]);
+            }
+            s.plant->step(s.plant, s.step, heater);
+            s.t += s.step;
+            s.on_steps += heater[0];
+            s.steps++;
+        }
+        if (!serve_spi(&s)) {
+            sched_yield();      // temp_control may be waiting for this core
+        }
+        if (real - last_report >= 1) {
+            printf("plantsim: t %9.1f s  temp %6.2f C  heater %d  duty %.3f"
+                   "  adc reads %llu", s.t, s.plant->temp(s.plant, 0),
+                   heater_on(&s, s.pins[0]),
+                   s.steps > 0 ? (double)s.on_steps / s.steps : 0,
+                   (unsigned long long)s.transfers / 2);
+            if (s.glitch > 0) {
+                printf("  glitches %llu", (unsigned long long)s.glitches);
+            }
+            for (z = 1; z < s.plant->nzones && z < 4; z++) {
+                printf("  zone %d %6.2f C", z, s.plant->temp(s.plant, z));
+            }
+            printf("\n");
+            fflush(stdout);
+            last_report = real;
+            s.on_steps = s.steps = 0;
+        }
+    }
+    s.plant->free(s.plant);
+    munmap((void*)regs, SIM_FILE_SIZE);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,268 @@
+/**
+ * \file power_budget.h
+ *
+ * \brief Power budget between the zone controllers and the heater outputs,
+ *        so the heaters switched on at any moment never draw more than the
+ *        supply can deliver.
+ *
+ * Each tick, every zone asks for a duty cycle (0 or 1 from an on/off
+ * controller, anything in between from a time proportioned one) along with
+ * its control error. A zone asking for a fraction of full power is on for
+ * the first part of each window, and the windows of the zones are staggered
+ * evenly across the window length so their on times overlap as little as
+ * possible.
+ *
+ * If the zones that want to be on draw more than the budget, power goes to
+ * the highest priority zones first and, within a priority, to the zones
+ * furthest below their target. A zone that already has power keeps it
+ * until another zone is POWER_HOLD_C further behind, so zones with about the
+ * same error do not take turns every tick. The split point is found with a weighted
+ * quickselect instead of a sort, so allocation stays O(zones) per tick.
+ * Whatever budget is left over is then handed out first-fit to the zones
+ * that missed out.
+ */
+#ifndef POWER_BUDGET_H
+#define POWER_BUDGET_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define POWER_MAX_ZONES   64
+#define POWER_HOLD_C      0.5   // head start in error of the zones already on
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct power_zone {
+    double watts;             // heater load when on
+    int priority;             // higher is served first
+    uint32_t phase_us;        // offset of this zone's window
+
+    // this tick's request
+    double duty;
+    double error;             // target - temperature
+    int want;
+    int on;                   // granted power on the last tick
+
+    uint64_t denied;          // ticks the zone wanted power and was refused
+};
+
+struct power_stats {
+    uint64_t ticks;
+    uint64_t throttled;       // ticks on which some demand was refused
+    uint64_t denied;          // zone ticks refused
+    double denied_joules;     // energy asked for but not delivered
+    double peak_demand;       // highest load asked for, W
+    double peak_load;         // highest load granted, W
+};
+
+struct power_budget {
+    double max_watts;         // 0 for no limit
+    uint32_t window_us;       // time proportioning window
+    int nzones;
+    struct power_zone zones[POWER_MAX_ZONES];
+    struct power_stats stats;
+    uint64_t last_us;
+
+    // scratch for the selection
+    int order[POWER_MAX_ZONES];
+    double score[POWER_MAX_ZONES];
+};
+
+/////////////////////////////////////////////////////////////////////
+// Functions
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Sets up a budget
+ *
+ * \param pb          the budget
+ * \param max_watts   the largest total heater load allowed, 0 for no limit
+ * \param window_ms   the time proportioning window, in milliseconds
+ */
+void power_budget_init(struct power_budget* pb, double max_watts,
+                       unsigned window_ms)
+{
+    memset(pb, 0, sizeof(*pb));
+    pb->max_watts = max_watts;
+    pb->window_us = window_ms > 0 ? window_ms * 1000 : 1;
+}
+
+/**
+ * \brief Adds a zone and restaggers the windows of all zones
+ *
+ * \returns The zone's index, or -1 if there are too many zones
+ */
+int power_budget_add_zone(struct power_budget* pb, double watts, int priority)
+{
+    int z;
+    if (pb->nzones == POWER_MAX_ZONES) {
+        return -1;
+    }
+    pb->zones[pb->nzones].watts = watts;
+    pb->zones[pb->nzones].priority = priority;
+    pb->nzones++;
+    for (z = 0; z < pb->nzones; z++) {
+        pb->zones[z].phase_us = (uint64_t)pb->window_us * z / pb->nzones;
+    }
+    return pb->nzones - 1;
+}
+
+/**
+ * \brief Records what a zone's controller asks for this tick
+ *
+ * \param duty    the fraction of full power wanted, 0 to 1
+ * \param error   the target minus the measured temperature
+ */
+void power_budget_request(struct power_budget* pb, int zone, double duty,
+                          double error)
+{
+    pb->zones[zone].duty = duty;
+    pb->zones[zone].error = error;
+}
+
+/**
+ * \brief Partitions order[lo, hi) so the zones scoring above the split come
+ *        first, and finds the split so they draw at most budget
+ *
+ * \returns The number of zones granted, all of them in order[lo, result)
+ */
+int power_budget_select(struct power_budget* pb, int lo, int hi,
+                        double budget)
+{
+    int* o = pb->order;
+    while (lo < hi) {
+        double pivot = pb->score[o[lo + (hi - lo) / 2]];
+        double above = 0, equal = 0;
+        int i, gt = lo, lt = hi, eq;
+
+        // three way partition: > pivot, == pivot, < pivot
+        for (i = lo; i < lt;) {
+            double s = pb->score[o[i]];
+            int t = o[i];
+            if (s > pivot) {
+                o[i++] = o[gt];
+                o[gt++] = t;
+            } else if (s < pivot) {
+                o[i] = o[--lt];
+                o[lt] = t;
+            } else {
+                i++;
+            }
+        }
+        for (i = lo; i < gt; i++) {
+            above += pb->zones[o[i]].watts;
+        }
+        if (above > budget) {
+            hi = gt;
+            continue;
+        }
+        // everything above the pivot fits, take the ties while they fit
+        budget -= above;
+        for (eq = gt; eq < lt; eq++) {
+            equal = pb->zones[o[eq]].watts;
+            if (equal > budget) {
+                return eq;
+            }
+            budget -= equal;
+        }
+        lo = lt;
+    }
+    return lo;
+}
+
+/**
+ * \brief Decides which heaters are on this tick
+ *
+ * \param pb       the budget, with every zone's request made
+ * \param now_us   the current time
+ * \param heater   receives the state of each zone's heater
+ */
+void power_budget_allocate(struct power_budget* pb, uint64_t now_us,
+                           uint8_t* heater)
+{
+    struct power_stats* st = &pb->stats;
+    double dt = pb->last_us != 0 ? (now_us - pb->last_us) * 1e-6 : 0;
+    double demand = 0, load = 0, budget;
+    int z, n = 0, granted, i;
+
+    pb->last_us = now_us;
+    st->ticks++;
+    for (z = 0; z < pb->nzones; z++) {
+        struct power_zone* pz = &pb->zones[z];
+        uint32_t pos = (now_us + pz->phase_us) % pb->window_us;
+        pz->want = pz->duty >= 1 || pos < pz->duty * pb->window_us;
+        heater[z] = 0;
+        if (pz->want) {
+            demand += pz->watts;
+            pb->order[n++] = z;
+            pb->score[z] = pz->priority * 1e6 + pz->error +
+                           (pz->on ? POWER_HOLD_C : 0);
+        }
+    }
+    st->peak_demand = demand > st->peak_demand ? demand : st->peak_demand;
+    if (pb->max_watts <= 0 || demand <= pb->max_watts) {
+        for (i = 0; i < n; i++) {
+            heater[pb->order[i]] = 1;
+        }
+        for (z = 0; z < pb->nzones; z++) {
+            pb->zones[z].on = heater[z];
+        }
+        st->peak_load = demand > st->peak_load ? demand : st->peak_load;
+        return;
+    }
+
+    granted = power_budget_select(pb, 0, n, pb->max_watts);
+    budget = pb->max_watts;
+    for (i = 0; i < granted; i++) {
+        heater[pb->order[i]] = 1;
+        budget -= pb->zones[pb->order[i]].watts;
+    }
+    // leftover power goes first-fit to the zones that missed the cut
+    for (; i < n; i++) {
+        struct power_zone* pz = &pb->zones[pb->order[i]];
+        if (pz->watts <= budget) {
+            heater[pb->order[i]] = 1;
+            budget -= pz->watts;
+        } else {
+            pz->denied++;
+            st->denied++;
+            st->denied_joules += pz->watts * dt;
+        }
+    }
+    for (z = 0; z < pb->nzones; z++) {
+        pb->zones[z].on = heater[z];
+    }
+    load = pb->max_watts - budget;
+    st->peak_load = load > st->peak_load ? load : st->peak_load;
+    st->throttled++;
+}
+
+/**
+ * \brief Prints the budget statistics
+ */
+void power_budget_print_stats(const struct power_budget* pb)
+{
+    const struct power_stats* st = &pb->stats;
+    int z;
+    printf("power: budget %.0f W, peak demand %.0f W, peak load %.0f W\n",
+           pb->max_watts, st->peak_demand, st->peak_load);
+    printf("power: throttled on %llu of %llu ticks, %llu zone ticks denied, "
+           "%.1f J not delivered\n", (unsigned long long)st->throttled,
+           (unsigned long long)st->ticks, (unsigned long long)st->denied,
+           st->denied_joules);
+    for (z = 0; z < pb->nzones; z++) {
+        if (pb->zones[z].denied > 0) {
+            printf("power: zone %d denied on %llu ticks\n", z,
+                   (unsigned long long)pb->zones[z].denied);
+        }
+    }
+}
+
+#endif
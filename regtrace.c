@@ -0,0 +1,517 @@
+/**
+ * \file regtrace.c
+ *
+ * \brief Recording and replay of peripheral register accesses, built into
+ *        libpihelpers_rt. The file format is described in regtrace.h.
+ */
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "regtrace.h"
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct regtrace_event {
+    int kind;
+    int block;
+    uint32_t index;
+    uint32_t value;
+};
+
+struct regtrace {
+    int initialized;                // set once the environment has been read
+    int mode;
+    const char* path;
+    int nblocks;
+    volatile unsigned int* base[REGTRACE_MAX_BLOCKS];
+    const char* name[REGTRACE_MAX_BLOCKS];
+    uint32_t last[REGTRACE_MAX_BLOCKS][REGTRACE_BLOCK_WORDS];
+    struct regtrace_event prev;     // last event written or read back
+    int have_prev;
+    uint64_t events;
+
+    // recording
+    FILE* out;
+    int busy;                       // set while an event is being written
+    uint64_t last_ns;
+    uint32_t repeats;               // repeats of prev not yet written
+    uint64_t repeat_ns;
+
+    // replay
+    const uint8_t* data;
+    size_t len;
+    size_t pos;
+    uint32_t pending;               // repeats of prev still to hand out
+    struct regtrace_event next;
+    int have_next;
+    int ended;
+    uint64_t skipped;
+};
+
+static struct regtrace regtrace;
+
+/////////////////////////////////////////////////////////////////////
+// Varints
+/////////////////////////////////////////////////////////////////////
+
+// The same encodings as tslog.h, which can't be included here since the
+// program linking this library has its own copy of it
+
+/**
+ * \brief Writes an unsigned LEB128 varint
+ *
+ * \returns The number of bytes written (at most 5)
+ */
+static size_t regtrace_put_varint(uint8_t* out, uint32_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+
+/**
+ * \brief Reads an unsigned LEB128 varint
+ *
+ * \returns The number of bytes read, or 0 if the varint runs past end
+ */
+static size_t regtrace_get_varint(const uint8_t* in, const uint8_t* end,
+                                  uint32_t* v)
+{
+    size_t n = 0;
+    unsigned shift = 0;
+    *v = 0;
+    while (in + n < end && shift < 35) {
+        uint8_t b = in[n++];
+        *v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return n;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+static uint64_t regtrace_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t regtrace_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Recording
+/////////////////////////////////////////////////////////////////////
+
+static uint64_t regtrace_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * \brief Writes out the repeats of the previous event that have built up
+ */
+static void regtrace_flush_repeats()
+{
+    uint8_t buf[11];
+    size_t n = 0;
+    if (regtrace.repeats == 0) {
+        return;
+    }
+    buf[n++] = REGTRACE_REPEAT;
+    n += regtrace_put_varint(buf + n, regtrace.repeats);
+    n += regtrace_put_varint(buf + n, regtrace.repeat_ns > UINT32_MAX ?
+                                   UINT32_MAX : regtrace.repeat_ns);
+    fwrite(buf, 1, n, regtrace.out);
+    regtrace.repeats = 0;
+    regtrace.repeat_ns = 0;
+}
+
+/**
+ * \brief Appends one register access to the recording
+ */
+static void regtrace_record(int kind, int block, uint32_t index, uint32_t value)
+{
+    struct regtrace_event* p = &regtrace.prev;
+    uint8_t buf[16];
+    size_t n = 0;
+    uint64_t now, dt;
+
+    // an access from a signal handler that interrupted another access
+    if (regtrace.busy) {
+        return;
+    }
+    regtrace.busy = 1;
+    now = regtrace_now_ns();
+    dt = now - regtrace.last_ns;
+    regtrace.last_ns = now;
+    regtrace.events++;
+    if (regtrace.have_prev && p->kind == kind && p->block == block &&
+        p->index == index && p->value == value &&
+        regtrace.repeats < UINT32_MAX) {
+        regtrace.repeats++;
+        regtrace.repeat_ns += dt;
+        regtrace.busy = 0;
+        return;
+    }
+    regtrace_flush_repeats();
+
+    buf[n++] = kind | block << 2;
+    n += regtrace_put_varint(buf + n, index);
+    n += regtrace_put_varint(buf + n, dt > UINT32_MAX ? UINT32_MAX : dt);
+    n += regtrace_put_varint(buf + n, regtrace_zigzag(
+             (int32_t)(value - regtrace.last[block][index])));
+    fwrite(buf, 1, n, regtrace.out);
+
+    regtrace.last[block][index] = value;
+    p->kind = kind;
+    p->block = block;
+    p->index = index;
+    p->value = value;
+    regtrace.have_prev = 1;
+    regtrace.busy = 0;
+}
+
+/**
+ * \brief Finishes the recording, called at exit
+ */
+static void regtrace_close()
+{
+    if (regtrace.out == NULL) {
+        return;
+    }
+    regtrace_flush_repeats();
+    fclose(regtrace.out);
+    regtrace.out = NULL;
+    printf("regtrace: recorded %llu register accesses to %s\n",
+           (unsigned long long)regtrace.events, regtrace.path);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Replay
+/////////////////////////////////////////////////////////////////////
+
+static const char* regtrace_kind_name(int kind)
+{
+    return kind == REGTRACE_READ ? "read" : kind == REGTRACE_WRITE ? "write"
+                                                                   : "map";
+}
+
+/**
+ * \brief Decodes the next event of the recording into regtrace.next
+ *
+ * \returns 1 if there was one, 0 at the end of the recording
+ */
+static int regtrace_decode()
+{
+    const uint8_t* end = regtrace.data + regtrace.len;
+    struct regtrace_event* e = &regtrace.next;
+    uint32_t a, b, c;
+    size_t n;
+
+    if (regtrace.have_next) {
+        return 1;
+    }
+    while (regtrace.pending == 0) {
+        const uint8_t* in = regtrace.data + regtrace.pos;
+        if (in >= end) {
+            return 0;
+        }
+        e->kind = *in & 3;
+        e->block = *in++ >> 2;
+        if ((n = regtrace_get_varint(in, end, &a)) == 0) {
+            return 0;
+        }
+        in += n;
+        if (e->kind == REGTRACE_MAP) {
+            if (a > (size_t)(end - in)) {
+                return 0;
+            }
+            e->index = in - regtrace.data;
+            e->value = a;
+            regtrace.pos = in + a - regtrace.data;
+            regtrace.have_next = 1;
+            return 1;
+        }
+        if ((n = regtrace_get_varint(in, end, &b)) == 0) {
+            return 0;
+        }
+        in += n;
+        if (e->kind == REGTRACE_REPEAT) {
+            regtrace.pos = in - regtrace.data;
+            regtrace.pending = a;
+            if (!regtrace.have_prev) {
+                return 0;
+            }
+            break;
+        }
+        if ((n = regtrace_get_varint(in, end, &c)) == 0 ||
+            e->block >= REGTRACE_MAX_BLOCKS || a >= REGTRACE_BLOCK_WORDS) {
+            return 0;
+        }
+        regtrace.pos = in + n - regtrace.data;
+        e->index = a;
+        e->value = regtrace.last[e->block][a] + (uint32_t)regtrace_unzigzag(c);
+        regtrace.last[e->block][a] = e->value;
+        regtrace.prev = *e;
+        regtrace.have_prev = 1;
+        regtrace.have_next = 1;
+        return 1;
+    }
+    regtrace.pending--;
+    *e = regtrace.prev;
+    regtrace.have_next = 1;
+    return 1;
+}
+
+/**
+ * \brief Stops the replay, letting the program shut down as if interrupted
+ */
+static void regtrace_stop()
+{
+    regtrace.ended = 1;
+    printf("regtrace: replayed %llu register accesses, %llu recorded writes "
+           "skipped\n", (unsigned long long)regtrace.events,
+           (unsigned long long)regtrace.skipped);
+    // stdout is fully buffered when it is not a terminal
+    fflush(stdout);
+    raise(SIGINT);
+}
+
+/**
+ * \brief Matches an access made by the code against the recording
+ *
+ * \returns 0 if it matched, -1 if the replay has stopped
+ */
+static int regtrace_replay(int kind, int block, uint32_t index, uint32_t* value)
+{
+    struct regtrace_event* e = &regtrace.next;
+    if (regtrace.ended) {
+        return -1;
+    }
+    for (;;) {
+        if (!regtrace_decode()) {
+            regtrace_stop();
+            return -1;
+        }
+        if (e->kind == kind && e->block == block && e->index == index &&
+            (kind != REGTRACE_WRITE || e->value == *value)) {
+            break;
+        }
+        if (e->kind != REGTRACE_WRITE) {
+            printf("regtrace: replay diverged after %llu accesses: recording "
+                   "has a %s of %s[%u], code made a %s of %s[%u]\n",
+                   (unsigned long long)regtrace.events,
+                   regtrace_kind_name(e->kind),
+                   e->block < regtrace.nblocks ? regtrace.name[e->block] : "?",
+                   e->index, regtrace_kind_name(kind),
+                   regtrace.name[block], index);
+            regtrace_stop();
+            return -1;
+        }
+        regtrace.skipped++;
+        regtrace.have_next = 0;
+    }
+    *value = e->value;
+    regtrace.have_next = 0;
+    regtrace.events++;
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Interface used by pi_helpers.h
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Reads PI_REGTRACE and opens the recording, on the first call only
+ *
+ * \returns The mode, REGTRACE_OFF, REGTRACE_RECORD or REGTRACE_REPLAY
+ */
+int regtrace_init(void)
+{
+    const char* env;
+    uint32_t header[2];
+
+    if (regtrace.initialized) {
+        return regtrace.mode;
+    }
+    regtrace.initialized = 1;
+    regtrace.mode = REGTRACE_OFF;
+    if ((env = getenv("PI_REGTRACE")) == NULL || *env == '\0') {
+        return regtrace.mode;
+    }
+    if (strncmp(env, "record:", 7) == 0) {
+        regtrace.path = env + 7;
+        if ((regtrace.out = fopen(regtrace.path, "wb")) == NULL) {
+            printf("regtrace: can't create %s\n", regtrace.path);
+            exit(-1);
+        }
+        setvbuf(regtrace.out, NULL, _IOFBF, 1 << 16);
+        header[0] = REGTRACE_MAGIC;
+        header[1] = REGTRACE_VERSION;
+        fwrite(header, sizeof(header), 1, regtrace.out);
+        regtrace.last_ns = regtrace_now_ns();
+        atexit(regtrace_close);
+        regtrace.mode = REGTRACE_RECORD;
+    } else if (strncmp(env, "replay:", 7) == 0) {
+        struct stat st;
+        void* map = MAP_FAILED;
+        int fd;
+        regtrace.path = env + 7;
+        if ((fd = open(regtrace.path, O_RDONLY)) >= 0) {
+            if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(header)) {
+                map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            close(fd);
+        }
+        if (map == MAP_FAILED) {
+            printf("regtrace: can't read %s\n", regtrace.path);
+            exit(-1);
+        }
+        memcpy(header, map, sizeof(header));
+        if (header[0] != REGTRACE_MAGIC || header[1] != REGTRACE_VERSION) {
+            printf("regtrace: %s is not a register recording\n",
+                   regtrace.path);
+            exit(-1);
+        }
+        regtrace.data = map;
+        regtrace.len = st.st_size;
+        regtrace.pos = sizeof(header);
+        regtrace.mode = REGTRACE_REPLAY;
+    } else {
+        printf("regtrace: PI_REGTRACE must be record:path or replay:path\n");
+        exit(-1);
+    }
+    return regtrace.mode;
+}
+
+/**
+ * \brief Registers a newly mapped register block
+ *
+ * \param base   the mapped block (a zeroed page when replaying)
+ * \param name   the peripheral name, checked against the recording
+ *
+ * \returns base
+ */
+volatile unsigned int* regtrace_map(volatile unsigned int* base,
+                                    const char* name)
+{
+    int block = regtrace.nblocks;
+    size_t len = strlen(name);
+    if (block == REGTRACE_MAX_BLOCKS) {
+        printf("regtrace: too many register blocks\n");
+        exit(-1);
+    }
+    regtrace.base[block] = base;
+    regtrace.name[block] = name;
+    regtrace.nblocks++;
+
+    if (regtrace.mode == REGTRACE_RECORD) {
+        uint8_t buf[5];
+        regtrace_flush_repeats();
+        fputc(REGTRACE_MAP | block << 2, regtrace.out);
+        fwrite(buf, 1, regtrace_put_varint(buf, len), regtrace.out);
+        fwrite(name, 1, len, regtrace.out);
+    } else if (regtrace.mode == REGTRACE_REPLAY && !regtrace.ended) {
+        struct regtrace_event* e = &regtrace.next;
+        if (!regtrace_decode() || e->kind != REGTRACE_MAP ||
+            e->block != block || e->value != len ||
+            memcmp(regtrace.data + e->index, name, len) != 0) {
+            printf("regtrace: %s was not mapped at this point of the "
+                   "recording\n", name);
+            exit(-1);
+        }
+        regtrace.have_next = 0;
+    }
+    return base;
+}
+
+/**
+ * \brief Finds the block a register pointer belongs to
+ */
+static int regtrace_block(volatile unsigned int* base)
+{
+    int i;
+    for (i = 0; i < regtrace.nblocks; i++) {
+        if (regtrace.base[i] == base) {
+            return i;
+        }
+    }
+    printf("regtrace: access to an unmapped register block\n");
+    exit(-1);
+}
+
+/**
+ * \brief Completes the handshakes the code busy-waits on once the replay has
+ *        stopped, so it gets back to its loop and sees the SIGINT
+ *
+ * \note Sets DONE in the SPI CS register and M1 in the system timer CS
+ *       register, the bits spi_send_receive() and sleep_micros() wait for.
+ */
+static void regtrace_release(int block, unsigned int index)
+{
+    volatile unsigned int* base = regtrace.base[block];
+    if (index != 0) {
+        return;
+    }
+    if (strcmp(regtrace.name[block], "spi0") == 0) {
+        base[0] |= 0x00010000;
+    } else if (strcmp(regtrace.name[block], "sys_timer") == 0) {
+        base[0] |= 0x2;
+    }
+}
+
+/**
+ * \brief Reads a register, from the hardware or from the recording
+ */
+unsigned int regtrace_read(volatile unsigned int* base, unsigned int index)
+{
+    uint32_t value;
+    if (regtrace.mode == REGTRACE_REPLAY) {
+        int block = regtrace_block(base);
+        if (regtrace_replay(REGTRACE_READ, block, index, &value) == 0) {
+            base[index] = value;
+        } else {
+            regtrace_release(block, index);
+        }
+        return base[index];
+    }
+    value = base[index];
+    if (regtrace.mode == REGTRACE_RECORD) {
+        regtrace_record(REGTRACE_READ, regtrace_block(base), index, value);
+    }
+    return value;
+}
+
+/**
+ * \brief Writes a register, checking it against the recording when replaying
+ */
+void regtrace_write(volatile unsigned int* base, unsigned int index,
+                    unsigned int value)
+{
+    uint32_t v = value;
+    if (regtrace.mode == REGTRACE_REPLAY) {
+        regtrace_replay(REGTRACE_WRITE, regtrace_block(base), index, &v);
+    }
+    base[index] = value;
+    if (regtrace.mode == REGTRACE_RECORD) {
+        regtrace_record(REGTRACE_WRITE, regtrace_block(base), index, value);
+    }
+}
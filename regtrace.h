@@ -0,0 +1,92 @@
+/**
+ * \file regtrace.h
+ *
+ * \brief Recording and replay of every peripheral register access, so a run
+ *        on a Pi in the field can be re-executed deterministically on a
+ *        development machine.
+ *
+ * Built into libpihelpers_rt from regtrace.c. Binaries compiled with
+ * -DPI_REGTRACE and linked against it get pi_helpers.h routing their register
+ * accesses through regtrace_read() and regtrace_write().
+ * The mode is picked at startup from the environment:
+ *
+ *     PI_REGTRACE=record:run.rgt    access the hardware and log each access
+ *     PI_REGTRACE=replay:run.rgt    no hardware, reads return recorded values
+ *
+ * A recording is a small header followed by a stream of events. Each event
+ * is a tag byte (the kind of event in the low two bits, the register block
+ * above them) followed by LEB128 varints:
+ *
+ *   map      name length, name          a block was mapped
+ *   read     word, ns since last event, zigzag delta from the last value
+ *   write    word, ns since last event, zigzag delta from the last value
+ *   repeat   count, ns spanned          the previous event happened again
+ *
+ * Values are stored as the difference from the last value seen in the same
+ * register, so free running counters cost a byte or two per read, and the
+ * busy-wait loops polling a status register collapse into one repeat event.
+ *
+ * During replay the control code runs unmodified against zeroed pages. Reads
+ * must match the recording in order; recorded writes the replay does not make
+ * (such as one made by a signal handler) are skipped and counted. When the
+ * recording runs out, or the code does something the recording never did,
+ * SIGINT is raised so the program shuts down the way it does on ctrl-c. From
+ * then on the status bits the code busy-waits on read as set, so no loop
+ * waits for hardware that is no longer being replayed.
+ */
+#ifndef REGTRACE_H
+#define REGTRACE_H
+
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define REGTRACE_MAGIC         0x52544752    // "RGTR"
+#define REGTRACE_VERSION       1
+#define REGTRACE_MAX_BLOCKS    8
+#define REGTRACE_BLOCK_WORDS   1024          // one 4KB register page
+
+#define REGTRACE_OFF           0
+#define REGTRACE_RECORD        1
+#define REGTRACE_REPLAY        2
+
+#define REGTRACE_READ          0
+#define REGTRACE_WRITE         1
+#define REGTRACE_REPEAT        2
+#define REGTRACE_MAP           3
+
+/////////////////////////////////////////////////////////////////////
+// Functions
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Reads PI_REGTRACE and opens the recording, on the first call only
+ *
+ * \returns The mode, REGTRACE_OFF, REGTRACE_RECORD or REGTRACE_REPLAY
+ */
+int regtrace_init(void);
+
+/**
+ * \brief Registers a newly mapped register block
+ *
+ * \param base   the mapped block (a zeroed page when replaying)
+ * \param name   the peripheral name, checked against the recording
+ *
+ * \returns base
+ */
+volatile unsigned int* regtrace_map(volatile unsigned int* base,
+                                    const char* name);
+
+/**
+ * \brief Reads a register, from the hardware or from the recording
+ */
+unsigned int regtrace_read(volatile unsigned int* base, unsigned int index);
+
+/**
+ * \brief Writes a register, checking it against the recording when replaying
+ */
+void regtrace_write(volatile unsigned int* base, unsigned int index,
+                    unsigned int value);
+
+#endif
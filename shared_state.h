@@ -0,0 +1,310 @@
+/**
+ * \file shared_state.h
+ *
+ * \brief Live state of a running temp_control, published in a page of shared
+ *        memory (/dev/shm/temp_control.NAME) for monitoring processes to read.
+ *
+ * The control thread is the only writer and updates the page once per tick
+ * under a sequence lock: the sequence number is odd while an update is in
+ * progress and readers retry until they copy the page with the same even
+ * number before and after. The writer never waits for a reader, so a stuck
+ * or slow monitoring process can not hold up the control loop.
+ *
+ * The collector merges the pages of every temp_control on the host into one
+ * host page (/dev/shm/temp_collector), laid out as struct shared_host and
+ * read the same way.
+ */
+#ifndef SHARED_STATE_H
+#define SHARED_STATE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define SHARED_STATE_DIR        "/dev/shm"
+#define SHARED_STATE_PREFIX     "temp_control."
+#define SHARED_STATE_MAGIC      0x4d485354    // "TSHM"
+#define SHARED_STATE_VERSION    1
+#define SHARED_STATE_MAX_ZONES  64
+#define SHARED_STATE_BUCKETS    24            // tick intervals up to 2^23 us
+#define SHARED_STATE_TRIES      1000          // reads before giving up
+#define SHARED_HOST_NAME        "temp_collector"
+#define SHARED_HOST_MAGIC       0x54534854    // "THST"
+#define SHARED_HOST_INSTANCES   64
+#define SHARED_HOST_ZONES       256           // zone numbers fit a log_sample
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct shared_zone {
+    double temp;              // last reading, C
+    double target;            // C
+    double joules;            // energy used by the heater
+    double duty_minute;       // duty cycle of the last whole minute
+    uint64_t on_us;           // total heater on time
+    uint32_t heater;          // state of the control pin
+    uint32_t raw;             // last raw ADC response
+};
+
+struct shared_state {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;             // odd while the writer is updating the page
+    int32_t pid;              // of the writer
+    char name[32];
+    int64_t epoch_offset_us;  // Unix time minus the timebase
+    uint64_t updated_us;      // timebase value of the last update
+
+    // control loop
+    uint64_t ticks;
+    uint64_t overruns;        // ticks that came later than the deadline
+    uint64_t deadline_us;
+    uint64_t interval_sum_us;
+    uint64_t interval[SHARED_STATE_BUCKETS];  // ticks [2^(i-1), 2^i) us apart
+
+    // power budget
+    double budget_watts;
+    uint64_t throttled;
+    double denied_joules;
+
+    uint32_t nzones;
+    uint32_t pad;
+    struct shared_zone zones[SHARED_STATE_MAX_ZONES];
+};
+
+/**
+ * \brief One temp_control as seen by the collector
+ */
+struct shared_host_instance {
+    char name[32];
+    int32_t pid;
+    uint32_t up;              // the page exists and its writer is running
+    uint32_t first_zone;      // host zone number of the instance's zone 0
+    uint32_t nzones;
+    int64_t last_tick_unix_us;
+    uint64_t ticks;
+    uint64_t overruns;
+    uint64_t throttled;
+    double denied_joules;
+};
+
+struct shared_host {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;             // odd while the collector is updating the page
+    int32_t pid;              // of the collector
+    uint64_t polls;
+    int64_t updated_unix_us;
+    uint32_t ninstances;
+    uint32_t nzones;
+    struct shared_host_instance instances[SHARED_HOST_INSTANCES];
+    struct shared_zone zones[SHARED_HOST_ZONES];
+};
+
+/////////////////////////////////////////////////////////////////////
+// Writer
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Creates and maps the shared state page of a temp_control
+ *
+ * \param name          the name the page is published under
+ * \param deadline_us   the longest expected time between ticks
+ *
+ * \returns The page, or NULL on failure
+ */
+struct shared_state* shared_state_create(const char* name,
+                                         uint64_t deadline_us)
+{
+    char path[256];
+    struct shared_state* ss;
+    int fd;
+    snprintf(path, sizeof(path), "%s/%s%s", SHARED_STATE_DIR,
+             SHARED_STATE_PREFIX, name);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        ftruncate(fd, sizeof(struct shared_state)) < 0) {
+        printf("can't create shared state %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    ss = mmap(NULL, sizeof(struct shared_state), PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+    close(fd);
+    if (ss == MAP_FAILED) {
+        printf("can't map shared state %s\n", path);
+        return NULL;
+    }
+    ss->version = SHARED_STATE_VERSION;
+    ss->pid = getpid();
+    snprintf(ss->name, sizeof(ss->name), "%s", name);
+    ss->deadline_us = deadline_us;
+    // readers ignore the page until it is fully set up
+    __atomic_store_n(&ss->magic, SHARED_STATE_MAGIC, __ATOMIC_RELEASE);
+    return ss;
+}
+
+/**
+ * \brief Starts an update of a page, given its sequence number
+ */
+void shared_state_begin(uint32_t* seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Publishes the update started by shared_state_begin()
+ */
+void shared_state_end(uint32_t* seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Counts a tick in the interval histogram, between
+ *        shared_state_begin() and shared_state_end()
+ *
+ * \param ss       the page
+ * \param now_us   the timebase value of the tick
+ */
+void shared_state_tick(struct shared_state* ss, uint64_t now_us)
+{
+    if (ss->ticks > 0) {
+        uint64_t dt = now_us - ss->updated_us;
+        int bucket = dt == 0 ? 0 : 64 - __builtin_clzll(dt);
+        bucket = bucket < SHARED_STATE_BUCKETS ? bucket
+                                               : SHARED_STATE_BUCKETS - 1;
+        ss->interval[bucket]++;
+        ss->interval_sum_us += dt;
+        ss->overruns += dt > ss->deadline_us;
+    }
+    ss->ticks++;
+    ss->updated_us = now_us;
+}
+
+/**
+ * \brief Unmaps and removes the page, on a clean shutdown
+ */
+void shared_state_destroy(struct shared_state* ss)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s%s", SHARED_STATE_DIR,
+             SHARED_STATE_PREFIX, ss->name);
+    munmap(ss, sizeof(struct shared_state));
+    unlink(path);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Readers
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Maps the shared state page of a temp_control for reading
+ *
+ * \param path   the page, for example /dev/shm/temp_control.oven
+ *
+ * \returns The page, or NULL if it does not exist or is not a state page
+ */
+const struct shared_state* shared_state_open(const char* path)
+{
+    const struct shared_state* ss;
+    struct stat st;
+    int fd;
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*ss)) {
+        close(fd);
+        return NULL;
+    }
+    ss = mmap(NULL, sizeof(*ss), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ss == MAP_FAILED) {
+        return NULL;
+    }
+    if (__atomic_load_n(&ss->magic, __ATOMIC_ACQUIRE) != SHARED_STATE_MAGIC ||
+        ss->version != SHARED_STATE_VERSION) {
+        munmap((void*)ss, sizeof(*ss));
+        return NULL;
+    }
+    return ss;
+}
+
+/**
+ * \brief Takes a consistent copy of a page updated under a sequence lock
+ *
+ * \param page   the mapped page
+ * \param seq    its sequence number
+ * \param copy   receives the copy
+ * \param size   the size of the page
+ *
+ * \returns 0 on success, -1 if the writer kept changing the page
+ */
+int shared_seq_read(const void* page, const uint32_t* seq, void* copy,
+                    size_t size)
+{
+    int i;
+    for (i = 0; i < SHARED_STATE_TRIES; i++) {
+        uint32_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, page, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * \brief Takes a consistent copy of a shared state page
+ *
+ * \param ss     the mapped page
+ * \param copy   receives the copy
+ *
+ * \returns 0 on success, -1 if the writer kept changing the page
+ */
+int shared_state_read(const struct shared_state* ss, struct shared_state* copy)
+{
+    if (shared_seq_read(ss, &ss->seq, copy, sizeof(*copy)) < 0) {
+        return -1;
+    }
+    copy->nzones = copy->nzones < SHARED_STATE_MAX_ZONES
+                   ? copy->nzones : SHARED_STATE_MAX_ZONES;
+    return 0;
+}
+
+/**
+ * \brief Unmaps a page opened with shared_state_open()
+ */
+void shared_state_close(const struct shared_state* ss)
+{
+    munmap((void*)ss, sizeof(*ss));
+}
+
+/**
+ * \brief Returns 1 if the process that writes a page is still running
+ */
+int shared_state_alive(const struct shared_state* ss)
+{
+    return ss->pid > 0 && (kill(ss->pid, 0) == 0 || errno == EPERM);
+}
+
+#endif
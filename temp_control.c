@@ -6,14 +6,114 @@
  *
  *  \note The executable created by compiling this file accepts a value between
  *        30 and 70 (degrees Celsius)
+ *  \note More heaters can be controlled with -Z, each zone with its own pin
+ *        and ADC channel. With -B the heaters that are on together are kept
+ *        under a power budget (see power_budget.h).
+ *  \note All of this can be given in a configuration file instead (-c, see
+ *        config.h), which is reloaded while running when it changes or on
+ *        SIGHUP. The file can also name interlock inputs, such as a door
+ *        switch, which hold every heater off while active.
  */
 
 #include <math.h>
 #include <signal.h>       // for catching ctrl-c
 #include <stdio.h>        // for printing to the console
+#include <string.h>       // for strcmp
+#include <time.h>         // for clock_gettime
+#include <unistd.h>       // for getopt
 #include "pi_helpers.h"   // for talking to the Pi
+#include "log_writer.h"   // for logging samples off the control thread
+#include "ctl_state.h"    // for resuming from the previous run's state
+#include "trace.h"        // for recording a timeline of the control loop
+#include "perf_regions.h" // for hardware counters around the hot path
+#include "power_budget.h" // for sharing the supply between the heaters
+#include "energy.h"       // for heater on time and energy
+#include "shared_state.h" // for publishing the live state to monitoring
+#include "config.h"       // for the zone layout and settings
+#include "debounce.h"     // for the interlock inputs
+#include "adc_filter.h"   // for rejecting spikes in the ADC readings
+#include "filter_bank.h"  // for smoothing the readings of every zone at once
+#include "arena.h"        // for keeping the control loop off the heap
 
 #define CONTROLPIN 17
+#define HEATER_WATTS 2.5  // the 10 ohm resistor across 5V
+#define POWER_WINDOW_MS 1000   // time proportioning window of the budget
+
+/**
+ * \brief A heater, the sensor next to it and where its control loop is at
+ */
+struct zone {
+    char name[CONFIG_NAME_MAX];
+    int pin;              // control pin of the heater
+    unsigned int gpio_word, gpio_mask;  // of the pin, checked by the config
+    unsigned char adc_command;  // selects the ADC channel of the sensor
+    size_t target;        // the desired temperature to maintain
+    size_t last_temp;     // the temperature measured on the last sample
+    size_t overshoot;     // the maximum temperature reached
+    int heater;           // the state of the control pin
+    double sensed;        // the last reading
+    double temp;          // the reading as the controller sees it
+    unsigned int raw;     // the last raw ADC response
+    struct controller ctl;
+    struct energy_zone energy;
+    struct adc_filter filter;
+    int smoothed;         // temp is the low-passed reading
+    int primed;           // its smoothing filter has been settled
+};
+
+// everything the control loop works on is carved from the arena at startup,
+// so the loop itself never allocates: the zone table, a copy of it for
+// reloads, the smoothing filters and the log buffers
+struct arena arena;
+struct zone* zones = NULL;          // CONFIG_MAX_ZONES of them
+struct zone* zones_old = NULL;
+int nzones = 0;
+
+// the configuration in use, and the watcher that reloads it with -c
+struct config* active = NULL;
+struct config_watcher watcher;
+int watching = 0;
+
+// decides which of the heaters that want to be on get to be
+struct power_budget budget;
+
+// low-pass filters of the readings, channel z for zone z, stepped together
+// at the configured rate
+struct filter_bank* smoothing = NULL;
+int nsmoothed = 0;
+uint64_t smoothing_period_us, smoothing_next_us = 0;
+
+// interlock inputs, every heater is held off while one of them is active
+struct debouncer inputs;
+int interlocked = 0;
+
+// live state for monitoring, published with -n
+struct shared_state* shared = NULL;
+
+// cleared by int_handler to make the control loop exit
+volatile sig_atomic_t running = 1;
+
+// samples are handed to the logger thread when a log directory is given
+struct log_writer logger;
+int log_to_files = 0;
+
+// controller state is checkpointed here when a state file is given
+struct ctl_state state;
+int save_state = 0;
+
+// hardware counter totals for the hot path, sampled with -P
+struct perf_region perf_get_temp = PERF_REGION("get_current_temp");
+struct perf_region perf_check_temp = PERF_REGION("check_temp");
+
+// timestamps of each step of startup, printed with -v
+#define MAX_STARTUP_PHASES 16
+struct startup_phase {
+    const char* name;
+    struct timespec end;
+};
+struct startup_phase startup_phases[MAX_STARTUP_PHASES];
+int startup_nphases = 0;
+struct timespec startup_begin;
 
 /**
  * \brief Catches the SIGINT signal (sent when the user hits ctrl-c) to make
@@ -21,6 +121,8 @@
  *        on when the user hits ctrl-c, the heater will stay on and heat up
  *        hotter than we intend).
  *
+ * \note The heater is switched off right away, and the control loop then
+ *       exits on its own so the logger can write out what it has queued.
  * \note To actually make this function be called when ctrl-c is pressed, it is
  *       necessary to create a sigaction struct (in this case called act), set
  *       the sa_handler member of struct to be this function, and then call
@@ -28,8 +130,28 @@
  */
 void int_handler(int sig)
 {
-    digital_write(CONTROLPIN, 0);
-    exit(0);
+    int z;
+    (void)sig;
+    for (z = 0; z < nzones; z++) {
+        digital_write(zones[z].pin, 0);
+    }
+    running = 0;
+}
+
+/**
+ * \brief Runs one conversion of the ADC
+ *
+ * \param command   the first byte to send, which selects the channel
+ *
+ * \returns The raw 10-bit ADC response
+ */
+unsigned int read_adc(unsigned char command)
+{
+    // send formatting data to the ADC and store the responses
+    char one = spi_send_receive(command);
+    char two = spi_send_receive(0x00);
+    // shift and or the responses together in the proper order
+    return (unsigned int)(one & 0x03) << 8 | (unsigned char)two;
 }
 
 /**
@@ -38,6 +160,10 @@ void int_handler(int sig)
  *        with a DC gain of 3.2) as read by the ADC and multiplying the voltage
  *        by 32.25 to convert to temperature in Celsius.
  *
+ * \param command    the first byte to send, which selects the channel
+ * \param filter     filters the burst of ADC_BURST_N conversions read
+ * \param response   if not NULL, receives the median raw 10-bit response
+ *
  * \returns The current temperature of the resistor
  * 
  * \remarks The values of 5 and 1024 when converting from the ADC response to
@@ -56,77 +182,690 @@ void int_handler(int sig)
  * \note Datasheet for the MCP3002 (ADC) can be found here
  *       http://www.ee.ic.ac.uk/pcheung/teaching/ee2_digital/MCP3002.pdf
  */
-double get_current_temp()
+double get_current_temp(unsigned char command, struct adc_filter* filter,
+                        unsigned int* response_out)
 {
-    // send formatting data to the ADC and store the responses
-    char one = spi_send_receive(0x68);
-    char two = spi_send_receive(0x00);
-    // shift and or the responses together in the proper order
-    int response = 0x00000000;
-    response = (response | (one & 0x03)) << 8;
-    response |= two;
+    unsigned int burst[ADC_BURST_N];
+    double response;
+    int i;
+    uint64_t t = trace_begin();
+    perf_region_begin(&perf_get_temp);
+    for (i = 0; i < ADC_BURST_N; i++) {
+        burst[i] = read_adc(command);
+    }
+    trace_end("spi_transfer", t);
+    t = trace_begin();
+    // a single spike must not flip the heater
+    response = adc_filter_burst(filter, burst);
+    if (response_out != NULL) {
+        *response_out = filter->median;
+    }
     // convert response to voltage and then voltage to temperature
     double voltage = (response * 5) / 1024.0;
+    trace_end("convert", t);
+    perf_region_end(&perf_get_temp);
     return 31.25 * voltage;
 }
 
 /**
- * \brief Reads the current temperature via SPI from the ADC and adjusts the
- *        control pin to keep the temperature at the specified target.
+ * \brief Reads the temperature of every zone via SPI from the ADC and
+ *        smooths the readings of the zones that ask for it
+ *
+ * \param now   the timebase value of the tick
+ */
+void sense_zones(uint64_t now)
+{
+    int z;
+    for (z = 0; z < nzones; z++) {
+        struct zone* zone = &zones[z];
+        zone->sensed = get_current_temp(zone->adc_command, &zone->filter,
+                                        &zone->raw);
+        smoothing->in[z] = zone->sensed;
+        if (!zone->primed) {
+            filter_bank_reset(smoothing, z, zone->sensed);
+            zone->primed = 1;
+        }
+    }
+    if (nsmoothed > 0 && now >= smoothing_next_us) {
+        uint64_t t = trace_begin();
+        filter_bank_step(smoothing);
+        smoothing_next_us = now + smoothing_period_us;
+        trace_end("smoothing", t);
+    }
+    for (z = 0; z < nzones; z++) {
+        zones[z].temp = zones[z].smoothed ? smoothing->out[z]
+                                          : zones[z].sensed;
+    }
+}
+
+/**
+ * \brief Checks the current temperature of a zone and asks the power budget
+ *        for its heater if its controller wants it on.
+ *
+ * \param z     the zone to check
+ * \param now   the timebase value of the tick
  *
- * \param target_temp    The desired temperature to maintain
- * \param last_temp      The temperature measured on the last sample
- * \param overshoot      The maximum temperature beyond the target temperature
- *                       that has been reached
+ * \returns 1 if the zone wants the heater on, 0 if it wants it off
  */
-void check_temp(size_t* target_temp, size_t* last_temp, size_t* overshoot)
+int check_temp(int z, uint64_t now)
 {
+    struct zone* zone = &zones[z];
     size_t current_temp;
-    current_temp = (size_t)get_current_temp();
+    int want;
+    uint64_t control = trace_begin();
+    perf_region_begin(&perf_check_temp);
+    current_temp = (size_t)zone->temp;
     
     // do this check to prevent too many temperature outputs to the console
-    if (current_temp != *(last_temp)) {
-        printf("current temp: %lu\n", current_temp);
-        *(last_temp) = current_temp;
-        if (current_temp >= *(target_temp)) {
-            printf("overshoot: %lu\n", *(overshoot) - *(target_temp));
+    if (current_temp != zone->last_temp) {
+        // when logging to files the logger thread does all of the output
+        if (!log_to_files) {
+            if (nzones > 1) {
+                printf("zone %d ", z);
+            }
+            printf("current temp: %lu\n", current_temp);
+            if (current_temp >= zone->target) {
+                printf("overshoot: %lu\n", zone->overshoot - zone->target);
+            }
         }
+        zone->last_temp = current_temp;
     }
-    // turn on the heater if we are below the target temperature
-    if (current_temp < *(target_temp)) {
-        digital_write(CONTROLPIN, 1);
+    // heat if the controller says so, by default while we are below the
+    // target temperature
+    want = zone->ctl.step(&zone->ctl, zone->temp, now);
+    power_budget_request(&budget, z, want && !interlocked,
+                         zone->ctl.target - zone->temp);
+    // keep track of the maximum temperature we achieve
+    zone->overshoot = fmax(current_temp, zone->overshoot);
+    trace_end("check_temp", control);
+    perf_region_end(&perf_check_temp);
+    return want;
+}
+
+/**
+ * \brief Publishes the state of every zone after a tick
+ *
+ * \param now   The timebase value of the tick
+ */
+void publish_state(uint64_t now)
+{
+    int z;
+    shared_state_begin(&shared->seq);
+    shared_state_tick(shared, now);
+    shared->throttled = budget.stats.throttled;
+    shared->denied_joules = budget.stats.denied_joules;
+    shared->nzones = nzones;
+    for (z = 0; z < nzones; z++) {
+        struct shared_zone* sz = &shared->zones[z];
+        sz->temp = zones[z].temp;
+        sz->target = zones[z].target;
+        sz->heater = zones[z].heater;
+        sz->raw = zones[z].raw;
+        sz->on_us = zones[z].energy.on_us;
+        sz->joules = energy_joules(&zones[z].energy);
+        sz->duty_minute = energy_duty_minute(&zones[z].energy);
     }
-    // turn off the heater if we are above or at the target temperature
-    else {
-        digital_write(CONTROLPIN, 0);
+    shared_state_end(&shared->seq);
+}
+
+/**
+ * \brief Switches the heaters the power budget allows on and the others off,
+ *        and logs the samples of the tick
+ *
+ * \param now   The timebase value of the tick
+ */
+void drive_heaters(uint64_t now)
+{
+    uint8_t heater[POWER_MAX_ZONES];
+    uint64_t t = trace_begin();
+    int z;
+    power_budget_allocate(&budget, now, heater);
+    for (z = 0; z < nzones; z++) {
+        gpio_write_mask(zones[z].gpio_word, zones[z].gpio_mask, heater[z]);
+        zones[z].heater = heater[z];
     }
-    // keep track of the maximum temperature we achieve
-    *(overshoot) = fmax(current_temp, *(overshoot));
+    trace_end("gpio_write", t);
+    for (z = 0; z < nzones; z++) {
+        energy_update(&zones[z].energy, heater[z], now);
+    }
+    if (shared != NULL) {
+        publish_state(now);
+    }
+
+    if (log_to_files) {
+        for (z = 0; z < nzones; z++) {
+            struct log_sample sample;
+            sample.t_us = now;
+            sample.temp = zones[z].temp;
+            sample.raw = zones[z].raw;
+            sample.heater = heater[z];
+            sample.zone = z;
+            log_push(&logger, &sample);
+        }
+    }
+}
+
+/**
+ * \brief Takes a snapshot of the GPIO levels, both GPLEV words
+ */
+void read_levels(uint32_t* levels)
+{
+    int w;
+    for (w = 0; w < DEBOUNCE_BANKS; w++) {
+        levels[w] = REG_READ(gpio, GPLEV0 + w);
+    }
+}
+
+/**
+ * \brief Works out from the debounced inputs whether an interlock is active
+ *
+ * \param report   print the interlocks that changed on the last sample
+ */
+void update_interlocks(int report)
+{
+    int i, w;
+    interlocked = 0;
+    for (w = 0; w < DEBOUNCE_BANKS; w++) {
+        interlocked |= (~(inputs.banks[w].state ^ active->interlock_high[w]) &
+                        active->interlock_mask[w]) != 0;
+    }
+    for (i = 0; report && i < active->ninterlocks; i++) {
+        const struct config_interlock* in = &active->interlocks[i];
+        const struct debounce_bank* b = &inputs.banks[in->pin / 32];
+        if ((b->rose | b->fell) >> in->pin % 32 & 1) {
+            printf("interlock %s %s\n", in->name,
+                   debounce_level(&inputs, in->pin) == in->active_high
+                   ? "active, heaters held off" : "clear");
+        }
+    }
+}
+
+/**
+ * \brief Samples the interlock inputs when a sample is due
+ *
+ * \note The inputs are debounced all at once, whatever their number.
+ */
+void check_interlocks(uint64_t now)
+{
+    uint32_t levels[DEBOUNCE_BANKS];
+    if (active->ninterlocks == 0 || !debounce_due(&inputs, now)) {
+        return;
+    }
+    read_levels(levels);
+    if (debounce_sample(&inputs, levels, now)) {
+        update_interlocks(1);
+    }
+}
+
+/**
+ * \brief Offsets the windows of the zones' controllers by their phases in
+ *        the power budget, so their on times don't all line up
+ *
+ * \param now   The current system timer value
+ */
+void stagger_zones(uint64_t now)
+{
+    int z;
+    for (z = 0; z < nzones; z++) {
+        controller_stagger(&zones[z].ctl, budget.zones[z].phase_us * 1e-6,
+                           now);
+    }
+}
+
+/**
+ * \brief Switches the control loop over to a configuration, carrying over
+ *        the state of every zone that keeps its name
+ *
+ * \param cfg   the configuration, which must stay valid while in use
+ * \param now   The current system timer value
+ */
+void apply_config(struct config* cfg, uint64_t now)
+{
+    struct zone* old = zones_old;
+    struct power_stats stats = budget.stats;
+    struct fsel_batch outputs;
+    struct pull_batch pulls;
+    uint32_t levels[DEBOUNCE_BANKS];
+    int nold = nzones, z, y;
+
+    memcpy(old, zones, nold * sizeof(zones[0]));
+    // heaters that are no longer configured are switched off for good
+    for (y = 0; y < nold; y++) {
+        for (z = 0; z < cfg->nzones && cfg->zones[z].pin != old[y].pin; z++);
+        if (z == cfg->nzones) {
+            digital_write(old[y].pin, 0);
+        }
+    }
+    power_budget_init(&budget, cfg->budget_watts, POWER_WINDOW_MS);
+    budget.stats = stats;
+    fsel_batch_init(&outputs);
+    filter_bank_init(smoothing);
+    nsmoothed = 0;
+    for (z = 0; z < cfg->nzones; z++) {
+        const struct config_zone* cz = &cfg->zones[z];
+        struct zone* zone = &zones[z];
+        for (y = 0; y < nold && strcmp(old[y].name, cz->name) != 0; y++);
+        if (y < nold) {
+            *zone = old[y];
+        } else {
+            memset(zone, 0, sizeof(*zone));
+            energy_init(&zone->energy, cz->watts, now);
+        }
+        // clear the latch now and make the pin an output with the others
+        // after the loop, so a new pin never drives a heater on
+        if (y == nold || old[y].pin != cz->pin) {
+            digital_write(cz->pin, 0);
+            fsel_batch_add(&outputs, cz->pin, OUTPUT);
+            zone->heater = 0;
+        }
+        if (y == nold || strcmp(zone->ctl.name, cz->controller) != 0) {
+            controller_init(&zone->ctl, cz->controller, cz->target);
+        }
+        snprintf(zone->name, sizeof(zone->name), "%s", cz->name);
+        zone->pin = cz->pin;
+        zone->gpio_word = cz->gpio_word;
+        zone->gpio_mask = cz->gpio_mask;
+        zone->adc_command = cz->adc_command;
+        zone->target = (size_t)cz->target;
+        zone->ctl.target = cz->target;
+        energy_set_watts(&zone->energy, cz->watts, now);
+        filter_bank_add_lowpass(smoothing, cz->smooth_s, 1 / cfg->filter_hz);
+        zone->smoothed = cz->smooth_s > 0;
+        nsmoothed += zone->smoothed;
+        if (y < nold) {
+            filter_bank_reset(smoothing, z, zone->temp);
+        }
+        power_budget_add_zone(&budget, cz->watts, cz->priority);
+    }
+    // interlock inputs get their pulls before they are first read
+    pull_batch_init(&pulls);
+    for (z = 0; z < cfg->ninterlocks; z++) {
+        fsel_batch_add(&outputs, cfg->interlocks[z].pin, INPUT);
+        pull_batch_add(&pulls, cfg->interlocks[z].pin,
+                       cfg->interlocks[z].pull);
+    }
+    fsel_batch_apply(&outputs);
+    pull_batch_apply(&pulls);
+    nzones = cfg->nzones;
+    active = cfg;
+    // the phases depend on the number of zones, so every window moves
+    stagger_zones(now);
+    smoothing_period_us = 1e6 / cfg->filter_hz;
+    read_levels(levels);
+    debounce_init(&inputs, levels,
+                  cfg->debounce_ms * 1000 / DEBOUNCE_SAMPLES, now);
+    update_interlocks(0);
+    if (interlocked) {
+        printf("interlock active, heaters held off\n");
+    }
+}
+
+/**
+ * \brief Runs one tick of the control loop over every zone, switching to a
+ *        reloaded configuration first if there is one
+ */
+void control_tick()
+{
+    uint64_t now = timer_micros();
+    uint64_t tick = trace_begin();
+    int z;
+    if (watching) {
+        struct config* cfg = config_take(&watcher);
+        if (cfg != NULL) {
+            struct config* old = active;
+            apply_config(cfg, now);
+            config_retire(&watcher, old);
+            if (shared != NULL) {
+                shared->budget_watts = budget.max_watts;
+            }
+            printf("config: reloaded, %d zones\n", nzones);
+        }
+    }
+    check_interlocks(now);
+    sense_zones(now);
+    for (z = 0; z < nzones; z++) {
+        check_temp(z, now);
+    }
+    drive_heaters(now);
+    trace_end("control_tick", tick);
+}
+
+/**
+ * \brief Writes a checkpoint of the state of every zone into the state file
+ *
+ * \param now   The current system timer value
+ */
+void checkpoint_state(uint64_t now)
+{
+    struct ctl_snapshot* snap = ctl_state_begin(&state);
+    int z;
+    memset(snap->zones, 0, nzones * sizeof(snap->zones[0]));
+    snap->nzones = nzones;
+    for (z = 0; z < nzones; z++) {
+        snap->zones[z].target = zones[z].target;
+        snap->zones[z].last_temp = zones[z].last_temp;
+        snap->zones[z].overshoot = zones[z].overshoot;
+        snap->zones[z].heater = zones[z].heater;
+        memcpy(snap->zones[z].ctl, zones[z].ctl.state,
+               sizeof(snap->zones[z].ctl));
+        snprintf(snap->zones[z].name, sizeof(snap->zones[z].name), "%s",
+                 zones[z].name);
+        snprintf(snap->zones[z].controller,
+                 sizeof(snap->zones[z].controller), "%s", zones[z].ctl.name);
+    }
+    ctl_state_commit(&state, snap, now);
+}
+
+/**
+ * \brief Resumes every zone that was checkpointed under the same name,
+ *        with its controller's state if it still runs the same controller
+ *
+ * \param snap  The checkpoint
+ * \param now   The current system timer value
+ */
+void restore_state(const struct ctl_snapshot* snap, uint64_t now)
+{
+    int z, s;
+    for (z = 0; z < nzones; z++) {
+        const struct ctl_zone_state* saved = snap->zones;
+        for (s = 0; s < (int)snap->nzones &&
+                    strncmp(saved[s].name, zones[z].name,
+                            sizeof(saved[s].name)) != 0; s++);
+        if (s == (int)snap->nzones) {
+            continue;
+        }
+        zones[z].last_temp = saved[s].last_temp;
+        zones[z].overshoot = saved[s].overshoot;
+        if (strncmp(saved[s].controller, zones[z].ctl.name,
+                    sizeof(saved[s].controller)) == 0) {
+            controller_resume(&zones[z].ctl, saved[s].ctl,
+                              budget.zones[z].phase_us * 1e-6, now);
+        }
+    }
+}
+
+/**
+ * \brief Adds a zone from a -Z description, pin,channel[,watts[,priority]]
+ *
+ * \returns 0 on success, -1 if the description is invalid
+ */
+int parse_zone(struct config* cfg, const char* spec)
+{
+    char name[CONFIG_NAME_MAX];
+    struct config_zone* zone;
+    snprintf(name, sizeof(name), "%d", cfg->nzones);
+    if ((zone = config_add_zone(cfg, name)) == NULL ||
+        sscanf(spec, "%d,%d,%lf,%d", &zone->pin, &zone->channel,
+               &zone->watts, &zone->priority) < 2) {
+        printf("invalid zone %s\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Records that a step of startup has just finished
+ *
+ * \param name   the name of the step, shown in the startup report
+ */
+void startup_mark(const char* name)
+{
+    if (startup_nphases < MAX_STARTUP_PHASES) {
+        startup_phases[startup_nphases].name = name;
+        clock_gettime(CLOCK_MONOTONIC, &startup_phases[startup_nphases].end);
+        startup_nphases++;
+    }
+}
+
+/**
+ * \brief Returns the number of milliseconds between two timestamps
+ */
+double elapsed_ms(const struct timespec* from, const struct timespec* to)
+{
+    return (to->tv_sec - from->tv_sec) * 1e3 +
+           (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/**
+ * \brief Prints how long each step of startup took and when it finished,
+ *        relative to the start of main()
+ */
+void print_startup_report()
+{
+    const struct timespec* prev = &startup_begin;
+    int i;
+    for (i = 0; i < startup_nphases; i++) {
+        printf("startup: %-14s %8.3f ms  (done at %8.3f ms)\n",
+               startup_phases[i].name,
+               elapsed_ms(prev, &startup_phases[i].end),
+               elapsed_ms(&startup_begin, &startup_phases[i].end));
+        prev = &startup_phases[i].end;
+    }
+}
+
+/**
+ * \brief Parses the comma separated -o log options into a log_config
+ *
+ * \returns 0 on success, -1 if an option was not recognized
+ */
+int parse_log_options(char* options, struct log_config* config)
+{
+    char* const tokens[] = { "segment_mb", "rotate_s", "flush_ms",
+                             "compress", "format", "sync_ms", "sync_kb",
+                             NULL };
+    char* value;
+    while (*options != '\0') {
+        int token = getsubopt(&options, tokens, &value);
+        unsigned long n = value != NULL ? strtoul(value, NULL, 10) : 0;
+        switch (token) {
+        case 0: config->segment_bytes = n * 1024 * 1024; break;
+        case 1: config->segment_secs = n;                break;
+        case 2: config->flush_ms = n;                    break;
+        case 3: config->compress = value == NULL || n;   break;
+        case 4:
+            if (value != NULL && strcmp(value, "text") == 0) {
+                config->format = LOG_FORMAT_TEXT;
+            } else if (value != NULL && strcmp(value, "tsb") == 0) {
+                config->format = LOG_FORMAT_TSB;
+            } else {
+                printf("unknown log format %s\n", value ? value : "");
+                return -1;
+            }
+            break;
+        case 5: config->sync_ms = n;                     break;
+        case 6: config->sync_bytes = n * 1024;           break;
+        default:
+            printf("unknown log option %s\n", value);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Maps the arena and carves the runtime structures out of it
+ *
+ * \param logging   leave room for the log buffers
+ *
+ * \returns 0 on success, -1 if the arena can't be mapped
+ */
+int setup_arena(int logging)
+{
+    size_t table = CONFIG_MAX_ZONES * sizeof(struct zone);
+    size_t size = 2 * ARENA_SIZE(table, ARENA_ALIGN) +
+                  ARENA_SIZE(sizeof(struct filter_bank), ARENA_ALIGN) +
+                  ARENA_SIZE(BUFSIZ, ARENA_ALIGN);
+    if (logging) {
+        size += log_arena_size(CONFIG_MAX_ZONES);
+    }
+    if (arena_init(&arena, size) < 0) {
+        return -1;
+    }
+    zones = ARENA_NEW(&arena, struct zone, CONFIG_MAX_ZONES);
+    zones_old = ARENA_NEW(&arena, struct zone, CONFIG_MAX_ZONES);
+    smoothing = ARENA_NEW(&arena, struct filter_bank, 1);
+    // stdio allocates the buffer of stdout on its first use, which could be
+    // a reload message from inside the loop
+    setvbuf(stdout, ARENA_NEW(&arena, char, BUFSIZ),
+            isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, BUFSIZ);
+    return 0;
 }
 
 int main(int argc, char* argv[])
 {
-    size_t target_temp, last_temp, overshoot;
-    if(argc != 2) {
+    const char* config_path = NULL;
+    const char* state_path = NULL;
+    const char* trace_path = NULL;
+    const char* shared_name = NULL;
+    char* log_options = NULL;
+    char err[CONFIG_LINE_MAX];
+    // settings only read at startup, copied as a reload frees the table
+    static char log_dir[CONFIG_PATH_MAX], state_file[CONFIG_PATH_MAX];
+    static char name[CONFIG_NAME_MAX], file_options[CONFIG_PATH_MAX];
+    int verbose = 0, cli_layout = 0;
+    unsigned perf_sample = 0;
+    struct log_config log_config = { NULL, NULL, 0, 0, 0, 1, LOG_FORMAT_TSB, 0,
+                                     0, 0, NULL };
+    struct config* cfg;
+    int opt, z;
+
+    clock_gettime(CLOCK_MONOTONIC, &startup_begin);
+    if ((cfg = malloc(sizeof(*cfg))) == NULL) {
+        return 1;
+    }
+    config_defaults(cfg);
+    while ((opt = getopt(argc, argv, "B:c:l:n:o:P:s:T:vZ:")) != -1) {
+        switch (opt) {
+        case 'B':
+            cfg->budget_watts = strtod(optarg, NULL);
+            cli_layout = 1;
+            break;
+        case 'c':
+            config_path = optarg;
+            break;
+        case 'Z':
+            if (parse_zone(cfg, optarg) < 0) {
+                return 1;
+            }
+            cli_layout = 1;
+            break;
+        case 'P':
+            perf_sample = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 's':
+            state_path = optarg;
+            break;
+        case 'l':
+            log_config.dir = optarg;
+            break;
+        case 'n':
+            shared_name = optarg;
+            break;
+        case 'o':
+            log_options = optarg;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+
+    if (config_path != NULL ? argc - optind != 0 || cli_layout
+                            : argc - optind != 1) {
         printf("Incorrect call to temp_control. The correct format is\n");
-        printf("\t./temp_control temperature\n");
+        printf("\t./temp_control [-v] [-l log_dir] [-o log_options] "
+               "[-s state_file] [-T trace.json] [-P every_n]\n\t\t"
+               "[-n name] [-Z pin,channel[,watts[,priority]]]... [-B watts] "
+               "temperature\n");
+        printf("or\n\t./temp_control [-v] [-l log_dir] [-o log_options] "
+               "[-s state_file] [-T trace.json] [-P every_n]\n\t\t"
+               "[-n name] -c config_file\n");
+        printf("where log_options is a comma separated list of\n");
+        printf("\tsegment_mb=N  rotate_s=N  flush_ms=N  compress=0|1\n");
+        printf("\tformat=tsb|text  sync_ms=N  sync_kb=N\n");
+        printf("-n publishes the live state in %s/%sname\n",
+               SHARED_STATE_DIR, SHARED_STATE_PREFIX);
+        printf("each -Z adds a zone, the default is a %g W heater on pin "
+               "%d read on channel 0,\n", HEATER_WATTS, CONTROLPIN);
+        printf("and -c reads all of these from a file that is reloaded when "
+               "it changes\n");
         return 1;
     }
 
-    target_temp = strtol(argv[1], NULL, 10);
+    if (config_path != NULL) {
+        if (config_load(config_path, cfg, err, sizeof(err)) < 0) {
+            printf("%s\n", err);
+            return 2;
+        }
+    } else {
+        double target_temp = strtol(argv[optind], NULL, 10);
+        if (cfg->nzones == 0) {
+            struct config_zone* zone = config_add_zone(cfg, "0");
+            zone->pin = CONTROLPIN;
+            zone->watts = HEATER_WATTS;
+        }
+        for (z = 0; z < cfg->nzones; z++) {
+            cfg->zones[z].target = target_temp;
+        }
+        if (config_finish(cfg, err, sizeof(err)) < 0) {
+            if (strstr(err, "target") != NULL) {
+                printf("Invalid temperature parameter. Please choose a "
+                       "temperature between 30 and 70\n");
+            } else {
+                printf("%s\n", err);
+            }
+            return 2;
+        }
+    }
+    // the command line overrides the file
+    snprintf(state_file, sizeof(state_file), "%s", cfg->state_path);
+    snprintf(name, sizeof(name), "%s", cfg->name);
+    snprintf(log_dir, sizeof(log_dir), "%s", cfg->log_dir);
+    snprintf(file_options, sizeof(file_options), "%s", cfg->log_options);
+    if (state_path == NULL && state_file[0] != '\0') {
+        state_path = state_file;
+    }
+    if (shared_name == NULL && name[0] != '\0') {
+        shared_name = name;
+    }
+    if (log_config.dir == NULL && log_dir[0] != '\0') {
+        log_config.dir = log_dir;
+    }
+    if (parse_log_options(file_options, &log_config) < 0 ||
+        (log_options != NULL &&
+         parse_log_options(log_options, &log_config) < 0)) {
+        return 1;
+    }
 
-    if (target_temp > 70 || target_temp < 30) {
-        printf("Invalid temperature parameter. Please choose a temperature"
-               "between 30 and 70\n");
-        return 2;
+    if (trace_path != NULL) {
+        trace_start();
+        trace_thread("control");
     }
-    
-    pio_init();
-    spi_init(244000, 0);
-    pin_mode(CONTROLPIN, OUTPUT);
+    if (perf_sample > 0) {
+        perf_open(perf_sample);
+    }
+    startup_mark("arguments");
 
-    last_temp = 0;
-    overshoot = 0;
+    // Fast path to a safe heater: map GPIO alone, clear the output latches
+    // and only then make the pins outputs, so they never drive a heater on.
+    // Everything else waits until the pins are in a known state. The zone
+    // tables come from the arena, which is only mapped here and has its
+    // pages faulted in once the heaters are safe.
+    if (setup_arena(log_config.dir != NULL) < 0) {
+        return 3;
+    }
+    log_config.arena = &arena;
+    pio_init();
+    apply_config(cfg, 0);
+    startup_mark("heater safe");
+    arena_populate(&arena);
+    startup_mark("arena");
 
     //catch SIGINT (signal sent when pressing ctrl-c)
     signal(SIGINT, int_handler);
@@ -134,9 +873,122 @@ int main(int argc, char* argv[])
 //    act.sa_handler = int_handler;
 //    sigaction(SIGINT, &act, NULL);
 
-    // continuously check on the temperature
-    while(1) {
-        check_temp(&target_temp, &last_temp, &overshoot);
+    timer_init();
+    spi_init(active->spi_hz, 0);
+    for (z = 0; z < nzones; z++) {
+        energy_init(&zones[z].energy, budget.zones[z].watts, timer_micros());
+    }
+    // apply_config() ran before the timer did
+    stagger_zones(timer_micros());
+    startup_mark("timer and spi");
+
+    // pick up where the last run left off if it stopped recently
+    if (state_path != NULL) {
+        const struct ctl_snapshot* snap;
+        if (ctl_state_open(&state, state_path) < 0) {
+            return 3;
+        }
+        snap = ctl_state_restore(&state, CTL_STATE_MAX_AGE_S);
+        if (snap != NULL && snap->nzones >= 1) {
+            restore_state(snap, timer_micros());
+            printf("warm start from state saved %lld ms ago\n",
+                   (long long)(ctl_wall_us() - snap->wall_us) / 1000);
+        }
+        save_state = 1;
+        startup_mark("state restore");
+    }
+
+    // take control before the slower setup below, the first tick goes to the
+    // console since the logger is not running yet
+    control_tick();
+    startup_mark("first tick");
+
+    // deferred setup, nothing here is needed to control the heater
+    if (log_config.dir != NULL) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        log_config.epoch_offset_us = (int64_t)now.tv_sec * 1000000 +
+                                     now.tv_nsec / 1000 - timer_micros();
+        if (log_start(&logger, &log_config) < 0) {
+            int_handler(SIGINT);
+            return 3;
+        }
+        log_to_files = 1;
+        startup_mark("logger");
+    }
+    if (shared_name != NULL) {
+        struct shared_state* ss = shared_state_create(shared_name,
+                                                      active->deadline_us);
+        struct timespec now;
+        if (ss == NULL) {
+            int_handler(SIGINT);
+            return 3;
+        }
+        clock_gettime(CLOCK_REALTIME, &now);
+        ss->epoch_offset_us = (int64_t)now.tv_sec * 1000000 +
+                              now.tv_nsec / 1000 - timer_micros();
+        ss->budget_watts = budget.max_watts;
+        shared = ss;
+        startup_mark("shared state");
+    }
+    if (config_path != NULL) {
+        watching = config_watch(&watcher, config_path) == 0;
+        startup_mark("config watch");
+    }
+    if (verbose) {
+        print_startup_report();
+    }
+
+    // continuously check on the temperature, without touching the heap
+    arena_guard_arm();
+    while(running) {
+        control_tick();
+        if (save_state) {
+            uint64_t now = timer_micros();
+            if (now - state.last_us >= CTL_STATE_PERIOD_US) {
+                checkpoint_state(now);
+            }
+        }
+    }
+    arena_guard_disarm();
+
+    if (watching) {
+        config_unwatch(&watcher);
+    }
+    // the last check may have turned heaters back on
+    for (z = 0; z < nzones; z++) {
+        digital_write(zones[z].pin, 0);
+        zones[z].heater = 0;
+        energy_update(&zones[z].energy, 0, timer_micros());
+    }
+    if (save_state) {
+        checkpoint_state(timer_micros());
+        ctl_state_sync(&state);
+    }
+    if (shared != NULL) {
+        shared_state_destroy(shared);
+    }
+    if (log_to_files) {
+        log_stop(&logger);
+        log_print_stats(&logger);
+    }
+    for (z = 0; z < nzones; z++) {
+        energy_print_stats(&zones[z].energy, z);
+        adc_filter_print_stats(&zones[z].filter, z);
+    }
+    if (budget.max_watts > 0) {
+        power_budget_print_stats(&budget);
+    }
+    arena_print_stats(&arena);
+    arena_guard_print_stats();
+    if (perf_sample > 0) {
+        const struct perf_region* regions[] = { &perf_get_temp,
+                                                &perf_check_temp };
+        perf_print_regions(regions, 2);
+        perf_close();
+    }
+    if (trace_path != NULL) {
+        trace_dump(trace_path);
     }
     return 0;
 }
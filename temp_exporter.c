@@ -0,0 +1,369 @@
+/*  \file temp_exporter.c
+ *
+ *  \brief Serves the live state of running temp_control processes as
+ *         Prometheus text metrics over HTTP.
+ *
+ *  Every temp_control started with -n NAME publishes its state in
+ *  /dev/shm/temp_control.NAME (see shared_state.h). The exporter maps those
+ *  pages read-only on each scrape and answers GET /metrics, so it never
+ *  touches the control thread and a temp_control restarted between scrapes
+ *  is picked up again:
+ *
+ *      ./temp_control -n oven 45 &
+ *      ./temp_exporter -p 9101 oven
+ *      curl localhost:9101/metrics
+ *
+ *  \note Requests are handled one at a time, on a single thread, with a
+ *        short receive timeout so a stalled client can't block the others
+ *        for long.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "shared_state.h"
+
+#define MAX_INSTANCES    64
+#define REQUEST_MAX      4096
+#define RECV_TIMEOUT_S   1
+#define LABEL_MAX        128
+
+struct instance {
+    char label[LABEL_MAX];      // name="..." label of the instance
+    int ok;                     // the page was read
+    int up;
+    struct shared_state state;
+};
+
+struct instance instances[MAX_INSTANCES];
+int ninstances = 0;
+
+/////////////////////////////////////////////////////////////////////
+// Metrics
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Formats the name="..." label of an instance, escaping backslashes,
+ *        double quotes and newlines as the exposition format requires
+ *
+ * \note A name too long for the buffer is cut short, never mid escape.
+ */
+void format_label(char* label, size_t len, const char* name)
+{
+    size_t n = snprintf(label, len, "name=\"");
+    for (; *name != '\0' && n + 4 <= len; name++) {
+        if (*name == '\\' || *name == '"') {
+            label[n++] = '\\';
+            label[n++] = *name;
+        } else if (*name == '\n') {
+            label[n++] = '\\';
+            label[n++] = 'n';
+        } else {
+            label[n++] = *name;
+        }
+    }
+    label[n++] = '"';
+    label[n] = '\0';
+}
+
+/**
+ * \brief Takes a consistent copy of the state page of every instance
+ */
+void read_instances(char** names)
+{
+    int i;
+    for (i = 0; i < ninstances; i++) {
+        struct instance* in = &instances[i];
+        char path[256];
+        const struct shared_state* ss;
+        if (strchr(names[i], '/') != NULL) {
+            snprintf(path, sizeof(path), "%s", names[i]);
+        } else {
+            snprintf(path, sizeof(path), "%s/%s%s", SHARED_STATE_DIR,
+                     SHARED_STATE_PREFIX, names[i]);
+        }
+        in->ok = in->up = 0;
+        if ((ss = shared_state_open(path)) == NULL) {
+            continue;
+        }
+        in->ok = shared_state_read(ss, &in->state) == 0;
+        in->up = in->ok && shared_state_alive(&in->state);
+        shared_state_close(ss);
+    }
+}
+
+/**
+ * \brief Writes the HELP and TYPE lines of a metric
+ */
+void family(FILE* out, const char* name, const char* type, const char* help)
+{
+    fprintf(out, "# HELP temp_control_%s %s\n", name, help);
+    fprintf(out, "# TYPE temp_control_%s %s\n", name, type);
+}
+
+/**
+ * \brief Writes one value of a per instance metric for every instance that
+ *        could be read
+ */
+#define INSTANCE_METRIC(out, name, type, help, fmt, expr)                   \
+    do {                                                                    \
+        int i_;                                                             \
+        family(out, name, type, help);                                      \
+        for (i_ = 0; i_ < ninstances; i_++) {                               \
+            const struct shared_state* s = &instances[i_].state;            \
+            if (instances[i_].ok) {                                         \
+                fprintf(out, "temp_control_%s{%s} " fmt "\n", name,         \
+                        instances[i_].label, (expr));                       \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+/**
+ * \brief Writes one value per zone of a per zone metric
+ */
+#define ZONE_METRIC(out, name, type, help, fmt, expr)                       \
+    do {                                                                    \
+        int i_;                                                             \
+        unsigned z;                                                         \
+        family(out, name, type, help);                                      \
+        for (i_ = 0; i_ < ninstances; i_++) {                               \
+            const struct instance* in_ = &instances[i_];                    \
+            for (z = 0; in_->ok && z < in_->state.nzones; z++) {            \
+                const struct shared_zone* zs = &in_->state.zones[z];        \
+                fprintf(out, "temp_control_%s{%s,zone=\"%u\"} " fmt "\n",   \
+                        name, in_->label, z, (expr));                       \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+/**
+ * \brief Writes the tick interval histogram of every instance
+ */
+void write_histogram(FILE* out)
+{
+    const char* name = "temp_control_tick_interval_seconds";
+    int i, b;
+    family(out, "tick_interval_seconds", "histogram",
+           "Time between the starts of consecutive control ticks.");
+    for (i = 0; i < ninstances; i++) {
+        const struct shared_state* s = &instances[i].state;
+        uint64_t count = 0;
+        if (!instances[i].ok) {
+            continue;
+        }
+        for (b = 0; b < SHARED_STATE_BUCKETS - 1; b++) {
+            count += s->interval[b];
+            fprintf(out, "%s_bucket{%s,le=\"%g\"} %llu\n", name,
+                    instances[i].label, (double)(1ull << b) * 1e-6,
+                    (unsigned long long)count);
+        }
+        count += s->interval[b];
+        fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name,
+                instances[i].label, (unsigned long long)count);
+        fprintf(out, "%s_sum{%s} %.6f\n", name, instances[i].label,
+                s->interval_sum_us * 1e-6);
+        fprintf(out, "%s_count{%s} %llu\n", name, instances[i].label,
+                (unsigned long long)count);
+    }
+}
+
+/**
+ * \brief Writes every metric in the Prometheus text format
+ */
+void write_metrics(FILE* out)
+{
+    int i;
+    family(out, "up", "gauge",
+           "Whether the temp_control publishing the state is running.");
+    for (i = 0; i < ninstances; i++) {
+        fprintf(out, "temp_control_up{%s} %d\n", instances[i].label,
+                instances[i].up);
+    }
+    INSTANCE_METRIC(out, "last_tick_timestamp_seconds", "gauge",
+                    "Unix time of the last control tick.", "%.6f",
+                    (s->updated_us + s->epoch_offset_us) * 1e-6);
+    INSTANCE_METRIC(out, "ticks_total", "counter",
+                    "Control ticks run.", "%llu",
+                    (unsigned long long)s->ticks);
+    INSTANCE_METRIC(out, "tick_overruns_total", "counter",
+                    "Ticks that started later than the deadline.", "%llu",
+                    (unsigned long long)s->overruns);
+    INSTANCE_METRIC(out, "tick_deadline_seconds", "gauge",
+                    "Longest expected time between ticks.", "%g",
+                    s->deadline_us * 1e-6);
+    write_histogram(out);
+    INSTANCE_METRIC(out, "power_budget_watts", "gauge",
+                    "Largest total heater load allowed, 0 for no limit.",
+                    "%g", s->budget_watts);
+    INSTANCE_METRIC(out, "power_throttled_ticks_total", "counter",
+                    "Ticks on which a heater was refused power.", "%llu",
+                    (unsigned long long)s->throttled);
+    INSTANCE_METRIC(out, "power_denied_joules_total", "counter",
+                    "Energy asked for but refused by the power budget.",
+                    "%.3f", s->denied_joules);
+
+    ZONE_METRIC(out, "temperature_celsius", "gauge",
+                "Last temperature read.", "%.3f", zs->temp);
+    ZONE_METRIC(out, "target_celsius", "gauge",
+                "Target temperature.", "%g", zs->target);
+    ZONE_METRIC(out, "adc_raw", "gauge",
+                "Last raw ADC response.", "%u", zs->raw);
+    ZONE_METRIC(out, "heater_on", "gauge",
+                "State of the heater control pin.", "%u", zs->heater);
+    ZONE_METRIC(out, "heater_on_seconds_total", "counter",
+                "Time the heater has been on.", "%.6f", zs->on_us * 1e-6);
+    ZONE_METRIC(out, "heater_energy_joules_total", "counter",
+                "Energy used by the heater.", "%.3f", zs->joules);
+    ZONE_METRIC(out, "heater_duty_ratio", "gauge",
+                "Heater duty cycle over the last whole minute.", "%.4f",
+                zs->duty_minute);
+}
+
+/////////////////////////////////////////////////////////////////////
+// HTTP
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Writes all of a buffer to a socket
+ *
+ * \returns 0 on success, -1 if the client went away
+ */
+int send_all(int fd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * \brief Answers one request on a connection
+ */
+void serve(int fd, char** names)
+{
+    char request[REQUEST_MAX + 1], header[256];
+    char* body = NULL;
+    size_t used = 0, body_len = 0;
+    FILE* out;
+
+    // the request line is all that matters, but wait for the whole header
+    while (used < REQUEST_MAX) {
+        ssize_t n = recv(fd, request + used, REQUEST_MAX - used, 0);
+        if (n <= 0) {
+            break;
+        }
+        used += n;
+        request[used] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+    request[used] = '\0';
+    if (strncmp(request, "GET /metrics ", 13) != 0 &&
+        strncmp(request, "GET / ", 6) != 0) {
+        const char* reply = "HTTP/1.0 404 Not Found\r\n"
+                            "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, reply, strlen(reply));
+        return;
+    }
+
+    if ((out = open_memstream(&body, &body_len)) == NULL) {
+        return;
+    }
+    read_instances(names);
+    write_metrics(out);
+    fclose(out);
+    snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+    if (send_all(fd, header, strlen(header)) == 0) {
+        send_all(fd, body, body_len);
+    }
+    free(body);
+}
+
+int main(int argc, char* argv[])
+{
+    struct sockaddr_in addr;
+    struct timeval timeout = { RECV_TIMEOUT_S, 0 };
+    const char* address = "127.0.0.1";
+    int port = 9101;
+    int fd, opt, one = 1, i;
+
+    while ((opt = getopt(argc, argv, "a:p:")) != -1) {
+        switch (opt) {
+        case 'a':
+            address = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > MAX_INSTANCES || port <= 0 ||
+        port > 65535) {
+        printf("Incorrect call to temp_exporter. The correct format is\n");
+        printf("\t./temp_exporter [-a address] [-p port] name...\n");
+        printf("where each name was given to a temp_control with -n, or is "
+               "the path of\nits state page\n");
+        return 1;
+    }
+    ninstances = argc - optind;
+    for (i = 0; i < ninstances; i++) {
+        const char* base = strrchr(argv[optind + i], '/');
+        base = base != NULL ? base + 1 : argv[optind + i];
+        if (strncmp(base, SHARED_STATE_PREFIX,
+                    strlen(SHARED_STATE_PREFIX)) == 0) {
+            base += strlen(SHARED_STATE_PREFIX);
+        }
+        format_label(instances[i].label, sizeof(instances[i].label), base);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+        printf("invalid address %s\n", address);
+        return 1;
+    }
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 16) < 0) {
+        printf("can't listen on %s:%d\n", address, port);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    printf("temp_exporter: serving %d instances on http://%s:%d/metrics\n",
+           ninstances, address, port);
+    fflush(stdout);
+
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout));
+        serve(client, argv + optind);
+        close(client);
+    }
+    return 0;
+}
@@ -0,0 +1,575 @@
+/**
+ * \file thermal_net.h
+ *
+ * \brief Thermal RC network plant: thermal masses (nodes) joined by thermal
+ *        conductances, losing heat to ambient, with heaters and sensors on
+ *        chosen nodes. It models enclosures where zones heat each other,
+ *        which the single node plant in plant.h cannot.
+ *
+ * For node temperatures T, capacitances C, the conductance matrix L (the
+ * weighted graph Laplacian plus each node's conductance to ambient) and
+ * heater powers P switched by the heater inputs u, the network follows
+ *
+ *     C dT/dt = -L T + G_amb T_amb + P u
+ *
+ * and is stepped with backward Euler, which stays stable for any step size:
+ *
+ *     (C/dt + L) T' = C/dt T + G_amb T_amb + P u
+ *
+ * The matrix is symmetric positive definite and as sparse as the network,
+ * so it is kept in CSR form and solved with Jacobi preconditioned conjugate
+ * gradients, warm started from the current temperatures. That takes a few
+ * iterations per step even for networks of thousands of nodes.
+ *
+ * A network is described by a text file, one statement per line:
+ *
+ *     # comment
+ *     ambient 22                  ambient temperature, C
+ *     node NAME CAP [TEMP]        thermal mass in J/K, starting temperature
+ *     link A B G                  conductance between two nodes, W/K
+ *     loss NAME G                 conductance from a node to ambient, W/K
+ *     heater ZONE NODE WATTS      heater of a control zone
+ *     sensor ZONE NODE            temperature sensor of a control zone
+ *
+ * or generated as grid:WxH[:ZONES], a W by H plate with ZONES (1, 2 or 4)
+ * heaters spread over it and each zone's sensor one node from its heater.
+ */
+#ifndef THERMAL_NET_H
+#define THERMAL_NET_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "plant.h"
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define TN_MAX_ZONES       16
+#define TN_MAX_ITERATIONS  500
+#define TN_TOLERANCE       1e-10     // relative residual of the solve
+#define TN_NAME_MAX        32
+
+// grid defaults: an aluminium-ish plate cut into cells
+#define TN_GRID_CAP        5.0       // J/K per cell
+#define TN_GRID_LINK       0.5       // W/K between neighbouring cells
+#define TN_GRID_LOSS       0.01      // W/K from each cell to ambient
+#define TN_GRID_POWER      20.0      // W per heater
+#define TN_GRID_AMBIENT    22.0
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct thermal_net {
+    struct plant base;
+    int n, nodes_cap;               // nodes
+    char (*names)[TN_NAME_MAX];
+    double* cap;                    // J/K
+    double* loss;                   // W/K to ambient
+    double* start;                  // temperatures at reset, NAN for ambient
+    double ambient;
+
+    // links, kept as an edge list until the matrix is built
+    int nlinks, links_cap;
+    int* link_a;
+    int* link_b;
+    double* link_g;
+
+    int heater_node[TN_MAX_ZONES];
+    double power[TN_MAX_ZONES];
+    int sensor_node[TN_MAX_ZONES];
+
+    // C/dt + L in CSR form, the diagonal entry first in every row
+    int* row;
+    int* col;
+    double* val;
+    int* link_ka;                   // positions of each link's two entries
+    int* link_kb;
+    double dt;                      // step the values were computed for
+
+    // solver state
+    double* temp;
+    double* rhs;
+    double* r;
+    double* z;
+    double* p;
+    double* q;
+    uint64_t solves, iterations;
+};
+
+/////////////////////////////////////////////////////////////////////
+// Building
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Finds a node by name
+ *
+ * \returns The node's index, or -1 if there is no such node
+ */
+int thermal_net_find(const struct thermal_net* net, const char* name)
+{
+    int i;
+    for (i = 0; i < net->n; i++) {
+        if (strcmp(net->names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * \brief Adds a node
+ *
+ * \returns The node's index, or -1 if out of memory
+ */
+int thermal_net_add_node(struct thermal_net* net, const char* name,
+                         double cap, double temp)
+{
+    if (net->n == net->nodes_cap) {
+        int cap = net->nodes_cap ? net->nodes_cap * 2 : 64;
+        void* names = realloc(net->names, cap * sizeof(net->names[0]));
+        net->names = names != NULL ? names : net->names;
+        void* caps = realloc(net->cap, cap * sizeof(double));
+        net->cap = caps != NULL ? caps : net->cap;
+        void* loss = realloc(net->loss, cap * sizeof(double));
+        net->loss = loss != NULL ? loss : net->loss;
+        void* start = realloc(net->start, cap * sizeof(double));
+        net->start = start != NULL ? start : net->start;
+        if (names == NULL || caps == NULL || loss == NULL || start == NULL) {
+            return -1;
+        }
+        net->nodes_cap = cap;
+    }
+    snprintf(net->names[net->n], TN_NAME_MAX, "%s", name);
+    net->cap[net->n] = cap;
+    net->loss[net->n] = 0;
+    net->start[net->n] = temp;
+    return net->n++;
+}
+
+/**
+ * \brief Adds a conductance between two nodes
+ *
+ * \returns 0 on success, -1 if out of memory
+ */
+int thermal_net_add_link(struct thermal_net* net, int a, int b, double g)
+{
+    if (net->nlinks == net->links_cap) {
+        int cap = net->links_cap ? net->links_cap * 2 : 64;
+        void* la = realloc(net->link_a, cap * sizeof(int));
+        net->link_a = la != NULL ? la : net->link_a;
+        void* lb = realloc(net->link_b, cap * sizeof(int));
+        net->link_b = lb != NULL ? lb : net->link_b;
+        void* lg = realloc(net->link_g, cap * sizeof(double));
+        net->link_g = lg != NULL ? lg : net->link_g;
+        if (la == NULL || lb == NULL || lg == NULL) {
+            return -1;
+        }
+        net->links_cap = cap;
+    }
+    net->link_a[net->nlinks] = a;
+    net->link_b[net->nlinks] = b;
+    net->link_g[net->nlinks] = g;
+    net->nlinks++;
+    return 0;
+}
+
+/**
+ * \brief Lays out the sparse matrix and the solver vectors once every node
+ *        and link is known
+ *
+ * \returns 0 on success, -1 if out of memory
+ */
+int thermal_net_build(struct thermal_net* net)
+{
+    int n = net->n, i, k;
+    int* fill;
+    net->row = calloc(n + 1, sizeof(int));
+    net->col = malloc((n + 2 * net->nlinks) * sizeof(int));
+    net->val = malloc((n + 2 * net->nlinks) * sizeof(double));
+    net->temp = malloc(n * sizeof(double));
+    net->rhs = malloc(n * sizeof(double));
+    net->r = malloc(n * sizeof(double));
+    net->z = malloc(n * sizeof(double));
+    net->p = malloc(n * sizeof(double));
+    net->q = malloc(n * sizeof(double));
+    net->link_ka = malloc((net->nlinks + 1) * sizeof(int));
+    net->link_kb = malloc((net->nlinks + 1) * sizeof(int));
+    fill = malloc(n * sizeof(int));
+    if (net->row == NULL || net->col == NULL || net->val == NULL ||
+        net->link_ka == NULL || net->link_kb == NULL ||
+        net->temp == NULL || net->rhs == NULL || net->r == NULL ||
+        net->z == NULL || net->p == NULL || net->q == NULL || fill == NULL) {
+        free(fill);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        net->row[i + 1] = 1;
+    }
+    for (k = 0; k < net->nlinks; k++) {
+        net->row[net->link_a[k] + 1]++;
+        net->row[net->link_b[k] + 1]++;
+    }
+    for (i = 0; i < n; i++) {
+        net->row[i + 1] += net->row[i];
+        net->col[net->row[i]] = i;
+        fill[i] = net->row[i] + 1;
+    }
+    for (k = 0; k < net->nlinks; k++) {
+        int a = net->link_a[k], b = net->link_b[k];
+        net->link_ka[k] = fill[a];
+        net->col[fill[a]++] = b;
+        net->link_kb[k] = fill[b];
+        net->col[fill[b]++] = a;
+    }
+    free(fill);
+    net->dt = 0;
+    return 0;
+}
+
+/**
+ * \brief Fills in the matrix values for a step size
+ */
+void thermal_net_set_dt(struct thermal_net* net, double dt)
+{
+    int i, k;
+    for (i = 0; i < net->n; i++) {
+        net->val[net->row[i]] = net->cap[i] / dt + net->loss[i];
+    }
+    for (k = 0; k < net->nlinks; k++) {
+        double g = net->link_g[k];
+        net->val[net->row[net->link_a[k]]] += g;
+        net->val[net->row[net->link_b[k]]] += g;
+        net->val[net->link_ka[k]] = -g;
+        net->val[net->link_kb[k]] = -g;
+    }
+    net->dt = dt;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Solving
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief q = A x
+ */
+void thermal_net_multiply(const struct thermal_net* net, const double* x,
+                          double* q)
+{
+    int i, k;
+    for (i = 0; i < net->n; i++) {
+        double sum = 0;
+        for (k = net->row[i]; k < net->row[i + 1]; k++) {
+            sum += net->val[k] * x[net->col[k]];
+        }
+        q[i] = sum;
+    }
+}
+
+/**
+ * \brief Solves A temp = rhs by Jacobi preconditioned conjugate gradients,
+ *        starting from the current temperatures
+ *
+ * \returns The number of iterations taken
+ */
+int thermal_net_solve(struct thermal_net* net)
+{
+    int n = net->n, i, it;
+    double rz = 0, bnorm = 0, rnorm;
+
+    thermal_net_multiply(net, net->temp, net->q);
+    for (i = 0; i < n; i++) {
+        net->r[i] = net->rhs[i] - net->q[i];
+        net->z[i] = net->r[i] / net->val[net->row[i]];
+        net->p[i] = net->z[i];
+        rz += net->r[i] * net->z[i];
+        bnorm += net->rhs[i] * net->rhs[i];
+    }
+    for (it = 0; it < TN_MAX_ITERATIONS; it++) {
+        double pq = 0, alpha, beta, rz_next = 0;
+        rnorm = 0;
+        for (i = 0; i < n; i++) {
+            rnorm += net->r[i] * net->r[i];
+        }
+        if (rnorm <= TN_TOLERANCE * TN_TOLERANCE * bnorm) {
+            break;
+        }
+        thermal_net_multiply(net, net->p, net->q);
+        for (i = 0; i < n; i++) {
+            pq += net->p[i] * net->q[i];
+        }
+        alpha = rz / pq;
+        for (i = 0; i < n; i++) {
+            net->temp[i] += alpha * net->p[i];
+            net->r[i] -= alpha * net->q[i];
+            net->z[i] = net->r[i] / net->val[net->row[i]];
+            rz_next += net->r[i] * net->z[i];
+        }
+        beta = rz_next / rz;
+        rz = rz_next;
+        for (i = 0; i < n; i++) {
+            net->p[i] = net->z[i] + beta * net->p[i];
+        }
+    }
+    net->solves++;
+    net->iterations += it;
+    return it;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Plant interface
+/////////////////////////////////////////////////////////////////////
+
+void thermal_net_reset(struct plant* p, double temp)
+{
+    struct thermal_net* net = (struct thermal_net*)p;
+    int i;
+    for (i = 0; i < net->n; i++) {
+        net->temp[i] = !isnan(net->start[i]) ? net->start[i]
+                     : !isnan(temp) ? temp : net->ambient;
+    }
+}
+
+void thermal_net_step(struct plant* p, double dt, const uint8_t* heater)
+{
+    struct thermal_net* net = (struct thermal_net*)p;
+    int i, z;
+    if (dt != net->dt) {
+        thermal_net_set_dt(net, dt);
+    }
+    for (i = 0; i < net->n; i++) {
+        net->rhs[i] = net->cap[i] / dt * net->temp[i] +
+                      net->loss[i] * net->ambient;
+    }
+    for (z = 0; z < net->base.nzones; z++) {
+        if (heater[z] && net->heater_node[z] >= 0) {
+            net->rhs[net->heater_node[z]] += net->power[z];
+        }
+    }
+    thermal_net_solve(net);
+}
+
+double thermal_net_temp(const struct plant* p, int zone)
+{
+    const struct thermal_net* net = (const struct thermal_net*)p;
+    if (zone < 0 || zone >= net->base.nzones || net->sensor_node[zone] < 0) {
+        return net->ambient;
+    }
+    return net->temp[net->sensor_node[zone]];
+}
+
+void thermal_net_free(struct plant* p)
+{
+    struct thermal_net* net = (struct thermal_net*)p;
+    free(net->names);
+    free(net->cap);
+    free(net->loss);
+    free(net->start);
+    free(net->link_a);
+    free(net->link_b);
+    free(net->link_g);
+    free(net->row);
+    free(net->col);
+    free(net->val);
+    free(net->link_ka);
+    free(net->link_kb);
+    free(net->temp);
+    free(net->rhs);
+    free(net->r);
+    free(net->z);
+    free(net->p);
+    free(net->q);
+    free(net);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Loading
+/////////////////////////////////////////////////////////////////////
+
+struct thermal_net* thermal_net_alloc()
+{
+    struct thermal_net* net = calloc(1, sizeof(*net));
+    int z;
+    if (net == NULL) {
+        return NULL;
+    }
+    net->base.name = "thermal_net";
+    net->base.reset = thermal_net_reset;
+    net->base.step = thermal_net_step;
+    net->base.temp = thermal_net_temp;
+    net->base.free = thermal_net_free;
+    net->ambient = TN_GRID_AMBIENT;
+    for (z = 0; z < TN_MAX_ZONES; z++) {
+        net->heater_node[z] = -1;
+        net->sensor_node[z] = -1;
+    }
+    return net;
+}
+
+/**
+ * \brief Generates a W by H plate with 1, 2 or 4 heated zones
+ */
+struct thermal_net* thermal_net_grid(int w, int h, int zones)
+{
+    struct thermal_net* net = thermal_net_alloc();
+    char name[TN_NAME_MAX];
+    int x, y, z, ok = net != NULL;
+
+    for (y = 0; ok && y < h; y++) {
+        for (x = 0; ok && x < w; x++) {
+            int i;
+            snprintf(name, sizeof(name), "c%d_%d", x, y);
+            i = thermal_net_add_node(net, name, TN_GRID_CAP, NAN);
+            ok = i >= 0;
+            if (ok) {
+                net->loss[i] = TN_GRID_LOSS;
+            }
+            if (ok && x > 0) {
+                ok = thermal_net_add_link(net, i - 1, i, TN_GRID_LINK) == 0;
+            }
+            if (ok && y > 0) {
+                ok = thermal_net_add_link(net, i - w, i, TN_GRID_LINK) == 0;
+            }
+        }
+    }
+    if (!ok) {
+        if (net != NULL) {
+            thermal_net_free(&net->base);
+        }
+        return NULL;
+    }
+    // heaters in the middle of each half or quarter of the plate
+    for (z = 0; z < zones; z++) {
+        int cx = zones == 1 ? w / 2 : (2 * (z % 2) + 1) * w / 4;
+        int cy = zones < 4 ? h / 2 : (2 * (z / 2) + 1) * h / 4;
+        net->heater_node[z] = cy * w + cx;
+        net->sensor_node[z] = cy * w + (cx + 1 < w ? cx + 1 : cx);
+        net->power[z] = TN_GRID_POWER;
+    }
+    net->base.nzones = zones;
+    return net;
+}
+
+/**
+ * \brief Reads a network description file
+ *
+ * \returns The network, or NULL if it could not be read (an error is
+ *          printed)
+ */
+struct thermal_net* thermal_net_read(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    struct thermal_net* net;
+    char line[256];
+    int lineno = 0, z;
+
+    if (f == NULL) {
+        printf("can't open thermal network %s\n", path);
+        return NULL;
+    }
+    if ((net = thermal_net_alloc()) == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char what[16], a[TN_NAME_MAX], b[TN_NAME_MAX];
+        double x, y = NAN;
+        int n, zone, ia, ib, ok = 1;
+        lineno++;
+        if ((n = sscanf(line, "%15s", what)) < 1 || what[0] == '#') {
+            continue;
+        }
+        if (strcmp(what, "ambient") == 0) {
+            ok = sscanf(line, "%*s %lf", &net->ambient) == 1;
+        } else if (strcmp(what, "node") == 0) {
+            ok = sscanf(line, "%*s %31s %lf %lf", a, &x, &y) >= 2 && x > 0 &&
+                 thermal_net_find(net, a) < 0 &&
+                 thermal_net_add_node(net, a, x, y) >= 0;
+        } else if (strcmp(what, "link") == 0) {
+            ok = sscanf(line, "%*s %31s %31s %lf", a, b, &x) == 3 &&
+                 (ia = thermal_net_find(net, a)) >= 0 &&
+                 (ib = thermal_net_find(net, b)) >= 0 && ia != ib &&
+                 x > 0 && thermal_net_add_link(net, ia, ib, x) == 0;
+        } else if (strcmp(what, "loss") == 0) {
+            ok = sscanf(line, "%*s %31s %lf", a, &x) == 2 &&
+                 (ia = thermal_net_find(net, a)) >= 0 && x >= 0;
+            if (ok) {
+                net->loss[ia] += x;
+            }
+        } else if (strcmp(what, "heater") == 0) {
+            ok = sscanf(line, "%*s %d %31s %lf", &zone, a, &x) == 3 &&
+                 zone >= 0 && zone < TN_MAX_ZONES &&
+                 (ia = thermal_net_find(net, a)) >= 0;
+            if (ok) {
+                net->heater_node[zone] = ia;
+                net->power[zone] = x;
+            }
+        } else if (strcmp(what, "sensor") == 0) {
+            ok = sscanf(line, "%*s %d %31s", &zone, a) == 2 &&
+                 zone >= 0 && zone < TN_MAX_ZONES &&
+                 (ia = thermal_net_find(net, a)) >= 0;
+            if (ok) {
+                net->sensor_node[zone] = ia;
+            }
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            printf("%s:%d: can't use \"%.*s\"\n", path, lineno,
+                   (int)strcspn(line, "\n"), line);
+            fclose(f);
+            thermal_net_free(&net->base);
+            return NULL;
+        }
+    }
+    fclose(f);
+    for (z = 0; z < TN_MAX_ZONES; z++) {
+        if (net->heater_node[z] >= 0 || net->sensor_node[z] >= 0) {
+            net->base.nzones = z + 1;
+        }
+    }
+    if (net->n == 0 || net->base.nzones == 0) {
+        printf("%s: a network needs nodes and at least one zone\n", path);
+        thermal_net_free(&net->base);
+        return NULL;
+    }
+    return net;
+}
+
+/**
+ * \brief Loads a network from a file or a grid:WxH[:ZONES] description and
+ *        readies it for stepping
+ *
+ * \returns The network as a plant, or NULL on failure (an error is printed)
+ */
+struct plant* thermal_net_open(const char* spec)
+{
+    struct thermal_net* net;
+    int w, h, zones = 1;
+
+    if (strncmp(spec, "grid:", 5) == 0) {
+        if (sscanf(spec + 5, "%dx%d:%d", &w, &h, &zones) < 2 || w < 2 ||
+            h < 1 || (zones != 1 && zones != 2 && zones != 4)) {
+            printf("bad grid %s, expected grid:WxH[:1|2|4]\n", spec);
+            return NULL;
+        }
+        net = thermal_net_grid(w, h, zones);
+    } else {
+        net = thermal_net_read(spec);
+    }
+    if (net == NULL) {
+        return NULL;
+    }
+    if (thermal_net_build(net) < 0) {
+        printf("out of memory building %s\n", spec);
+        thermal_net_free(&net->base);
+        return NULL;
+    }
+    thermal_net_reset(&net->base, NAN);
+    return &net->base;
+}
+
+#endif
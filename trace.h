@@ -0,0 +1,191 @@
+/**
+ * \file trace.h
+ *
+ * \brief Optional timeline tracing. Each thread records complete (begin plus
+ *        duration) events into its own fixed size buffer, so recording needs
+ *        no locks and no system calls beyond reading the clock. At exit the
+ *        buffers are written out as a Chrome trace (JSON) that can be opened
+ *        in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Usage:
+ *     uint64_t t = trace_begin();
+ *     ...
+ *     trace_end("spi_transfer", t);
+ *
+ * \note While tracing is disabled trace_begin() returns 0 and trace_end()
+ *       returns straight away, so the calls can stay in the hot path.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define TRACE_MAX_THREADS         16
+#define TRACE_EVENTS_PER_THREAD   (1 << 18)   // 6MB per traced thread
+
+/////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////
+
+struct trace_event {
+    const char* name;           // must be a string literal
+    uint64_t begin_ns;
+    uint64_t dur_ns;
+};
+
+struct trace_buffer {
+    const char* thread_name;
+    uint32_t count;             // events recorded
+    uint32_t dropped;           // events lost because the buffer was full
+    struct trace_event* events;
+};
+
+int trace_enabled = 0;
+uint64_t trace_origin_ns = 0;  // when tracing started, timestamps count from it
+struct trace_buffer trace_buffers[TRACE_MAX_THREADS];
+unsigned trace_nbuffers = 0;
+__thread struct trace_buffer* trace_local = NULL;
+
+/////////////////////////////////////////////////////////////////////
+// Recording
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Returns the monotonic clock in nanoseconds
+ */
+uint64_t trace_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * \brief Turns tracing on. Must be called before any thread registers.
+ */
+void trace_start()
+{
+    trace_origin_ns = trace_now();
+    trace_enabled = 1;
+}
+
+/**
+ * \brief Gives the calling thread its own event buffer. Threads that never
+ *        call this are not traced.
+ *
+ * \param name   the thread name shown in the trace viewer
+ */
+void trace_thread(const char* name)
+{
+    unsigned slot;
+    if (!trace_enabled || trace_local != NULL) {
+        return;
+    }
+    slot = __atomic_fetch_add(&trace_nbuffers, 1, __ATOMIC_RELAXED);
+    if (slot >= TRACE_MAX_THREADS) {
+        return;
+    }
+    trace_buffers[slot].thread_name = name;
+    trace_buffers[slot].events = malloc(TRACE_EVENTS_PER_THREAD *
+                                        sizeof(struct trace_event));
+    if (trace_buffers[slot].events != NULL) {
+        trace_local = &trace_buffers[slot];
+    }
+}
+
+/**
+ * \brief Marks the start of a traced region
+ *
+ * \returns The start time to pass to trace_end(), 0 when not tracing
+ */
+uint64_t trace_begin()
+{
+    return trace_local != NULL ? trace_now() : 0;
+}
+
+/**
+ * \brief Records a region that started at begin and ends now
+ *
+ * \param name    the region name, must be a string literal
+ * \param begin   the value returned by trace_begin()
+ */
+void trace_end(const char* name, uint64_t begin)
+{
+    struct trace_buffer* b = trace_local;
+    struct trace_event* e;
+    if (begin == 0 || b == NULL) {
+        return;
+    }
+    if (b->count == TRACE_EVENTS_PER_THREAD) {
+        b->dropped++;
+        return;
+    }
+    e = &b->events[b->count];
+    e->name = name;
+    e->begin_ns = begin;
+    e->dur_ns = trace_now() - begin;
+    __atomic_store_n(&b->count, b->count + 1, __ATOMIC_RELEASE);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Output
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Writes every recorded event as a Chrome trace
+ *
+ * \param path   the JSON file to create
+ *
+ * \returns 0 on success, -1 if the file could not be written
+ *
+ * \note Call after the traced threads have stopped
+ */
+int trace_dump(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    unsigned nbuffers = trace_nbuffers < TRACE_MAX_THREADS ? trace_nbuffers
+                                                          : TRACE_MAX_THREADS;
+    uint64_t dropped = 0;
+    unsigned t, i;
+    const char* sep = "";
+
+    if (f == NULL) {
+        printf("can't write trace %s\n", path);
+        return -1;
+    }
+    // timestamps are written relative to trace_start() to keep them short.
+    // Events are recorded as they end, so a buffer's first event need not be
+    // its earliest one.
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (t = 0; t < nbuffers; t++) {
+        const struct trace_buffer* b = &trace_buffers[t];
+        if (b->events == NULL) {
+            continue;
+        }
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%u,\"args\":{\"name\":\"%s\"}}", sep, t + 1,
+                b->thread_name);
+        sep = ",\n";
+        for (i = 0; i < b->count; i++) {
+            const struct trace_event* e = &b->events[i];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                    "\"ts\":%.3f,\"dur\":%.3f}", e->name, t + 1,
+                    (e->begin_ns - trace_origin_ns) / 1e3, e->dur_ns / 1e3);
+        }
+        dropped += b->dropped;
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    printf("trace: wrote %s, %llu events dropped\n", path,
+           (unsigned long long)dropped);
+    return 0;
+}
+
+#endif
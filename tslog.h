@@ -0,0 +1,636 @@
+/**
+ * \file tslog.h
+ *
+ * \brief Compact columnar block format for the temperature sample stream.
+ *
+ * A segment file starts with a tslog_file_header and is followed by blocks.
+ * Each block holds up to TSLOG_BLOCK_SAMPLES samples of a single zone and is
+ * made of a tslog_block_header followed by four bit-packed columns:
+ *
+ *   timestamps    delta-of-delta, zigzag, variable length bit buckets
+ *   raw ADC       delta, zigzag, variable length bit buckets
+ *   temperature   XOR with the previous float, leading/trailing zero windows
+ *   heater        one bit per sample
+ *
+ * Each column is prefixed by its byte length as a LEB128 varint, so a
+ * decoder can find any column without decoding the ones before it. Next to
+ * every segment the logger writes a .idx file with one tslog_index_entry per
+ * block, which lets readers seek straight to the blocks covering a time range.
+ *
+ * \note Everything is stored in the byte order of the machine that wrote it
+ *       (little endian on both the Pi and x86 hosts).
+ */
+#ifndef TSLOG_H
+#define TSLOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/////////////////////////////////////////////////////////////////////
+// Constants
+/////////////////////////////////////////////////////////////////////
+
+#define TSLOG_FILE_MAGIC      0x314c5354    // "TSL1"
+#define TSLOG_BLOCK_MAGIC     0x31425354    // "TSB1"
+#define TSLOG_VERSION         1
+#define TSLOG_BLOCK_SAMPLES   1024
+
+// Worst case bytes per sample for each column, used to size the encoder
+#define TSLOG_TS_BYTES        9     // 4 bit prefix + 64 bit delta-of-delta
+#define TSLOG_RAW_BYTES       3     // 3 bit prefix + 16 bit delta
+#define TSLOG_TEMP_BYTES      6     // 2 bit prefix + 10 bit window + 32 bits
+
+// Largest possible encoded block including its header
+#define TSLOG_BLOCK_MAX  (sizeof(struct tslog_block_header) + 4 * 5 + \
+                          TSLOG_BLOCK_SAMPLES * (TSLOG_TS_BYTES + \
+                          TSLOG_RAW_BYTES + TSLOG_TEMP_BYTES + 1))
+
+/////////////////////////////////////////////////////////////////////
+// On-disk structures
+/////////////////////////////////////////////////////////////////////
+
+struct tslog_file_header {
+    uint32_t magic;             // TSLOG_FILE_MAGIC
+    uint16_t version;           // TSLOG_VERSION
+    uint16_t header_size;       // sizeof(struct tslog_file_header)
+    int64_t  epoch_offset_us;   // add to a timestamp to get Unix time in us
+    uint64_t reserved[2];
+};
+
+struct tslog_block_header {
+    uint32_t magic;             // TSLOG_BLOCK_MAGIC
+    uint16_t count;             // number of samples in the block
+    uint8_t  zone;              // zone every sample belongs to
+    uint8_t  flags;             // reserved, 0
+    uint64_t t_first;           // timestamp of the first sample
+    uint64_t t_last;            // timestamp of the last sample
+    uint32_t payload_len;       // bytes of column data after the header
+    uint32_t crc;               // CRC-32 of header (crc = 0) and payload
+};
+
+struct tslog_index_entry {
+    uint64_t t_first;           // copied from the block header
+    uint64_t t_last;
+    uint64_t offset;            // file offset of the block header
+    uint16_t count;
+    uint8_t  zone;
+    uint8_t  reserved[5];
+};
+
+/**
+ * \brief A decoded block, one array per column
+ */
+struct tslog_block {
+    uint16_t count;
+    uint8_t  zone;
+    uint64_t t[TSLOG_BLOCK_SAMPLES];
+    uint16_t raw[TSLOG_BLOCK_SAMPLES];
+    float    temp[TSLOG_BLOCK_SAMPLES];
+    uint8_t  heater[TSLOG_BLOCK_SAMPLES];
+};
+
+/////////////////////////////////////////////////////////////////////
+// Checksums and varints
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Updates a CRC-32 (IEEE 802.3, same as zlib) a nibble at a time
+ *
+ * \param crc    the running crc, start with 0
+ * \param data   the bytes to add
+ * \param len    the number of bytes to add
+ */
+uint32_t tslog_crc32(uint32_t crc, const void* data, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    const uint8_t* p = data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        crc = table[crc & 15] ^ (crc >> 4);
+        crc = table[crc & 15] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+/**
+ * \brief Computes the checksum stored in a block header
+ */
+uint32_t tslog_block_crc(const struct tslog_block_header* h,
+                         const uint8_t* payload)
+{
+    struct tslog_block_header copy = *h;
+    copy.crc = 0;
+    return tslog_crc32(tslog_crc32(0, &copy, sizeof(copy)),
+                       payload, h->payload_len);
+}
+
+/**
+ * \brief Writes an unsigned LEB128 varint
+ *
+ * \returns The number of bytes written (at most 5)
+ */
+size_t tslog_put_varint(uint8_t* out, uint32_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+
+/**
+ * \brief Reads an unsigned LEB128 varint
+ *
+ * \returns The number of bytes read, or 0 if the varint runs past end
+ */
+size_t tslog_get_varint(const uint8_t* in, const uint8_t* end, uint32_t* v)
+{
+    size_t n = 0;
+    unsigned shift = 0;
+    *v = 0;
+    while (in + n < end && shift < 35) {
+        uint8_t b = in[n++];
+        *v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return n;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Bit streams
+/////////////////////////////////////////////////////////////////////
+
+struct tslog_bitwriter {
+    uint8_t* buf;
+    size_t len;         // whole bytes written to buf
+    uint64_t acc;       // bits not yet written, right aligned
+    unsigned nbits;     // number of valid bits in acc (always < 8 on return)
+};
+
+/**
+ * \brief Appends the low n bits of v, most significant bit first
+ *
+ * \note n must be at most 56
+ */
+void tslog_put_bits(struct tslog_bitwriter* w, uint64_t v, unsigned n)
+{
+    w->acc = (w->acc << n) | (v & ((1ULL << n) - 1));
+    w->nbits += n;
+    while (w->nbits >= 8) {
+        w->nbits -= 8;
+        w->buf[w->len++] = w->acc >> w->nbits;
+    }
+}
+
+/**
+ * \brief Pads the stream with zero bits up to a byte boundary
+ */
+void tslog_flush_bits(struct tslog_bitwriter* w)
+{
+    if (w->nbits > 0) {
+        tslog_put_bits(w, 0, 8 - w->nbits);
+    }
+    w->acc = 0;
+}
+
+struct tslog_bitreader {
+    const uint8_t* buf;
+    const uint8_t* end;
+    uint64_t acc;
+    unsigned nbits;
+    int overrun;        // set once a read went past the end of the column
+};
+
+/**
+ * \brief Reads the next n bits (n at most 56), most significant bit first
+ */
+uint64_t tslog_get_bits(struct tslog_bitreader* r, unsigned n)
+{
+    while (r->nbits < n) {
+        if (r->buf < r->end) {
+            r->acc = (r->acc << 8) | *r->buf++;
+        } else {
+            r->acc <<= 8;
+            r->overrun = 1;
+        }
+        r->nbits += 8;
+    }
+    r->nbits -= n;
+    return (r->acc >> r->nbits) & ((1ULL << n) - 1);
+}
+
+/**
+ * \brief Reads a unary prefix of up to max one bits terminated by a zero
+ *
+ * \returns The number of one bits read
+ */
+unsigned tslog_get_prefix(struct tslog_bitreader* r, unsigned max)
+{
+    unsigned n = 0;
+    while (n < max && tslog_get_bits(r, 1)) {
+        n++;
+    }
+    return n;
+}
+
+uint64_t tslog_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+int64_t tslog_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Streaming encoder
+/////////////////////////////////////////////////////////////////////
+
+struct tslog_encoder {
+    uint8_t zone;
+    uint16_t count;
+    uint64_t t_first;
+    uint64_t t_prev;
+    int64_t delta_prev;
+    uint16_t raw_prev;
+    uint32_t temp_prev;
+    unsigned lead_prev;             // 32 means no window yet
+    unsigned trail_prev;
+    struct tslog_bitwriter ts, raw, temp, heater;
+    uint8_t ts_buf[TSLOG_BLOCK_SAMPLES * TSLOG_TS_BYTES];
+    uint8_t raw_buf[TSLOG_BLOCK_SAMPLES * TSLOG_RAW_BYTES];
+    uint8_t temp_buf[TSLOG_BLOCK_SAMPLES * TSLOG_TEMP_BYTES];
+    uint8_t heater_buf[TSLOG_BLOCK_SAMPLES / 8 + 1];
+};
+
+/**
+ * \brief Resets an encoder so the next sample starts a new block
+ */
+void tslog_encoder_reset(struct tslog_encoder* e)
+{
+    e->count = 0;
+    e->delta_prev = 0;
+    e->raw_prev = 0;
+    e->temp_prev = 0;
+    e->lead_prev = 32;
+    e->trail_prev = 0;
+    memset(&e->ts, 0, sizeof(e->ts));
+    memset(&e->raw, 0, sizeof(e->raw));
+    memset(&e->temp, 0, sizeof(e->temp));
+    memset(&e->heater, 0, sizeof(e->heater));
+    e->ts.buf = e->ts_buf;
+    e->raw.buf = e->raw_buf;
+    e->temp.buf = e->temp_buf;
+    e->heater.buf = e->heater_buf;
+}
+
+/**
+ * \brief Prepares an encoder for the samples of one zone
+ */
+void tslog_encoder_init(struct tslog_encoder* e, uint8_t zone)
+{
+    e->zone = zone;
+    tslog_encoder_reset(e);
+}
+
+/**
+ * \brief Appends one sample to the block being built
+ *
+ * \returns 1 once the block is full and must be finished, 0 otherwise
+ */
+int tslog_encoder_add(struct tslog_encoder* e, uint64_t t_us, uint16_t raw,
+                      float temp, int heater)
+{
+    uint32_t bits, x;
+    uint64_t z;
+
+    // timestamps: the first one lives in the header, the rest are stored as
+    // the change in the sampling interval, which is 0 for a steady loop
+    if (e->count == 0) {
+        e->t_first = t_us;
+    } else {
+        int64_t delta = (int64_t)(t_us - e->t_prev);
+        z = tslog_zigzag(delta - e->delta_prev);
+        e->delta_prev = delta;
+        if (z == 0) {
+            tslog_put_bits(&e->ts, 0, 1);
+        } else if (z < (1 << 3)) {
+            tslog_put_bits(&e->ts, 0x2, 2);
+            tslog_put_bits(&e->ts, z, 3);
+        } else if (z < (1 << 7)) {
+            tslog_put_bits(&e->ts, 0x6, 3);
+            tslog_put_bits(&e->ts, z, 7);
+        } else if (z < (1 << 12)) {
+            tslog_put_bits(&e->ts, 0xe, 4);
+            tslog_put_bits(&e->ts, z, 12);
+        } else {
+            tslog_put_bits(&e->ts, 0xf, 4);
+            tslog_put_bits(&e->ts, z >> 32, 32);
+            tslog_put_bits(&e->ts, z, 32);
+        }
+    }
+    e->t_prev = t_us;
+
+    // raw ADC readings: zigzag of the change since the last reading
+    z = tslog_zigzag((int64_t)raw - e->raw_prev);
+    e->raw_prev = raw;
+    if (z == 0) {
+        tslog_put_bits(&e->raw, 0, 1);
+    } else if (z < (1 << 3)) {
+        tslog_put_bits(&e->raw, 0x2, 2);
+        tslog_put_bits(&e->raw, z, 3);
+    } else if (z < (1 << 6)) {
+        tslog_put_bits(&e->raw, 0x6, 3);
+        tslog_put_bits(&e->raw, z, 6);
+    } else {
+        tslog_put_bits(&e->raw, 0x7, 3);
+        tslog_put_bits(&e->raw, z, 16);
+    }
+
+    // temperatures: XOR with the previous float, storing only the bits
+    // between the leading and trailing zeros of the result
+    memcpy(&bits, &temp, sizeof(bits));
+    x = bits ^ e->temp_prev;
+    e->temp_prev = bits;
+    if (x == 0) {
+        tslog_put_bits(&e->temp, 0, 1);
+    } else {
+        unsigned lead = __builtin_clz(x);
+        unsigned trail = __builtin_ctz(x);
+        if (lead >= e->lead_prev && trail >= e->trail_prev) {
+            // fits in the previous window
+            tslog_put_bits(&e->temp, 0x2, 2);
+            tslog_put_bits(&e->temp, x >> e->trail_prev,
+                           32 - e->lead_prev - e->trail_prev);
+        } else {
+            unsigned len = 32 - lead - trail;
+            tslog_put_bits(&e->temp, 0x3, 2);
+            tslog_put_bits(&e->temp, lead, 5);
+            tslog_put_bits(&e->temp, len - 1, 5);
+            tslog_put_bits(&e->temp, x >> trail, len);
+            e->lead_prev = lead;
+            e->trail_prev = trail;
+        }
+    }
+
+    tslog_put_bits(&e->heater, heater ? 1 : 0, 1);
+    return ++e->count >= TSLOG_BLOCK_SAMPLES;
+}
+
+/**
+ * \brief Closes the block being built, writes it (header and payload) to out
+ *        and resets the encoder
+ *
+ * \param e     the encoder to finish
+ * \param out   buffer with room for TSLOG_BLOCK_MAX bytes
+ *
+ * \returns The number of bytes written, 0 if the encoder was empty
+ */
+size_t tslog_encoder_finish(struct tslog_encoder* e, uint8_t* out)
+{
+    struct tslog_block_header h;
+    uint8_t* payload = out + sizeof(h);
+    uint8_t* p = payload;
+    const struct tslog_bitwriter* cols[3];
+    int i;
+
+    if (e->count == 0) {
+        return 0;
+    }
+    tslog_flush_bits(&e->ts);
+    tslog_flush_bits(&e->raw);
+    tslog_flush_bits(&e->temp);
+    tslog_flush_bits(&e->heater);
+
+    cols[0] = &e->ts;
+    cols[1] = &e->raw;
+    cols[2] = &e->temp;
+    for (i = 0; i < 3; i++) {
+        p += tslog_put_varint(p, cols[i]->len);
+        memcpy(p, cols[i]->buf, cols[i]->len);
+        p += cols[i]->len;
+    }
+    // the heater column length follows from the sample count
+    memcpy(p, e->heater.buf, e->heater.len);
+    p += e->heater.len;
+
+    h.magic = TSLOG_BLOCK_MAGIC;
+    h.count = e->count;
+    h.zone = e->zone;
+    h.flags = 0;
+    h.t_first = e->t_first;
+    h.t_last = e->t_prev;
+    h.payload_len = p - payload;
+    h.crc = tslog_block_crc(&h, payload);
+    memcpy(out, &h, sizeof(h));
+
+    tslog_encoder_reset(e);
+    return sizeof(h) + h.payload_len;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Block decoder
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Checks that a block header is plausible and its checksum matches
+ *
+ * \returns 1 if the block is intact, 0 otherwise
+ */
+int tslog_block_valid(const struct tslog_block_header* h,
+                      const uint8_t* payload)
+{
+    return h->magic == TSLOG_BLOCK_MAGIC && h->count > 0 &&
+           h->count <= TSLOG_BLOCK_SAMPLES &&
+           h->payload_len <= TSLOG_BLOCK_MAX &&
+           tslog_block_crc(h, payload) == h->crc;
+}
+
+/**
+ * \brief Decodes every column of a block
+ *
+ * \param h         the block header
+ * \param payload   the h->payload_len bytes following the header
+ * \param out       receives the decoded samples
+ *
+ * \returns 0 on success, -1 if the payload is malformed
+ *
+ * \note The checksum is not verified here, see tslog_block_valid()
+ */
+int tslog_decode_block(const struct tslog_block_header* h,
+                       const uint8_t* payload, struct tslog_block* out)
+{
+    const uint8_t* end = payload + h->payload_len;
+    const uint8_t* p = payload;
+    struct tslog_bitreader cols[4];
+    uint32_t len;
+    size_t n;
+    unsigned i, lead = 0, trail = 0;
+    int64_t delta = 0;
+    uint64_t t = h->t_first;
+    uint32_t raw = 0, temp = 0;
+
+    if (h->count == 0 || h->count > TSLOG_BLOCK_SAMPLES) {
+        return -1;
+    }
+    memset(cols, 0, sizeof(cols));
+    for (i = 0; i < 4; i++) {
+        if (i < 3) {
+            if ((n = tslog_get_varint(p, end, &len)) == 0) {
+                return -1;
+            }
+            p += n;
+        } else {
+            len = (h->count + 7) / 8;
+        }
+        if (len > (size_t)(end - p)) {
+            return -1;
+        }
+        cols[i].buf = p;
+        cols[i].end = p + len;
+        p += len;
+    }
+
+    out->count = h->count;
+    out->zone = h->zone;
+    for (i = 0; i < h->count; i++) {
+        if (i > 0) {
+            unsigned prefix = tslog_get_prefix(&cols[0], 4);
+            static const unsigned width[] = { 0, 3, 7, 12 };
+            uint64_t z = 0;
+            if (prefix == 4) {
+                z = tslog_get_bits(&cols[0], 32) << 32;
+                z |= tslog_get_bits(&cols[0], 32);
+            } else if (prefix > 0) {
+                z = tslog_get_bits(&cols[0], width[prefix]);
+            }
+            delta += tslog_unzigzag(z);
+            t += delta;
+        }
+        out->t[i] = t;
+    }
+
+    for (i = 0; i < h->count; i++) {
+        unsigned prefix = tslog_get_prefix(&cols[1], 3);
+        static const unsigned width[] = { 0, 3, 6, 16 };
+        if (prefix > 0) {
+            raw += tslog_unzigzag(tslog_get_bits(&cols[1], width[prefix]));
+        }
+        out->raw[i] = raw;
+    }
+
+    for (i = 0; i < h->count; i++) {
+        if (tslog_get_bits(&cols[2], 1)) {
+            if (tslog_get_bits(&cols[2], 1)) {
+                lead = tslog_get_bits(&cols[2], 5);
+                trail = 32 - lead - (tslog_get_bits(&cols[2], 5) + 1);
+                if (lead + trail > 31) {
+                    return -1;
+                }
+            }
+            temp ^= (uint32_t)tslog_get_bits(&cols[2], 32 - lead - trail)
+                    << trail;
+        }
+        memcpy(&out->temp[i], &temp, sizeof(temp));
+    }
+
+    for (i = 0; i < h->count; i++) {
+        out->heater[i] = cols[3].buf[i >> 3] >> (7 - (i & 7)) & 1;
+    }
+
+    return cols[0].overrun || cols[1].overrun || cols[2].overrun ? -1 : 0;
+}
+
+/**
+ * \brief Reads the block header and payload stored at an offset of a segment
+ *
+ * \param fd        the segment file
+ * \param offset    the offset of the block header
+ * \param h         receives the block header
+ * \param payload   buffer with room for TSLOG_BLOCK_MAX bytes
+ *
+ * \returns 0 if a valid block was read, -1 if it is truncated or corrupt
+ */
+int tslog_read_block(int fd, uint64_t offset, struct tslog_block_header* h,
+                     uint8_t* payload)
+{
+    if (pread(fd, h, sizeof(*h), offset) != (ssize_t)sizeof(*h) ||
+        h->magic != TSLOG_BLOCK_MAGIC || h->payload_len > TSLOG_BLOCK_MAX ||
+        pread(fd, payload, h->payload_len, offset + sizeof(*h)) !=
+            (ssize_t)h->payload_len ||
+        !tslog_block_valid(h, payload)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Cuts a segment back to its last intact block and rebuilds its index
+ *        to match. Used after a crash, when the tail of the file may hold a
+ *        partially written block and the index may be behind or ahead.
+ *
+ * \param fd        the segment file, opened read/write
+ * \param idx_fd    the index file, opened read/write
+ *
+ * \returns The number of bytes cut from the segment, or -1 if the file
+ *          header itself is missing or damaged
+ */
+int64_t tslog_recover(int fd, int idx_fd)
+{
+    static uint8_t payload[TSLOG_BLOCK_MAX];
+    struct tslog_index_entry entries[64];
+    struct tslog_file_header fh;
+    struct tslog_block_header h;
+    struct stat st;
+    uint64_t off;
+    unsigned n = 0;
+
+    if (fstat(fd, &st) < 0 ||
+        pread(fd, &fh, sizeof(fh), 0) != (ssize_t)sizeof(fh) ||
+        fh.magic != TSLOG_FILE_MAGIC || fh.header_size < sizeof(fh)) {
+        return -1;
+    }
+    if (ftruncate(idx_fd, 0) < 0 || lseek(idx_fd, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+    for (off = fh.header_size;
+         tslog_read_block(fd, off, &h, payload) == 0;
+         off += sizeof(h) + h.payload_len) {
+        memset(&entries[n], 0, sizeof(entries[n]));
+        entries[n].t_first = h.t_first;
+        entries[n].t_last = h.t_last;
+        entries[n].offset = off;
+        entries[n].count = h.count;
+        entries[n].zone = h.zone;
+        if (++n == sizeof(entries) / sizeof(entries[0])) {
+            if (write(idx_fd, entries, sizeof(entries)) != sizeof(entries)) {
+                return -1;
+            }
+            n = 0;
+        }
+    }
+    if (n > 0 && write(idx_fd, entries, n * sizeof(entries[0])) !=
+                     (ssize_t)(n * sizeof(entries[0]))) {
+        return -1;
+    }
+    if ((uint64_t)st.st_size > off && ftruncate(fd, off) < 0) {
+        return -1;
+    }
+    return (uint64_t)st.st_size > off ? (int64_t)(st.st_size - off) : 0;
+}
+
+#endif
@@ -0,0 +1,600 @@
+/*  \file tsquery.c
+ *
+ *  \brief Command line tool for querying the block format sample logs written
+ *         by temp_control, either as raw samples or downsampled into
+ *         min/max/mean buckets.
+ *
+ *  The duty cycle of a bucket weighs every sample by the time until the next
+ *  one, so it is the fraction of time the heater was on even if the tick rate
+ *  varied, and -w turns it into the energy the heater used.
+ *
+ *  \note The .idx file of each segment is used to skip segments and blocks
+ *        outside of the requested range, the remaining blocks are decoded in
+ *        parallel in fixed size batches and merged in order, so memory use
+ *        does not depend on how much data the query covers.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "tslog.h"
+
+#define BATCH_BLOCKS     64     // blocks decoded per parallel batch
+#define MAX_THREADS      BATCH_BLOCKS
+#define INDEX_CHUNK      4096   // index entries read per pread
+#define BOUND_ENTRIES    256    // entries examined for a segment's time span
+
+/**
+ * \brief Partial aggregate of one output bucket
+ */
+struct bucket {
+    int64_t index;              // bucket number since the start time
+    uint32_t count;
+    uint32_t heater_on;
+    uint64_t on_us;             // time the heater was on
+    uint64_t span_us;           // time covered by the samples
+    float min, max;
+    double sum;
+};
+
+/**
+ * \brief A block to decode and what decoding it produced
+ */
+struct job {
+    int fd;
+    int64_t epoch_offset_us;
+    struct tslog_index_entry entry;
+    int ok;
+    struct tslog_block block;
+    unsigned first, last;       // samples of the block inside the range
+    unsigned nbuckets;
+    struct bucket buckets[TSLOG_BLOCK_SAMPLES];
+};
+
+struct query {
+    const char* dir;
+    int zone;
+    int64_t start_us, end_us;   // Unix time range, end exclusive
+    int64_t bucket_us;          // 0 for raw samples
+    double watts;               // heater load, 0 for no energy column
+    int threads;
+
+    // current batch, shared with the workers
+    struct job* jobs;
+    unsigned njobs;
+    unsigned next_job;
+    pthread_barrier_t start, done;
+    int quit;
+
+    // merge state
+    struct bucket open;
+    uint64_t corrupt;
+    uint64_t samples;
+};
+
+/**
+ * \brief Parses a time given as @seconds, YYYY-MM-DD[ HH:MM[:SS]] or
+ *        HH:MM[:SS] (today) into Unix microseconds
+ *
+ * \returns 0 on success, -1 if the time could not be parsed
+ */
+int parse_time(const char* s, int64_t* us)
+{
+    static const char* date_formats[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M",
+        "%Y-%m-%dT%H:%M", "%Y-%m-%d", NULL
+    };
+    static const char* time_formats[] = { "%H:%M:%S", "%H:%M", NULL };
+    struct tm tm;
+    time_t now;
+    const char* end;
+    int i;
+
+    if (s[0] == '@') {
+        char* e;
+        double secs = strtod(s + 1, &e);
+        *us = (int64_t)(secs * 1e6);
+        return *e == '\0' ? 0 : -1;
+    }
+    for (i = 0; date_formats[i] != NULL; i++) {
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(s, date_formats[i], &tm);
+        if (end != NULL && *end == '\0') {
+            tm.tm_isdst = -1;
+            *us = (int64_t)mktime(&tm) * 1000000;
+            return 0;
+        }
+    }
+    for (i = 0; time_formats[i] != NULL; i++) {
+        time(&now);
+        localtime_r(&now, &tm);
+        tm.tm_sec = 0;
+        end = strptime(s, time_formats[i], &tm);
+        if (end != NULL && *end == '\0') {
+            tm.tm_isdst = -1;
+            *us = (int64_t)mktime(&tm) * 1000000;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * \brief Parses a duration like 250ms, 10s, 5m or 1h (plain numbers are
+ *        seconds) into microseconds
+ *
+ * \returns 0 on success, -1 if the duration could not be parsed
+ */
+int parse_duration(const char* s, int64_t* us)
+{
+    char* unit;
+    double v = strtod(s, &unit);
+    double scale;
+    if (strcmp(unit, "us") == 0) {
+        scale = 1;
+    } else if (strcmp(unit, "ms") == 0) {
+        scale = 1e3;
+    } else if (strcmp(unit, "") == 0 || strcmp(unit, "s") == 0) {
+        scale = 1e6;
+    } else if (strcmp(unit, "m") == 0) {
+        scale = 60e6;
+    } else if (strcmp(unit, "h") == 0) {
+        scale = 3600e6;
+    } else if (strcmp(unit, "d") == 0) {
+        scale = 86400e6;
+    } else {
+        return -1;
+    }
+    *us = (int64_t)(v * scale);
+    return *us > 0 ? 0 : -1;
+}
+
+/**
+ * \brief Prints Unix microseconds as seconds with a fractional part
+ */
+void print_time(int64_t us)
+{
+    printf("%lld.%06lld", (long long)(us / 1000000), (long long)(us % 1000000));
+}
+
+/////////////////////////////////////////////////////////////////////
+// Decoding
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Decodes one block and reduces it to the samples (or partial
+ *        buckets) that fall inside the query range
+ */
+void run_job(const struct query* q, struct job* j)
+{
+    static __thread uint8_t payload[TSLOG_BLOCK_MAX];
+    struct tslog_block_header h;
+    int64_t start = q->start_us - j->epoch_offset_us;
+    int64_t end = q->end_us - j->epoch_offset_us;
+    unsigned i;
+
+    j->ok = 0;
+    j->nbuckets = 0;
+    if (tslog_read_block(j->fd, j->entry.offset, &h, payload) < 0 ||
+        tslog_decode_block(&h, payload, &j->block) < 0) {
+        return;
+    }
+    j->ok = 1;
+
+    // the samples are in time order, so the range is a contiguous slice
+    for (i = 0; i < j->block.count && (int64_t)j->block.t[i] < start; i++);
+    j->first = i;
+    for (; i < j->block.count && (int64_t)j->block.t[i] < end; i++);
+    j->last = i;
+
+    if (q->bucket_us == 0) {
+        return;
+    }
+    for (i = j->first; i < j->last; i++) {
+        int64_t index = ((int64_t)j->block.t[i] - start) / q->bucket_us;
+        float temp = j->block.temp[i];
+        const uint64_t* t = j->block.t;
+        // the last sample of a block is held for as long as the one before
+        uint64_t hold = i + 1 < j->block.count ? t[i + 1] - t[i]
+                        : i > 0 ? t[i] - t[i - 1] : 0;
+        struct bucket* b = j->nbuckets > 0 ? &j->buckets[j->nbuckets - 1]
+                                           : NULL;
+        if (b == NULL || b->index != index) {
+            b = &j->buckets[j->nbuckets++];
+            b->index = index;
+            b->count = 0;
+            b->heater_on = 0;
+            b->on_us = b->span_us = 0;
+            b->min = b->max = temp;
+            b->sum = 0;
+        }
+        b->count++;
+        b->heater_on += j->block.heater[i];
+        b->on_us += j->block.heater[i] ? hold : 0;
+        b->span_us += hold;
+        b->sum += temp;
+        b->min = temp < b->min ? temp : b->min;
+        b->max = temp > b->max ? temp : b->max;
+    }
+}
+
+/**
+ * \brief Takes jobs from the current batch until none are left
+ */
+void run_jobs(struct query* q)
+{
+    unsigned n;
+    while ((n = __atomic_fetch_add(&q->next_job, 1, __ATOMIC_RELAXED)) <
+           q->njobs) {
+        run_job(q, &q->jobs[n]);
+    }
+}
+
+/**
+ * \brief Body of the worker threads, which help with every batch until the
+ *        query is finished
+ */
+void* worker(void* arg)
+{
+    struct query* q = arg;
+    for (;;) {
+        pthread_barrier_wait(&q->start);
+        if (q->quit) {
+            return NULL;
+        }
+        run_jobs(q);
+        pthread_barrier_wait(&q->done);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Merging and output
+/////////////////////////////////////////////////////////////////////
+
+void print_bucket(const struct query* q, const struct bucket* b)
+{
+    print_time(q->start_us + b->index * q->bucket_us);
+    printf(",%u,%.3f,%.3f,%.3f,%.3f", b->count, b->min, b->max,
+           b->sum / b->count, b->span_us > 0 ? (double)b->on_us / b->span_us
+                                             : (double)b->heater_on / b->count);
+    if (q->watts > 0) {
+        printf(",%.3f", b->on_us * 1e-6 * q->watts);
+    }
+    printf("\n");
+}
+
+/**
+ * \brief Merges the results of a finished batch, in index order, into the
+ *        output stream
+ */
+void merge_batch(struct query* q)
+{
+    unsigned n, i;
+    for (n = 0; n < q->njobs; n++) {
+        struct job* j = &q->jobs[n];
+        if (!j->ok) {
+            q->corrupt++;
+            continue;
+        }
+        q->samples += j->last - j->first;
+        if (q->bucket_us == 0) {
+            for (i = j->first; i < j->last; i++) {
+                print_time(j->block.t[i] + j->epoch_offset_us);
+                printf(",%u,%.3f,%u,%u\n", j->block.zone, j->block.temp[i],
+                       j->block.raw[i], j->block.heater[i]);
+            }
+            continue;
+        }
+        for (i = 0; i < j->nbuckets; i++) {
+            struct bucket* b = &j->buckets[i];
+            struct bucket* o = &q->open;
+            if (o->count > 0 && o->index == b->index) {
+                o->count += b->count;
+                o->heater_on += b->heater_on;
+                o->on_us += b->on_us;
+                o->span_us += b->span_us;
+                o->sum += b->sum;
+                o->min = b->min < o->min ? b->min : o->min;
+                o->max = b->max > o->max ? b->max : o->max;
+            } else {
+                if (o->count > 0) {
+                    print_bucket(q, o);
+                }
+                *o = *b;
+            }
+        }
+    }
+}
+
+/**
+ * \brief Decodes the queued batch on every thread and merges the results
+ */
+void run_batch(struct query* q)
+{
+    if (q->njobs == 0) {
+        return;
+    }
+    q->next_job = 0;
+    if (q->threads > 1) {
+        pthread_barrier_wait(&q->start);
+        run_jobs(q);
+        pthread_barrier_wait(&q->done);
+    } else {
+        run_jobs(q);
+    }
+    merge_batch(q);
+    q->njobs = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Segment scanning
+/////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Works out the time span of a segment from the first and last
+ *        entries of its index
+ *
+ * \note Blocks of different zones are finished in a slightly different order
+ *       than they start, so a few entries at each end are examined
+ */
+void segment_span(int idx_fd, size_t nentries, int64_t* first, int64_t* last)
+{
+    static struct tslog_index_entry e[BOUND_ENTRIES];
+    size_t n = nentries < BOUND_ENTRIES ? nentries : BOUND_ENTRIES;
+    size_t i;
+    *first = INT64_MAX;
+    *last = INT64_MIN;
+    if (pread(idx_fd, e, n * sizeof(e[0]), 0) == (ssize_t)(n * sizeof(e[0]))) {
+        for (i = 0; i < n; i++) {
+            *first = (int64_t)e[i].t_first < *first ? (int64_t)e[i].t_first
+                                                    : *first;
+        }
+    }
+    if (pread(idx_fd, e, n * sizeof(e[0]),
+              (nentries - n) * sizeof(e[0])) == (ssize_t)(n * sizeof(e[0]))) {
+        for (i = 0; i < n; i++) {
+            *last = (int64_t)e[i].t_last > *last ? (int64_t)e[i].t_last : *last;
+        }
+    }
+}
+
+/**
+ * \brief Queues every block of a segment that overlaps the query, running a
+ *        batch each time the queue fills
+ */
+void scan_segment(struct query* q, const char* base)
+{
+    static struct tslog_index_entry entries[INDEX_CHUNK];
+    char path[512];
+    struct tslog_file_header fh;
+    struct stat st;
+    int fd, idx_fd;
+    size_t nentries, off;
+    int64_t first, last, start, end;
+
+    snprintf(path, sizeof(path), "%s/%s.tsb", q->dir, base);
+    fd = open(path, O_RDONLY);
+    snprintf(path, sizeof(path), "%s/%s.idx", q->dir, base);
+    idx_fd = open(path, O_RDONLY);
+    if (fd < 0 || idx_fd < 0 || fstat(idx_fd, &st) < 0 ||
+        pread(fd, &fh, sizeof(fh), 0) != sizeof(fh) ||
+        fh.magic != TSLOG_FILE_MAGIC) {
+        fprintf(stderr, "skipping unreadable segment %s\n", base);
+        goto out;
+    }
+
+    nentries = st.st_size / sizeof(struct tslog_index_entry);
+    start = q->start_us - fh.epoch_offset_us;
+    end = q->end_us - fh.epoch_offset_us;
+    segment_span(idx_fd, nentries, &first, &last);
+    if (nentries == 0 || last < start || first >= end) {
+        goto out;
+    }
+
+    for (off = 0; off < nentries; off += INDEX_CHUNK) {
+        size_t n = nentries - off < INDEX_CHUNK ? nentries - off : INDEX_CHUNK;
+        size_t i;
+        if (pread(idx_fd, entries, n * sizeof(entries[0]),
+                  off * sizeof(entries[0])) != (ssize_t)(n * sizeof(entries[0]))) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            struct tslog_index_entry* e = &entries[i];
+            if (e->zone != q->zone || (int64_t)e->t_last < start ||
+                (int64_t)e->t_first >= end) {
+                continue;
+            }
+            q->jobs[q->njobs].fd = fd;
+            q->jobs[q->njobs].epoch_offset_us = fh.epoch_offset_us;
+            q->jobs[q->njobs].entry = *e;
+            if (++q->njobs == BATCH_BLOCKS) {
+                run_batch(q);
+            }
+        }
+    }
+    // the jobs refer to this segment's file, so finish them before closing
+    run_batch(q);
+
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (idx_fd >= 0) {
+        close(idx_fd);
+    }
+}
+
+int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * \brief Lists the block segments in the log directory in write order
+ *
+ * \param dir     the log directory
+ * \param names   receives the segment names (without extension)
+ * \param count   receives the number of segments found
+ *
+ * \returns 0 on success, -1 if memory ran out while listing
+ */
+int list_segments(const char* dir, char*** names, size_t* count)
+{
+    DIR* d = opendir(dir);
+    struct dirent* ent;
+    size_t n = 0, cap = 0;
+    *names = NULL;
+    *count = 0;
+    if (d == NULL) {
+        return 0;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        char* name;
+        if (len < 5 || strcmp(ent->d_name + len - 4, ".tsb") != 0) {
+            continue;
+        }
+        if (n == cap) {
+            char** grown;
+            cap = cap ? cap * 2 : 64;
+            if ((grown = realloc(*names, cap * sizeof(char*))) == NULL) {
+                break;
+            }
+            *names = grown;
+        }
+        if ((name = strdup(ent->d_name)) == NULL) {
+            break;
+        }
+        name[len - 4] = '\0';
+        (*names)[n++] = name;
+    }
+    closedir(d);
+    if (ent != NULL) {
+        printf("out of memory listing %s\n", dir);
+        while (n > 0) {
+            free((*names)[--n]);
+        }
+        free(*names);
+        *names = NULL;
+        return -1;
+    }
+    // segment numbers are zero padded, so name order is write order
+    qsort(*names, n, sizeof(char*), compare_names);
+    *count = n;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static struct job jobs[BATCH_BLOCKS];
+    pthread_t threads[MAX_THREADS];
+    struct query q;
+    char** names;
+    size_t nsegments, i;
+    int opt, t;
+
+    memset(&q, 0, sizeof(q));
+    q.start_us = 0;
+    q.end_us = INT64_MAX;
+    q.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    q.jobs = jobs;
+
+    while ((opt = getopt(argc, argv, "z:s:e:b:j:w:")) != -1) {
+        switch (opt) {
+        case 'z':
+            q.zone = atoi(optarg);
+            break;
+        case 's':
+            if (parse_time(optarg, &q.start_us) < 0) {
+                printf("can't parse start time %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (parse_time(optarg, &q.end_us) < 0) {
+                printf("can't parse end time %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (parse_duration(optarg, &q.bucket_us) < 0) {
+                printf("can't parse bucket size %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            q.threads = atoi(optarg);
+            break;
+        case 'w':
+            q.watts = strtod(optarg, NULL);
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind != 1) {
+        printf("Incorrect call to tsquery. The correct format is\n");
+        printf("\t./tsquery [-z zone] [-s start] [-e end] [-b bucket] "
+               "[-w heater_watts] [-j threads] log_dir\n");
+        printf("where start and end are @unix_seconds, YYYY-MM-DD[ HH:MM[:SS]]"
+               " or HH:MM[:SS]\n");
+        printf("and bucket is a duration such as 500ms, 10s, 5m or 1h\n");
+        return 1;
+    }
+    q.dir = argv[optind];
+    q.threads = q.threads < 1 ? 1 : q.threads > MAX_THREADS ? MAX_THREADS
+                                                            : q.threads;
+
+    if (list_segments(q.dir, &names, &nsegments) < 0) {
+        return 2;
+    }
+    if (nsegments == 0) {
+        printf("no block segments found in %s\n", q.dir);
+        return 2;
+    }
+
+    // the main thread decodes alongside the workers
+    if (q.threads > 1) {
+        pthread_barrier_init(&q.start, NULL, q.threads);
+        pthread_barrier_init(&q.done, NULL, q.threads);
+        for (t = 0; t < q.threads - 1; t++) {
+            pthread_create(&threads[t], NULL, worker, &q);
+        }
+    }
+
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    if (q.bucket_us == 0) {
+        printf("time,zone,temp,raw,heater\n");
+    } else {
+        printf("time,count,min,max,mean,duty%s\n",
+               q.watts > 0 ? ",energy_j" : "");
+    }
+    for (i = 0; i < nsegments; i++) {
+        scan_segment(&q, names[i]);
+        free(names[i]);
+    }
+    free(names);
+    if (q.open.count > 0) {
+        print_bucket(&q, &q.open);
+    }
+    fflush(stdout);
+
+    if (q.threads > 1) {
+        q.quit = 1;
+        pthread_barrier_wait(&q.start);
+        for (t = 0; t < q.threads - 1; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    fprintf(stderr, "%llu samples, %llu corrupt blocks skipped\n",
+            (unsigned long long)q.samples, (unsigned long long)q.corrupt);
+    return 0;
+}